@@ -0,0 +1,35 @@
+#include "Memory.h"
+#include "StaticTranslator.h"
+
+#include <fstream>
+#include <vector>
+#include <cstdio>
+
+// Translates a guest ELF into C++ source, see StaticTranslator.h:
+//     riscv_aot program.riscv program.cpp
+//     c++ -O2 -I src program.cpp -o program
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <elf> <output.cpp>\n", argv[0]);
+        return 1;
+    }
+
+    Memory mem;
+    std::vector<Memory::Segment> segments;
+    if (!mem.LoadElf(argv[1], &segments))
+        return 1;
+
+    std::ofstream out(argv[2]);
+    if (!out)
+    {
+        fprintf(stderr, "ERROR: failed opening \"%s\"\n", argv[2]);
+        return 1;
+    }
+
+    StaticTranslator translator{mem, segments};
+    translator.Translate(out, 0x200, argv[1]);
+    fprintf(stderr, "%zu blocks\n", translator.Blocks().size());
+    return out ? 0 : 1;
+}
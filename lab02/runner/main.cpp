@@ -0,0 +1,76 @@
+#include "TestRunner.h"
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <filesystem>
+
+// Runs guest programs in parallel inside one process, see TestRunner.h:
+//     riscv_runner programs/build/assembly/bin
+//     riscv_runner --jobs=4 --limit=1000000 add.riscv sub.riscv
+// Prints one line per program, the output of failed ones and a summary.
+// Exits with 0 if every program passed.
+int main(int argc, char** argv)
+{
+    Word jitThreshold = 0;
+    Word limit = 0;
+    unsigned jobs = 0;
+    bool verbose = false;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--jit") == 0)
+            jitThreshold = jitThreshold ? jitThreshold : 16;
+        else if (std::strncmp(argv[i], "--jit-threshold=", 16) == 0)
+            jitThreshold = std::strtoul(argv[i] + 16, nullptr, 10);
+        else if (std::strncmp(argv[i], "--limit=", 8) == 0)
+            limit = std::strtoul(argv[i] + 8, nullptr, 10);
+        else if (std::strncmp(argv[i], "--jobs=", 7) == 0)
+            jobs = std::strtoul(argv[i] + 7, nullptr, 10);
+        else if (std::strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (argv[i][0] != '-')
+        {
+            std::vector<std::string> files = TestRunner::Collect(argv[i]);
+            paths.insert(paths.end(), files.begin(), files.end());
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--jit] [--jit-threshold=N] [--limit=N] [--jobs=N] [-v] "
+                            "<elf or directory>...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (paths.empty())
+    {
+        fprintf(stderr, "ERROR: no programs to run\n");
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<TestResult> results = TestRunner{jitThreshold, limit}.RunAll(paths, jobs);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t passed = 0;
+    for (const TestResult& result : results)
+    {
+        const char* status = "ERROR";
+        switch (result.status)
+        {
+            case TestResult::Status::Passed: status = "PASSED"; passed++; break;
+            case TestResult::Status::Failed: status = "FAILED"; break;
+            case TestResult::Status::Timeout: status = "TIMEOUT"; break;
+            case TestResult::Status::Error: status = "ERROR"; break;
+        }
+        std::string name = std::filesystem::path(result.path).stem().string();
+        printf("%-8s %-16s exit=%-4d instret=%-10u %8.3f ms\n",
+               status, name.c_str(), result.exitCode, result.instret, result.seconds * 1e3);
+        if (verbose || result.status != TestResult::Status::Passed)
+            fputs(result.output.c_str(), stdout);
+    }
+    printf("%zu/%zu passed in %.3f ms\n", passed, results.size(), seconds * 1e3);
+    return passed == results.size() ? 0 : 1;
+}
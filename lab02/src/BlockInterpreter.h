@@ -0,0 +1,647 @@
+#ifndef RISCV_SIM_BLOCKINTERPRETER_H
+#define RISCV_SIM_BLOCKINTERPRETER_H
+
+#include <array>
+#include <vector>
+#include <algorithm>
+
+#include "Instruction.h"
+#include "Executor.h"
+#include "DecodeCache.h"
+#include "Memory.h"
+#include "TimingModel.h"
+
+// Threaded-code interpreter. Guest code is split into basic blocks ending with
+// a branch or jump, each block is translated once into an array of handler
+// pointers with operands already extracted, and then runs without going
+// through Decoder, RegisterFile or CsrFile for every instruction.
+//
+// CSR accesses and unsupported instructions are never put into a block, the
+// block ends right before them and Cpu executes them with ProcessInstruction.
+//
+// Common compiler idioms spanning two instructions (lui + addi, auipc + jalr,
+// slt + bne/beq, addi + lw) are fused into a single op at translation time.
+// Both instructions still count for instret.
+//
+// With tracing on, blocks also record their memory accesses and a static
+// profile into a BlockTrace for timing models.
+class BlockInterpreter
+{
+public:
+    static constexpr Word maxBlockLength = 64;
+
+    BlockInterpreter(Memory& mem, DecodeCache& decodeCache)
+        : _mem(mem), _decodeCache(decodeCache), _blocks(size)
+    {
+
+    }
+
+    // Runs the block starting at ip and moves ip past it.
+    // Returns the number of guest instructions executed, 0 if the instruction
+    // at ip has to be executed by ProcessInstruction.
+    Word Execute(Word& ip, std::array<Word, 32>& regs, BlockTrace* trace = nullptr)
+    {
+        if (_generation != _decodeCache.Generation())
+        {
+            Clear();
+            _generation = _decodeCache.Generation();
+        }
+
+        const Block& block = GetBlock(ip);
+        if (block.ops.empty())
+            return 0;
+
+        State state{regs.data(), _mem, _decodeCache, ip, false, 0, trace};
+        if (trace)
+            trace->accessCount = 0;
+        const Op* op = block.ops.data();
+        while (op)
+            op = op->handler(state, op);
+
+        Word count = state.codeWritten ? (state.nextIp - ip) / 4 : block.count;
+        if (trace)
+        {
+            trace->start = ip;
+            trace->count = count;
+            trace->nextIp = state.nextIp;
+            trace->profile = block.profile;
+        }
+        ip = state.nextIp;
+        if (state.codeWritten)
+        {
+            // The block stopped right after the store, stale translations
+            // are dropped on the next call
+            _decodeCache.Invalidate(state.storeAddr);
+        }
+        return count;
+    }
+
+    void Clear()
+    {
+        for (auto& block : _blocks)
+            block.start = invalidIp;
+    }
+
+    // Blocks translated from now on fill the trace passed to Execute,
+    // which then must not be nullptr
+    void SetTracing(bool tracing)
+    {
+        if (tracing != _tracing)
+            Clear();
+        _tracing = tracing;
+    }
+
+private:
+    struct State;
+    struct Op;
+
+    // Returns the next handler to run or nullptr when the block is done
+    using Handler = const Op* (*)(State& state, const Op* op);
+
+    struct Op
+    {
+        Handler handler;
+        Word imm;
+        Word ip;
+        uint8_t rd;
+        uint8_t rs1;
+        uint8_t rs2;
+        Word imm2 = 0; // second constant of fused ops
+    };
+
+    struct State
+    {
+        Word* r;
+        Memory& mem;
+        DecodeCache& decodeCache;
+        Word nextIp;
+        bool codeWritten;
+        Word storeAddr;
+        BlockTrace* trace;
+    };
+
+    struct Block
+    {
+        Word start = invalidIp;
+        Word count = 0;
+        std::vector<Op> ops;
+        BlockTrace::Profile profile;
+    };
+
+    static constexpr Word invalidIp = ~0u;
+    static constexpr size_t size = 4096; // number of cached blocks, power of two
+    static_assert(maxBlockLength <= BlockTrace::maxAccesses);
+
+    const Block& GetBlock(Word ip)
+    {
+        Block& block = _blocks[(ip >> 2u) & (size - 1)];
+        if (block.start != ip)
+            Translate(block, ip);
+        return block;
+    }
+
+    void Translate(Block& block, Word start)
+    {
+        block.start = start;
+        block.count = 0;
+        block.ops.clear();
+        block.profile = BlockTrace::Profile{};
+
+        Word ip = start;
+        DecodedInstruction prev;
+        bool canFuse = false;
+        bool ended = false;
+        Chains chains;
+        while (block.count < maxBlockLength && !ended)
+        {
+            const DecodedInstruction& instr = _decodeCache.Fetch(_mem, ip);
+            if (!IsTranslatable(instr))
+                break;
+            if (_tracing)
+                Profile(block.profile, chains, instr, ip);
+
+            if (canFuse && Fuse(block.ops.back(), prev, instr))
+                canFuse = false;
+            else
+            {
+                block.ops.push_back(Translate(instr, ip));
+                prev = instr;
+                canFuse = true;
+            }
+            block.count++;
+            ip += 4;
+            ended = IsBlockEnd(instr);
+        }
+
+        if (block.count != 0 && !ended)
+            block.ops.push_back(Op{FallThrough, 0, ip, 0, 0, 0});
+        if (!_tracing)
+            return;
+
+        block.profile.recurrence = chains.Recurrence();
+        for (Op& op : block.ops)
+        {
+            if (op.handler == Load)
+                op.handler = TracedLoad;
+            else if (op.handler == Store)
+                op.handler = TracedStore;
+            else if (op.handler == AddLoad)
+                op.handler = TracedAddLoad;
+            else if (op.handler == DiscardLoad)
+                op.handler = TracedDiscardLoad;
+        }
+    }
+
+    // Longest dependence chains through registers inside a block: chain[r][s]
+    // is the number of instructions from the value s has at the block entry
+    // to the value r has now, -1 if r doesn't depend on it
+    class Chains
+    {
+    public:
+        Chains()
+        {
+            for (int r = 0; r < 32; r++)
+                for (int s = 0; s < 32; s++)
+                    _chain[r][s] = r == s && r != 0 ? 0 : -1;
+        }
+
+        void Add(const DecodedInstruction& instr)
+        {
+            if (instr._dst == 0)
+                return;
+            int8_t chain[32];
+            for (int s = 0; s < 32; s++)
+            {
+                int8_t longest = -1;
+                if (instr.Has(Instruction::Src1))
+                    longest = std::max(longest, _chain[instr._src1][s]);
+                if (instr.Has(Instruction::Src2))
+                    longest = std::max(longest, _chain[instr._src2][s]);
+                chain[s] = longest < 0 ? -1 : int8_t(longest + 1);
+            }
+            std::copy(chain, chain + 32, _chain[instr._dst]);
+            _depth[instr._dst] = Word(Depth(instr) + 1);
+            _written[instr._dst] = _count + 1;
+        }
+
+        void Next()
+        {
+            _count++;
+        }
+
+        // Instructions of the block instr has to wait for
+        Word Depth(const DecodedInstruction& instr) const
+        {
+            Word depth = 0;
+            if (instr.Has(Instruction::Src1))
+                depth = _depth[instr._src1];
+            if (instr.Has(Instruction::Src2))
+                depth = std::max(depth, _depth[instr._src2]);
+            return depth;
+        }
+
+        // Instructions from the last one in the block instr depends on to
+        // instr, 0 if none
+        Word Distance(const DecodedInstruction& instr) const
+        {
+            Word written = 0;
+            if (instr.Has(Instruction::Src1))
+                written = _written[instr._src1];
+            if (instr.Has(Instruction::Src2))
+                written = std::max(written, _written[instr._src2]);
+            return written ? _count + 1 - written : 0;
+        }
+
+        // What a loop over the block can't overlap between iterations
+        Word Recurrence() const
+        {
+            int8_t longest = 0;
+            for (int r = 1; r < 32; r++)
+                longest = std::max(longest, _chain[r][r]);
+            return Word(longest);
+        }
+
+    private:
+        int8_t _chain[32][32];
+        Word _depth[32] = {};
+        Word _written[32] = {}; // 1 + the index of the last write, 0 for none
+        Word _count = 0;
+    };
+
+    static void Profile(BlockTrace::Profile& profile, Chains& chains, const DecodedInstruction& instr, Word ip)
+    {
+        profile.length++;
+        if (instr._type == IType::Alu && instr._aluFunc >= AluFunc::Mul && instr._aluFunc < AluFunc::Div)
+            profile.multiplies++;
+        if (instr._type == IType::Alu && instr._aluFunc >= AluFunc::Div && instr._aluFunc < AluFunc::None)
+            profile.divides++;
+        if (IsBlockEnd(instr))
+        {
+            profile.last = instr;
+            profile.lastIp = ip;
+            profile.resolveDepth = chains.Depth(instr);
+            profile.resolveDistance = chains.Distance(instr);
+        }
+        chains.Add(instr);
+        chains.Next();
+    }
+
+    static bool IsTranslatable(const DecodedInstruction& instr)
+    {
+        switch (instr._type)
+        {
+            case IType::Alu:
+            case IType::Ld:
+            case IType::St:
+            case IType::J:
+            case IType::Jr:
+            case IType::Br:
+            case IType::Auipc:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool IsBlockEnd(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::Br || instr._type == IType::J || instr._type == IType::Jr;
+    }
+
+    static Op Translate(const DecodedInstruction& instr, Word ip)
+    {
+        Op op{nullptr, instr._imm, ip, uint8_t(instr._dst), uint8_t(instr._src1), uint8_t(instr._src2)};
+        switch (instr._type)
+        {
+            case IType::Alu:
+                if (instr._dst == 0)
+                    op.handler = Nop;
+                else if (!instr.Has(Instruction::Imm))
+                    op.handler = aluReg[Index(instr._aluFunc)];
+                else if (instr._src1 == 0)
+                {
+                    // lui and friends: the result is known at translation time
+                    op.imm = Executor::GetOperation[Index(instr._aluFunc)](0, instr._imm);
+                    op.handler = LoadConst;
+                }
+                else
+                    op.handler = aluImm[Index(instr._aluFunc)];
+                break;
+            case IType::Auipc:
+                op.imm = ip + instr._imm;
+                op.handler = instr._dst == 0 ? Nop : LoadConst;
+                break;
+            case IType::Ld:
+                op.handler = instr._dst == 0 ? DiscardLoad : Load;
+                break;
+            case IType::St:
+                op.handler = Store;
+                break;
+            case IType::J:
+                op.imm = ip + instr._imm;
+                op.handler = Jal;
+                break;
+            case IType::Jr:
+                op.handler = Jalr;
+                break;
+            case IType::Br:
+                op.imm = ip + instr._imm;
+                op.handler = branch[Index(instr._brFunc)];
+                break;
+            default:
+                break;
+        }
+        return op;
+    }
+
+    static bool IsAddi(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::Alu && instr._aluFunc == AluFunc::Add && instr.Has(Instruction::Imm);
+    }
+
+    // Turns op, the translation of first, into a single op doing both first
+    // and second, which directly follows it. Returns false if they don't fuse.
+    static bool Fuse(Op& op, const DecodedInstruction& first, const DecodedInstruction& second)
+    {
+        if (first._dst == 0)
+            return false;
+
+        // lui rd, hi; addi rd, rd, lo (auipc works the same)
+        if (op.handler == LoadConst && IsAddi(second) &&
+            second._src1 == first._dst && second._dst == first._dst)
+        {
+            op.imm += second._imm;
+            return true;
+        }
+
+        // auipc rd, hi; jalr rd2, lo(rd)
+        if (first._type == IType::Auipc && second._type == IType::Jr && second._src1 == first._dst)
+        {
+            op.handler = FarJump;
+            op.imm2 = op.imm + second._imm;
+            op.rs2 = second._dst;
+            return true;
+        }
+
+        // slt(i)(u) rd, ...; bne/beq rd, x0
+        bool sltFunc = first._aluFunc == AluFunc::Slt || first._aluFunc == AluFunc::Sltu;
+        bool branchOnDst = (second._src1 == first._dst && second._src2 == 0) ||
+                           (second._src1 == 0 && second._src2 == first._dst);
+        if (first._type == IType::Alu && sltFunc && second._type == IType::Br && branchOnDst &&
+            (second._brFunc == BrFunc::Neq || second._brFunc == BrFunc::Eq))
+        {
+            bool imm = first.Has(Instruction::Imm);
+            bool taken = second._brFunc == BrFunc::Neq;
+            if (first._aluFunc == AluFunc::Slt)
+                op.handler = imm ? (taken ? SetBranch<Executor::GetSlt, true, true> : SetBranch<Executor::GetSlt, true, false>)
+                                 : (taken ? SetBranch<Executor::GetSlt, false, true> : SetBranch<Executor::GetSlt, false, false>);
+            else
+                op.handler = imm ? (taken ? SetBranch<Executor::GetSltu, true, true> : SetBranch<Executor::GetSltu, true, false>)
+                                 : (taken ? SetBranch<Executor::GetSltu, false, true> : SetBranch<Executor::GetSltu, false, false>);
+            op.imm = first._imm; // slti with x0 was folded into a constant
+            op.imm2 = op.ip + 4 + second._imm;
+            return true;
+        }
+
+        // addi rd, rs, k; lw rd2, off(rd)
+        if (op.handler == aluImm[Index(AluFunc::Add)] && second._type == IType::Ld &&
+            second._src1 == first._dst && second._dst != 0)
+        {
+            op.handler = AddLoad;
+            op.imm2 = second._imm;
+            op.rs2 = second._dst;
+            return true;
+        }
+        return false;
+    }
+
+    template<typename Enum>
+    static constexpr size_t Index(Enum value)
+    {
+        return static_cast<size_t>(value);
+    }
+
+    static const Op* Nop(State& s, const Op* op)
+    {
+        return op + 1;
+    }
+
+    static const Op* FallThrough(State& s, const Op* op)
+    {
+        s.nextIp = op->ip;
+        return nullptr;
+    }
+
+    template<Word (*Operation)(Word, Word)>
+    static const Op* AluReg(State& s, const Op* op)
+    {
+        s.r[op->rd] = Operation(s.r[op->rs1], s.r[op->rs2]);
+        return op + 1;
+    }
+
+    template<Word (*Operation)(Word, Word)>
+    static const Op* AluImm(State& s, const Op* op)
+    {
+        s.r[op->rd] = Operation(s.r[op->rs1], op->imm);
+        return op + 1;
+    }
+
+    static const Op* LoadConst(State& s, const Op* op)
+    {
+        s.r[op->rd] = op->imm;
+        return op + 1;
+    }
+
+    static const Op* Load(State& s, const Op* op)
+    {
+        s.r[op->rd] = s.mem.Request(s.r[op->rs1] + op->imm);
+        return op + 1;
+    }
+
+    // A load into x0 only matters to the trace
+    static const Op* DiscardLoad(State& s, const Op* op)
+    {
+        return op + 1;
+    }
+
+    // Memory ops of traced blocks record the access first
+    static void Record(State& s, Word addr, bool write)
+    {
+        s.trace->accesses[s.trace->accessCount++] = BlockTrace::Access{addr, write};
+    }
+
+    static const Op* TracedLoad(State& s, const Op* op)
+    {
+        Record(s, s.r[op->rs1] + op->imm, false);
+        return Load(s, op);
+    }
+
+    static const Op* TracedStore(State& s, const Op* op)
+    {
+        Record(s, s.r[op->rs1] + op->imm, true);
+        return Store(s, op);
+    }
+
+    static const Op* TracedDiscardLoad(State& s, const Op* op)
+    {
+        Record(s, s.r[op->rs1] + op->imm, false);
+        return op + 1;
+    }
+
+    static const Op* TracedAddLoad(State& s, const Op* op)
+    {
+        Record(s, s.r[op->rs1] + op->imm + op->imm2, false);
+        return AddLoad(s, op);
+    }
+
+    static const Op* Store(State& s, const Op* op)
+    {
+        Word addr = s.r[op->rs1] + op->imm;
+        s.mem.Store(addr, s.r[op->rs2]);
+        if (!s.decodeCache.MayContain(addr))
+            return op + 1;
+
+        s.codeWritten = true;
+        s.storeAddr = addr;
+        s.nextIp = op->ip + 4;
+        return nullptr;
+    }
+
+    static const Op* Jal(State& s, const Op* op)
+    {
+        if (op->rd != 0)
+            s.r[op->rd] = op->ip + 4;
+        s.nextIp = op->imm;
+        return nullptr;
+    }
+
+    static const Op* Jalr(State& s, const Op* op)
+    {
+        Word target = s.r[op->rs1] + op->imm;
+        if (op->rd != 0)
+            s.r[op->rd] = op->ip + 4;
+        s.nextIp = target;
+        return nullptr;
+    }
+
+    // Fused ops, the second instruction is at op->ip + 4
+
+    // r[rd] = auipc result, r[rs2] = link, jump to imm2
+    static const Op* FarJump(State& s, const Op* op)
+    {
+        s.r[op->rd] = op->imm;
+        if (op->rs2 != 0)
+            s.r[op->rs2] = op->ip + 8;
+        s.nextIp = op->imm2;
+        return nullptr;
+    }
+
+    // r[rd] = set-less-than result, branch to imm2 if it is (not) zero
+    template<Word (*Operation)(Word, Word), bool Imm, bool TakenIfSet>
+    static const Op* SetBranch(State& s, const Op* op)
+    {
+        Word res = Operation(s.r[op->rs1], Imm ? op->imm : s.r[op->rs2]);
+        s.r[op->rd] = res;
+        s.nextIp = (res != 0) == TakenIfSet ? op->imm2 : op->ip + 8;
+        return nullptr;
+    }
+
+    // r[rd] = r[rs1] + imm, r[rs2] = load from r[rd] + imm2
+    static const Op* AddLoad(State& s, const Op* op)
+    {
+        Word base = s.r[op->rs1] + op->imm;
+        s.r[op->rd] = base;
+        s.r[op->rs2] = s.mem.Request(base + op->imm2);
+        return op + 1;
+    }
+
+    template<bool (*Condition)(Word, Word)>
+    static const Op* Branch(State& s, const Op* op)
+    {
+        s.nextIp = Condition(s.r[op->rs1], s.r[op->rs2]) ? op->imm : op->ip + 4;
+        return nullptr;
+    }
+
+    static bool Eq(Word first, Word second) { return first == second; }
+    static bool Neq(Word first, Word second) { return first != second; }
+    static bool Lt(Word first, Word second) { return Executor::GetSlt(first, second); }
+    static bool Ge(Word first, Word second) { return !Executor::GetSlt(first, second); }
+    static bool Ltu(Word first, Word second) { return first < second; }
+    static bool Geu(Word first, Word second) { return first >= second; }
+    static bool Always(Word first, Word second) { return true; }
+    static bool Never(Word first, Word second) { return false; }
+
+    static const Op* Unreachable(State& s, const Op* op)
+    {
+        throw std::invalid_argument("Unsupported ALU function");
+    }
+
+    // Handler tables indexed by the enum values, in the same order as in Executor
+
+    static constexpr std::array<Handler, 20> aluReg = {
+                AluReg<Executor::GetAdd>,
+                AluReg<Executor::GetSll>,
+                AluReg<Executor::GetSlt>,
+                AluReg<Executor::GetSltu>,
+                AluReg<Executor::GetXor>,
+                Unreachable,
+                AluReg<Executor::GetOr>,
+                AluReg<Executor::GetAnd>,
+                AluReg<Executor::GetSub>,
+                AluReg<Executor::GetSra>,
+                AluReg<Executor::GetSrl>,
+                AluReg<Executor::GetMul>,
+                AluReg<Executor::GetMulh>,
+                AluReg<Executor::GetMulhsu>,
+                AluReg<Executor::GetMulhu>,
+                AluReg<Executor::GetDiv>,
+                AluReg<Executor::GetDivu>,
+                AluReg<Executor::GetRem>,
+                AluReg<Executor::GetRemu>,
+                Unreachable
+            };
+
+    static constexpr std::array<Handler, 20> aluImm = {
+                AluImm<Executor::GetAdd>,
+                AluImm<Executor::GetSll>,
+                AluImm<Executor::GetSlt>,
+                AluImm<Executor::GetSltu>,
+                AluImm<Executor::GetXor>,
+                Unreachable,
+                AluImm<Executor::GetOr>,
+                AluImm<Executor::GetAnd>,
+                AluImm<Executor::GetSub>,
+                AluImm<Executor::GetSra>,
+                AluImm<Executor::GetSrl>,
+                Unreachable, // M instructions have no immediate form
+                Unreachable,
+                Unreachable,
+                Unreachable,
+                Unreachable,
+                Unreachable,
+                Unreachable,
+                Unreachable,
+                Unreachable
+            };
+
+    static constexpr std::array<Handler, 10> branch = {
+                Branch<Eq>,
+                Branch<Neq>,
+                Branch<Never>,
+                Branch<Never>,
+                Branch<Lt>,
+                Branch<Ge>,
+                Branch<Ltu>,
+                Branch<Geu>,
+                Branch<Always>,
+                Branch<Never>
+            };
+
+    Memory& _mem;
+    DecodeCache& _decodeCache;
+    Word _generation = 0;
+    bool _tracing = false;
+    std::vector<Block> _blocks;
+};
+
+#endif //RISCV_SIM_BLOCKINTERPRETER_H
@@ -0,0 +1,619 @@
+#ifndef RISCV_SIM_BRANCHPREDICTOR_H
+#define RISCV_SIM_BRANCHPREDICTOR_H
+
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+#include "Instruction.h"
+#include "OptionList.h"
+
+// Direction predictors of conditional branches. Predict and Update come in
+// pairs for the same branch, nothing else runs in between.
+class DirectionPredictor
+{
+public:
+    virtual ~DirectionPredictor() = default;
+
+    virtual bool Predict(Word ip) = 0;
+    virtual void Update(Word ip, bool taken) = 0;
+
+protected:
+    // Two bit saturating counters, 2 and 3 predict taken
+    static bool IsTaken(uint8_t counter)
+    {
+        return counter >= 2;
+    }
+
+    static void Train(uint8_t& counter, bool taken)
+    {
+        if (taken && counter < 3)
+            counter++;
+        else if (!taken && counter > 0)
+            counter--;
+    }
+
+    static Word Mask(Word bits)
+    {
+        return bits >= 32 ? ~0u : (1u << bits) - 1;
+    }
+};
+
+// A table of counters indexed by the branch address
+class BimodalPredictor : public DirectionPredictor
+{
+public:
+    explicit BimodalPredictor(Word bits)
+        : _mask(Mask(bits)), _counters(size_t(_mask) + 1, 1)
+    {
+
+    }
+
+    bool Predict(Word ip) override
+    {
+        return IsTaken(_counters[ip >> 2u & _mask]);
+    }
+
+    void Update(Word ip, bool taken) override
+    {
+        Train(_counters[ip >> 2u & _mask], taken);
+    }
+
+private:
+    Word _mask;
+    std::vector<uint8_t> _counters;
+};
+
+// Counters indexed by the branch address xor the global history
+class GsharePredictor : public DirectionPredictor
+{
+public:
+    GsharePredictor(Word bits, Word historyBits)
+        : _mask(Mask(bits)), _historyMask(Mask(historyBits)), _counters(size_t(_mask) + 1, 1)
+    {
+
+    }
+
+    bool Predict(Word ip) override
+    {
+        return IsTaken(_counters[Index(ip)]);
+    }
+
+    void Update(Word ip, bool taken) override
+    {
+        Train(_counters[Index(ip)], taken);
+        _history = (_history << 1u | taken) & _historyMask;
+    }
+
+private:
+    Word Index(Word ip) const
+    {
+        return (ip >> 2u ^ _history) & _mask;
+    }
+
+    Word _mask;
+    Word _historyMask;
+    Word _history = 0;
+    std::vector<uint8_t> _counters;
+};
+
+// Bimodal and gshare with a per-branch chooser between them, trained only
+// when they disagree
+class TournamentPredictor : public DirectionPredictor
+{
+public:
+    TournamentPredictor(Word bits, Word historyBits)
+        : _bimodal(bits), _gshare(bits, historyBits), _mask(Mask(bits)), _chooser(size_t(_mask) + 1, 2)
+    {
+
+    }
+
+    bool Predict(Word ip) override
+    {
+        bool global = _gshare.Predict(ip);
+        bool local = _bimodal.Predict(ip);
+        return IsTaken(_chooser[ip >> 2u & _mask]) ? global : local;
+    }
+
+    void Update(Word ip, bool taken) override
+    {
+        bool global = _gshare.Predict(ip);
+        bool local = _bimodal.Predict(ip);
+        if (global != local)
+            Train(_chooser[ip >> 2u & _mask], global == taken);
+        _gshare.Update(ip, taken);
+        _bimodal.Update(ip, taken);
+    }
+
+private:
+    BimodalPredictor _bimodal;
+    GsharePredictor _gshare;
+    Word _mask;
+    std::vector<uint8_t> _chooser;
+};
+
+// TAGE without the alternate prediction and the periodic usefulness reset:
+// a bimodal base and tagged tables with history lengths 4, 8, 16 and 32.
+// The longest matching table provides the prediction, a misprediction
+// allocates an entry in a longer table.
+class TagePredictor : public DirectionPredictor
+{
+public:
+    explicit TagePredictor(Word bits)
+        : _base(bits), _tableBits(std::max(bits, 6u) - 2)
+    {
+        for (Table& table : _tables)
+            table.entries.resize(size_t(1) << _tableBits);
+    }
+
+    bool Predict(Word ip) override
+    {
+        int provider = Provider(ip);
+        if (provider < 0)
+            return _base.Predict(ip);
+        return Find(provider, ip).counter >= 4;
+    }
+
+    void Update(Word ip, bool taken) override
+    {
+        int provider = Provider(ip);
+        bool predicted;
+        if (provider < 0)
+        {
+            predicted = _base.Predict(ip);
+            _base.Update(ip, taken);
+        }
+        else
+        {
+            Entry& entry = Find(provider, ip);
+            predicted = entry.counter >= 4;
+            if (taken && entry.counter < 7)
+                entry.counter++;
+            else if (!taken && entry.counter > 0)
+                entry.counter--;
+            if (predicted == taken && entry.useful < 3)
+                entry.useful++;
+            else if (predicted != taken && entry.useful > 0)
+                entry.useful--;
+        }
+
+        if (predicted != taken)
+            Allocate(provider + 1, ip, taken);
+        _history = _history << 1u | taken;
+    }
+
+private:
+    struct Entry
+    {
+        uint16_t tag = 0;
+        uint8_t counter = 3; // three bits, 4..7 predict taken
+        uint8_t useful = 0;
+        bool valid = false;
+    };
+
+    struct Table
+    {
+        Word historyLength;
+        std::vector<Entry> entries;
+    };
+
+    static constexpr Word tagBits = 9;
+
+    // Folds the newest length bits of the history into bits bits
+    Word Fold(Word length, Word bits) const
+    {
+        uint64_t history = length >= 64 ? _history : _history & ((uint64_t(1) << length) - 1);
+        Word folded = 0;
+        for (; history; history >>= bits)
+            folded ^= Word(history) & Mask(bits);
+        return folded;
+    }
+
+    Word Index(int table, Word ip) const
+    {
+        return (ip >> 2u ^ ip >> (2u + _tableBits) ^ Fold(_tables[table].historyLength, _tableBits)) & Mask(_tableBits);
+    }
+
+    uint16_t Tag(int table, Word ip) const
+    {
+        return uint16_t((ip >> 2u ^ Fold(_tables[table].historyLength, tagBits) * 3u) & Mask(tagBits));
+    }
+
+    Entry& Find(int table, Word ip)
+    {
+        return _tables[table].entries[Index(table, ip)];
+    }
+
+    int Provider(Word ip)
+    {
+        for (int table = int(std::size(_tables)) - 1; table >= 0; table--)
+        {
+            const Entry& entry = Find(table, ip);
+            if (entry.valid && entry.tag == Tag(table, ip))
+                return table;
+        }
+        return -1;
+    }
+
+    // Takes the first entry that isn't useful, if all are they age instead
+    void Allocate(int from, Word ip, bool taken)
+    {
+        for (int table = from; table < int(std::size(_tables)); table++)
+        {
+            Entry& entry = Find(table, ip);
+            if (!entry.valid || entry.useful == 0)
+            {
+                entry = Entry{Tag(table, ip), uint8_t(taken ? 4 : 3), 0, true};
+                return;
+            }
+        }
+        for (int table = from; table < int(std::size(_tables)); table++)
+            Find(table, ip).useful--;
+    }
+
+    BimodalPredictor _base;
+    Word _tableBits;
+    Table _tables[4] = {{4, {}}, {8, {}}, {16, {}}, {32, {}}};
+    uint64_t _history = 0;
+};
+
+// Set-associative LRU table of taken targets
+class BranchTargetBuffer
+{
+public:
+    BranchTargetBuffer(Word entries, Word ways)
+        : _ways(ways), _sets(ways ? entries / ways : 0), _entries(size_t(_sets) * ways)
+    {
+
+    }
+
+    std::optional<Word> Lookup(Word ip)
+    {
+        if (_sets == 0)
+            return std::nullopt;
+        Entry* set = Set(ip);
+        for (Word way = 0; way < _ways; way++)
+        {
+            if (set[way].valid && set[way].ip == ip)
+            {
+                set[way].lastUse = ++_clock;
+                return set[way].target;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void Update(Word ip, Word target)
+    {
+        if (_sets == 0)
+            return;
+        Entry* set = Set(ip);
+        Entry* victim = set;
+        for (Word way = 0; way < _ways; way++)
+        {
+            if (set[way].valid && set[way].ip == ip)
+            {
+                victim = &set[way];
+                break;
+            }
+            if (!set[way].valid || (victim->valid && set[way].lastUse < victim->lastUse))
+                victim = &set[way];
+        }
+        *victim = Entry{ip, target, true, ++_clock};
+    }
+
+private:
+    struct Entry
+    {
+        Word ip = 0;
+        Word target = 0;
+        bool valid = false;
+        uint64_t lastUse = 0;
+    };
+
+    Entry* Set(Word ip)
+    {
+        return &_entries[size_t(ip >> 2u & (_sets - 1)) * _ways];
+    }
+
+    Word _ways;
+    Word _sets;
+    std::vector<Entry> _entries;
+    uint64_t _clock = 0;
+};
+
+// Return addresses of the calls in flight, on overflow the oldest is lost
+class ReturnAddressStack
+{
+public:
+    explicit ReturnAddressStack(Word depth)
+        : _stack(depth)
+    {
+
+    }
+
+    void Push(Word ip)
+    {
+        if (_stack.empty())
+            return;
+        _top = (_top + 1) % _stack.size();
+        _stack[_top] = ip;
+        _size = std::min<size_t>(_size + 1, _stack.size());
+    }
+
+    std::optional<Word> Pop()
+    {
+        if (_size == 0)
+            return std::nullopt;
+        Word ip = _stack[_top];
+        _top = (_top + _stack.size() - 1) % _stack.size();
+        _size--;
+        return ip;
+    }
+
+private:
+    std::vector<Word> _stack;
+    size_t _top = 0;
+    size_t _size = 0;
+};
+
+// Predicts the next pc of control transfers: conditional branches take the
+// direction predictor and the BTB, returns the RAS and other jumps the BTB.
+// Resolve is called once the instruction has executed and returns the
+// cycles lost to a misprediction.
+class BranchPredictor
+{
+public:
+    enum class Kind
+    {
+        Bimodal,
+        Gshare,
+        Tournament,
+        Tage,
+    };
+
+    struct Config
+    {
+        Kind kind = Kind::Gshare;
+        Word bits = 12;        // log2 of the counter tables
+        Word historyBits = 12; // global history of gshare and tournament
+        Word btbEntries = 512;
+        Word btbWays = 4;
+        Word rasDepth = 16;
+        Word penalty = 3;
+    };
+
+    enum Class
+    {
+        Branch,   // conditional
+        Jump,     // jal
+        Indirect, // jalr other than returns
+        Return,
+        Classes
+    };
+
+    struct Counter
+    {
+        uint64_t executed = 0;
+        uint64_t mispredicted = 0;
+    };
+
+    struct BranchStats
+    {
+        Class type = Branch;
+        uint64_t executed = 0;
+        uint64_t taken = 0;
+        uint64_t mispredicted = 0;
+    };
+
+    // "bht=bimodal|gshare|tournament|tage,bits=12,history=12,btb=512,btb-ways=4,ras=16,penalty=3",
+    // btb=0 or ras=0 leave them out. what names the predictor in errors.
+    static std::optional<Config> Parse(const std::string& text, const std::string& what)
+    {
+        OptionList options(text);
+        Config config;
+        config.bits = options.Get("bits", config.bits);
+        config.historyBits = options.Get("history", config.historyBits);
+        config.btbEntries = options.Get("btb", config.btbEntries);
+        config.btbWays = options.Get("btb-ways", config.btbWays);
+        config.rasDepth = options.Get("ras", config.rasDepth);
+        config.penalty = options.Get("penalty", config.penalty);
+        std::string bht = options.Get("bht", std::string("gshare"));
+
+        bool ok = options.Check(what);
+        if (bht == "bimodal")
+            config.kind = Kind::Bimodal;
+        else if (bht == "gshare")
+            config.kind = Kind::Gshare;
+        else if (bht == "tournament")
+            config.kind = Kind::Tournament;
+        else if (bht == "tage")
+            config.kind = Kind::Tage;
+        else
+            ok = OptionList::Error(what, "bht has to be bimodal, gshare, tournament or tage");
+
+        if (config.bits == 0 || config.bits > 24)
+            ok = OptionList::Error(what, "bits has to be between 1 and 24");
+        if (config.historyBits > 32)
+            ok = OptionList::Error(what, "history can't be longer than 32 bits");
+        if (config.btbEntries != 0 && (config.btbWays == 0 || config.btbEntries % config.btbWays != 0 ||
+                                       !IsPowerOfTwo(config.btbEntries / config.btbWays)))
+            ok = OptionList::Error(what, "btb / btb-ways has to be a power of two");
+
+        if (!ok)
+            return std::nullopt;
+        return config;
+    }
+
+    explicit BranchPredictor(const Config& config)
+        : _config(config),
+          _direction(MakeDirection(config)),
+          _btb(config.btbEntries, config.btbWays),
+          _ras(config.rasDepth)
+    {
+
+    }
+
+    // instr has executed at ip, returns the penalty if the predicted next
+    // pc differs from _nextIp, 0 for anything that isn't a control transfer
+    Word Resolve(const Instruction& instr, Word ip)
+    {
+        return Mispredicts(instr, ip) ? _config.penalty : 0;
+    }
+
+    // Same as Resolve for models that derive the penalty themselves
+    bool Mispredicts(const Instruction& instr, Word ip)
+    {
+        Class type;
+        Word predicted = ip + 4;
+        bool taken = instr._nextIp != ip + 4;
+        switch (instr._type)
+        {
+            case IType::Br:
+            {
+                type = Branch;
+                std::optional<Word> target = _btb.Lookup(ip);
+                if (_direction->Predict(ip) && target)
+                    predicted = target.value();
+                _direction->Update(ip, taken);
+                if (taken)
+                    _btb.Update(ip, instr._nextIp);
+                break;
+            }
+            case IType::J:
+            {
+                type = Jump;
+                predicted = _btb.Lookup(ip).value_or(ip + 4);
+                _btb.Update(ip, instr._nextIp);
+                if (IsLink(instr._dst))
+                    _ras.Push(ip + 4);
+                break;
+            }
+            case IType::Jr:
+            {
+                // The hints of the spec: a link in rd is a call, a link in
+                // rs1 a return unless it is the same register as rd
+                bool call = IsLink(instr._dst);
+                bool ret = IsLink(instr._src1) && !(call && instr._src1 == instr._dst);
+                std::optional<Word> target = ret ? _ras.Pop() : std::nullopt;
+                type = target ? Return : Indirect;
+                if (!target)
+                    target = _btb.Lookup(ip);
+                predicted = target.value_or(ip + 4);
+                if (!ret)
+                    _btb.Update(ip, instr._nextIp);
+                if (call)
+                    _ras.Push(ip + 4);
+                break;
+            }
+            default:
+                return false;
+        }
+
+        bool mispredicted = predicted != instr._nextIp;
+        _total[type].executed++;
+        _total[type].mispredicted += mispredicted;
+        BranchStats& branch = _branches[ip];
+        branch.type = type;
+        branch.executed++;
+        branch.taken += taken;
+        branch.mispredicted += mispredicted;
+        return mispredicted;
+    }
+
+    const Counter& GetStats(Class type) const
+    {
+        return _total[type];
+    }
+
+    const std::unordered_map<Word, BranchStats>& GetBranches() const
+    {
+        return _branches;
+    }
+
+    // Global and per class rates, then the branches that mispredict most
+    void Report(std::ostream& out, size_t worst = 10) const
+    {
+        static const char* const kinds[] = {"bimodal", "gshare", "tournament", "tage"};
+        static const char* const classes[] = {"branches", "jumps", "indirect", "returns"};
+        Counter all;
+        for (const Counter& counter : _total)
+        {
+            all.executed += counter.executed;
+            all.mispredicted += counter.mispredicted;
+        }
+        out << "bpred: " << kinds[int(_config.kind)] << " " << (1u << _config.bits) << " entries, btb "
+            << _config.btbEntries << "x" << _config.btbWays << ", ras " << _config.rasDepth
+            << ", penalty " << _config.penalty << "\n"
+            << "    control transfers " << all.executed << ", mispredicted " << all.mispredicted
+            << " (" << Rate(all) << "%)\n   ";
+        for (int type = 0; type < Classes; type++)
+            out << " " << classes[type] << " " << _total[type].mispredicted << "/" << _total[type].executed;
+        out << "\n";
+
+        std::vector<std::pair<Word, BranchStats>> branches(_branches.begin(), _branches.end());
+        std::sort(branches.begin(), branches.end(), [](const auto& left, const auto& right) {
+            if (left.second.mispredicted != right.second.mispredicted)
+                return left.second.mispredicted > right.second.mispredicted;
+            return left.first < right.first;
+        });
+        for (size_t i = 0; i < std::min(worst, branches.size()) && branches[i].second.mispredicted; i++)
+        {
+            const BranchStats& branch = branches[i].second;
+            out << "    0x" << std::hex << std::setw(8) << std::setfill('0') << branches[i].first
+                << std::dec << std::setfill(' ') << " " << classes[branch.type] << ": executed "
+                << branch.executed << ", taken " << branch.taken << ", mispredicted "
+                << branch.mispredicted << " (" << Rate(Counter{branch.executed, branch.mispredicted}) << "%)\n";
+        }
+    }
+
+private:
+    static bool IsLink(RId reg)
+    {
+        return reg == 1 || reg == 5;
+    }
+
+    static bool IsPowerOfTwo(Word value)
+    {
+        return value != 0 && (value & (value - 1)) == 0;
+    }
+
+    static std::string Rate(const Counter& counter)
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%.2f", counter.executed ? 100.0 * counter.mispredicted / counter.executed : 0.0);
+        return text;
+    }
+
+    static std::unique_ptr<DirectionPredictor> MakeDirection(const Config& config)
+    {
+        switch (config.kind)
+        {
+            case Kind::Bimodal:
+                return std::make_unique<BimodalPredictor>(config.bits);
+            case Kind::Tournament:
+                return std::make_unique<TournamentPredictor>(config.bits, config.historyBits);
+            case Kind::Tage:
+                return std::make_unique<TagePredictor>(config.bits);
+            case Kind::Gshare:
+            default:
+                return std::make_unique<GsharePredictor>(config.bits, config.historyBits);
+        }
+    }
+
+    Config _config;
+    std::unique_ptr<DirectionPredictor> _direction;
+    BranchTargetBuffer _btb;
+    ReturnAddressStack _ras;
+    Counter _total[Classes];
+    std::unordered_map<Word, BranchStats> _branches;
+};
+
+#endif //RISCV_SIM_BRANCHPREDICTOR_H
@@ -0,0 +1,266 @@
+#ifndef RISCV_SIM_CACHE_H
+#define RISCV_SIM_CACHE_H
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <optional>
+#include <iostream>
+#include <iomanip>
+
+#include "BaseTypes.h"
+#include "OptionList.h"
+
+// Timing model of one set-associative cache level. Only tags are kept,
+// data always comes from Memory, so the model can't change what the
+// program computes. Every access returns the cycles it adds.
+class Cache
+{
+public:
+    enum class Replacement
+    {
+        Lru,
+        Plru,   // tree pseudo-LRU
+        Random, // fixed seed, runs are reproducible
+    };
+
+    enum class WritePolicy
+    {
+        WriteBack,    // store misses allocate, dirty lines are written back on eviction
+        WriteThrough, // every store goes to memory through a write buffer, store misses don't allocate
+    };
+
+    struct Config
+    {
+        Word size = 8 * 1024;
+        Word lineSize = 32;
+        Word ways = 2;
+        Replacement replacement = Replacement::Lru;
+        WritePolicy writePolicy = WritePolicy::WriteBack;
+        Word missPenalty = 20;
+    };
+
+    struct Stats
+    {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t readMisses = 0;
+        uint64_t writeMisses = 0;
+        uint64_t evictions = 0;
+        uint64_t writebacks = 0;
+        uint64_t memoryWrites = 0; // words or lines sent to the next level
+    };
+
+    // "size=8k,line=32,ways=2,policy=lru|plru|random,write=back|through,penalty=20",
+    // missing keys keep their defaults. what names the cache in errors.
+    static std::optional<Config> Parse(const std::string& text, const std::string& what)
+    {
+        OptionList options(text);
+        Config config;
+        config.size = options.Get("size", config.size);
+        config.lineSize = options.Get("line", config.lineSize);
+        config.ways = options.Get("ways", config.ways);
+        config.missPenalty = options.Get("penalty", config.missPenalty);
+        std::string policy = options.Get("policy", std::string("lru"));
+        std::string write = options.Get("write", std::string("back"));
+
+        bool ok = options.Check(what);
+        if (policy == "lru")
+            config.replacement = Replacement::Lru;
+        else if (policy == "plru")
+            config.replacement = Replacement::Plru;
+        else if (policy == "random")
+            config.replacement = Replacement::Random;
+        else
+            ok = OptionList::Error(what, "policy has to be lru, plru or random");
+
+        if (write == "back")
+            config.writePolicy = WritePolicy::WriteBack;
+        else if (write == "through")
+            config.writePolicy = WritePolicy::WriteThrough;
+        else
+            ok = OptionList::Error(what, "write has to be back or through");
+
+        uint64_t setSize = uint64_t(config.lineSize) * config.ways;
+        if (!IsPowerOfTwo(config.lineSize) || config.lineSize < 4)
+            ok = OptionList::Error(what, "line has to be a power of two of at least 4 bytes");
+        else if (setSize == 0 || config.size % setSize != 0 || !IsPowerOfTwo(config.size / setSize))
+            ok = OptionList::Error(what, "size / (line * ways) has to be a power of two");
+        else if (config.replacement == Replacement::Plru && (!IsPowerOfTwo(config.ways) || config.ways > 64))
+            ok = OptionList::Error(what, "plru needs a power of two of at most 64 ways");
+
+        if (!ok)
+            return std::nullopt;
+        return config;
+    }
+
+    explicit Cache(const Config& config)
+        : _config(config),
+          _sets(config.size / (config.lineSize * config.ways)),
+          _lineBits(__builtin_ctz(config.lineSize)),
+          _lines(size_t(_sets) * config.ways),
+          _plru(config.replacement == Replacement::Plru ? _sets : 0)
+    {
+
+    }
+
+    // Returns the penalty cycles of the access, 0 on a hit
+    Word Access(Word addr, bool write)
+    {
+        Word lineAddr = addr >> _lineBits;
+        Word set = lineAddr & (_sets - 1);
+        Line* lines = &_lines[size_t(set) * _config.ways];
+        bool writeBack = _config.writePolicy == WritePolicy::WriteBack;
+        if (write)
+            _stats.writes++;
+        else
+            _stats.reads++;
+
+        for (Word way = 0; way < _config.ways; way++)
+        {
+            if (lines[way].valid && lines[way].tag == lineAddr)
+            {
+                Touch(set, way);
+                if (write && writeBack)
+                    lines[way].dirty = true;
+                else if (write)
+                    _stats.memoryWrites++;
+                return 0;
+            }
+        }
+
+        if (write)
+            _stats.writeMisses++;
+        else
+            _stats.readMisses++;
+        if (write && !writeBack)
+        {
+            _stats.memoryWrites++;
+            return 0;
+        }
+
+        Word way = Victim(set);
+        Line& line = lines[way];
+        if (line.valid)
+        {
+            _stats.evictions++;
+            if (line.dirty)
+            {
+                _stats.writebacks++;
+                _stats.memoryWrites++;
+            }
+        }
+        line = Line{lineAddr, true, write};
+        Touch(set, way);
+        return _config.missPenalty;
+    }
+
+    const Stats& GetStats() const
+    {
+        return _stats;
+    }
+
+    const Config& GetConfig() const
+    {
+        return _config;
+    }
+
+    void Report(std::ostream& out, const std::string& name) const
+    {
+        static const char* const policies[] = {"lru", "plru", "random"};
+        uint64_t accesses = _stats.reads + _stats.writes;
+        uint64_t misses = _stats.readMisses + _stats.writeMisses;
+        out << name << ": " << _config.size << " B, " << _config.lineSize << " B lines, "
+            << _config.ways << "-way " << policies[int(_config.replacement)] << ", write-"
+            << (_config.writePolicy == WritePolicy::WriteBack ? "back" : "through") << "\n"
+            << "    reads " << _stats.reads << " (" << _stats.readMisses << " misses), writes "
+            << _stats.writes << " (" << _stats.writeMisses << " misses), miss rate "
+            << std::fixed << std::setprecision(2) << (accesses ? 100.0 * misses / accesses : 0.0) << "%\n"
+            << "    evictions " << _stats.evictions << ", writebacks " << _stats.writebacks
+            << ", memory writes " << _stats.memoryWrites << "\n";
+    }
+
+private:
+    struct Line
+    {
+        Word tag = 0; // the whole line address
+        bool valid = false;
+        bool dirty = false;
+        uint64_t lastUse = 0;
+    };
+
+    static bool IsPowerOfTwo(Word value)
+    {
+        return value != 0 && (value & (value - 1)) == 0;
+    }
+
+    // The PLRU tree of a set has a bit per inner node, node n has children
+    // 2n and 2n + 1 and the bit points to the half to evict from next
+    void Touch(Word set, Word way)
+    {
+        Line& line = _lines[size_t(set) * _config.ways + way];
+        line.lastUse = ++_clock;
+        if (_config.replacement != Replacement::Plru)
+            return;
+
+        uint64_t& tree = _plru[set];
+        Word levels = __builtin_ctz(_config.ways);
+        Word node = 1;
+        for (Word level = levels; level-- > 0;)
+        {
+            Word bit = way >> level & 1u;
+            if (bit)
+                tree &= ~(uint64_t(1) << node);
+            else
+                tree |= uint64_t(1) << node;
+            node = node * 2 + bit;
+        }
+    }
+
+    Word Victim(Word set)
+    {
+        Line* lines = &_lines[size_t(set) * _config.ways];
+        for (Word way = 0; way < _config.ways; way++)
+            if (!lines[way].valid)
+                return way;
+
+        switch (_config.replacement)
+        {
+            case Replacement::Plru:
+            {
+                Word node = 1;
+                Word way = 0;
+                for (Word level = __builtin_ctz(_config.ways); level-- > 0;)
+                {
+                    Word bit = _plru[set] >> node & 1u;
+                    way = way * 2 + bit;
+                    node = node * 2 + bit;
+                }
+                return way;
+            }
+            case Replacement::Random:
+                return _random() % _config.ways;
+            case Replacement::Lru:
+            default:
+            {
+                Word victim = 0;
+                for (Word way = 1; way < _config.ways; way++)
+                    if (lines[way].lastUse < lines[victim].lastUse)
+                        victim = way;
+                return victim;
+            }
+        }
+    }
+
+    Config _config;
+    Word _sets;
+    Word _lineBits;
+    std::vector<Line> _lines;
+    std::vector<uint64_t> _plru;
+    uint64_t _clock = 0;
+    std::minstd_rand _random{1};
+    Stats _stats;
+};
+
+#endif //RISCV_SIM_CACHE_H
@@ -7,48 +7,238 @@
 #include "RegisterFile.h"
 #include "CsrFile.h"
 #include "Executor.h"
+#include "DecodeCache.h"
+#include "BlockInterpreter.h"
+#include "JitEngine.h"
+
+// Architectural state of the hart, saved in snapshots
+struct CpuState
+{
+    Word ip;
+    std::array<Word, 32> regs;
+    CsrFile::Counters counters;
+};
 
 class Cpu
 {
 public:
+    static constexpr Word maxBlockLength = BlockInterpreter::maxBlockLength;
+
     Cpu(Memory& mem)
-        : _mem(mem)
+        : _mem(mem), _blocks(mem, _decodeCache), _jit(mem, _decodeCache)
     {
 
     }
 
     void ProcessInstruction()
     {
-        auto instr = _decoder.Decode(_mem.Request(_ip));
+        Word ip = _ip;
+        Instruction instr;
+        Fetch(instr);
         _rf.Read(instr);
         _csrf.Read(instr);
 
         _exe.Execute(instr, _ip);
-        _mem.Request(instr);
+        if (instr._type == IType::Amo)
+            Atomic(instr);
+        else
+            _mem.Request(instr);
+        if (instr._type == IType::St || instr._type == IType::Amo)
+            _decodeCache.Invalidate(instr._addr);
         _rf.Write(instr);
         _csrf.Write(instr);
         _csrf.InstructionExecuted();
-        _ip = instr->_nextIp;
+        _ip = instr._nextIp;
+        if (_timing)
+            _timing->Retire(instr, ip);
+    }
+
+    // Executes compiled code if the JIT is on, otherwise a whole basic block
+    // with the block interpreter. Instructions neither of them handles
+    // (CSR accesses, unsupported ones) go through ProcessInstruction.
+    void ProcessBlock()
+    {
+        if (_timing)
+        {
+            ProcessTimed();
+            return;
+        }
+        Word count = _jit.Execute(_ip, _rf.Registers(), jitBudget);
+        if (count == 0)
+            count = _blocks.Execute(_ip, _rf.Registers());
+        if (count == 0)
+        {
+            ProcessInstruction();
+            return;
+        }
+        _csrf.InstructionsExecuted(count);
+    }
+
+    // Runs until the guest writes to mtohost or about maxInstructions
+    // instructions have been executed (blocks are never split, so less
+    // than maxBlockLength more). Returns the number of instructions executed.
+    Word Run(Word maxInstructions)
+    {
+        if (_timing)
+            return RunTimed(maxInstructions);
+
+        Word executed = 0;
+        Word pending = 0; // executed but not yet added to CsrFile
+        while (executed < maxInstructions)
+        {
+            Word count = _jit.Execute(_ip, _rf.Registers(), maxInstructions - executed);
+            if (count == 0)
+                count = _blocks.Execute(_ip, _rf.Registers());
+            if (count != 0)
+            {
+                executed += count;
+                pending += count;
+                continue;
+            }
+
+            // Only CSR accesses and unsupported instructions get here,
+            // CSR reads have to see an up to date instret
+            _csrf.InstructionsExecuted(pending);
+            pending = 0;
+            ProcessInstruction();
+            executed++;
+            if (_csrf.HasMessage())
+                break;
+        }
+        _csrf.InstructionsExecuted(pending);
+        return executed;
+    }
+
+    // Timing models see instructions one by one, so with a model attached
+    // everything runs through ProcessInstruction, or the block interpreter
+    // if the model takes whole blocks. The JIT is never used. nullptr
+    // detaches the model.
+    void SetTimingModel(TimingModel* model)
+    {
+        _timing = model;
+        _csrf.SetTimingModel(model);
+        _blocks.SetTracing(model && model->TakesBlocks());
     }
 
-    void Reset(Word ip)
+    // Compiles basic blocks to host code after hotThreshold executions,
+    // 0 turns the JIT off. Returns false if the host doesn't support it.
+    bool EnableJit(Word hotThreshold)
     {
-        _csrf.Reset();
+        return _jit.Enable(hotThreshold);
+    }
+
+    // hartId is what the guest reads from mhartid
+    void Reset(Word ip, Word hartId = 0)
+    {
+        _csrf.Reset(hartId);
+        _reservation.reset();
+        _decodeCache.Clear();
         _ip = ip;
     }
 
+    CpuState GetState()
+    {
+        return CpuState{_ip, _rf.Registers(), _csrf.GetCounters()};
+    }
+
+    // Memory may have been replaced as well, so decoded code is dropped
+    void SetState(const CpuState& state)
+    {
+        _ip = state.ip;
+        _rf.Registers() = state.regs;
+        _csrf.SetCounters(state.counters);
+        _decodeCache.Clear();
+        _reservation.reset();
+    }
+
     std::optional<CpuToHostData> GetMessage()
     {
         return _csrf.GetMessage();
     }
 
 private:
+    Word RunTimed(Word maxInstructions)
+    {
+        Word executed = 0;
+        while (executed < maxInstructions)
+        {
+            executed += ProcessTimed();
+            if (_csrf.HasMessage())
+                break;
+        }
+        return executed;
+    }
+
+    // Returns the number of instructions executed
+    Word ProcessTimed()
+    {
+        if (_timing->TakesBlocks())
+        {
+            BlockTrace trace;
+            Word count = _blocks.Execute(_ip, _rf.Registers(), &trace);
+            if (count != 0)
+            {
+                _csrf.InstructionsExecuted(count);
+                _timing->RetireBlock(trace);
+                return count;
+            }
+        }
+        ProcessInstruction();
+        return 1;
+    }
+
+    // LR remembers the address and the value it read, SC stores only if the
+    // word still holds that value. The check is a single compare-exchange,
+    // so harts need no lock and no shared reservation table. Like other
+    // compare-exchange based emulations it lets an SC succeed after another
+    // hart stored the same value back (ABA).
+    void Atomic(Instruction& instr)
+    {
+        switch (instr._amoFunc)
+        {
+            case AmoFunc::Lr:
+                instr._data = _mem.AtomicLoad(instr._addr);
+                _reservation = Reservation{instr._addr & Memory::AddressMask(), instr._data};
+                break;
+            case AmoFunc::Sc:
+            {
+                bool stored = _reservation && _reservation->addr == (instr._addr & Memory::AddressMask()) &&
+                              _mem.CompareExchange(instr._addr, _reservation->value, instr._data);
+                _reservation.reset();
+                instr._data = stored ? 0 : 1;
+                break;
+            }
+            default:
+                instr._data = _mem.AtomicRmw(instr._amoFunc, instr._addr, instr._data);
+                break;
+        }
+    }
+
+    void Fetch(Instruction& instr)
+    {
+        instr = Instruction{};
+        static_cast<DecodedInstruction&>(instr) = _decodeCache.Fetch(_mem, _ip);
+    }
+
+    // Guest instructions compiled code may run before returning to the caller
+    static constexpr Word jitBudget = 1024 * 1024;
+
+    struct Reservation
+    {
+        Word addr;
+        Word value;
+    };
+
     Reg32 _ip;
-    Decoder _decoder;
+    DecodeCache _decodeCache;
     RegisterFile _rf;
     CsrFile _csrf;
     Executor _exe;
     Memory& _mem;
+    BlockInterpreter _blocks;
+    JitEngine _jit;
+    std::optional<Reservation> _reservation;
+    TimingModel* _timing = nullptr;
 };
 
 
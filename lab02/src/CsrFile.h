@@ -4,42 +4,80 @@
 
 #include <optional>
 #include "Instruction.h"
+#include "TimingModel.h"
 
 class CsrFile
 {
 public:
-    void Reset()
+    void Reset(Word hartId = 0)
     {
         numInstr = 0;
-        numCycles = 0;
-        coreId = 0;
+        cycleOffset = 0;
+        coreId = hartId;
         cpuToHostData.reset();
         startReg = true;
     }
-    void Read(InstructionPtr& instr)
+    void Read(Instruction& instr)
     {
-        if (!instr->_csr)
+        if (!instr.Has(Instruction::Csr))
             return;
 
-        switch (static_cast<CsrIdx>(instr->_csr.value()))
+        switch (static_cast<CsrIdx>(instr._csr))
         {
-            case CsrIdx::Instret: instr->_csrVal = numInstr; break;
-            case CsrIdx::Cycle  : instr->_csrVal = numCycles; break;
-            case CsrIdx::Mhartid: instr->_csrVal = coreId; break;
-            default: break;
+            case CsrIdx::Instret: instr._csrVal = numInstr; break;
+            case CsrIdx::Cycle  : instr._csrVal = Cycles(); break;
+            case CsrIdx::Mhartid: instr._csrVal = coreId; break;
+            default:
+                if (instr._csr >= static_cast<RId>(CsrIdx::Hpmcounter3) && instr._csr < 0xc20)
+                    instr._csrVal = timing ? Word(timing->Counter(instr._csr & 0x1fu)) : 0;
+                break;
         }
     }
-    void Write(InstructionPtr& instr)
+    void Write(Instruction& instr)
     {
-        if (instr->_type == IType::Csrw && instr->_csr.value_or(CsrIdx::None) == CsrIdx::Mtohost)
+        if (instr._type == IType::Csrw && static_cast<CsrIdx>(instr._csr) == CsrIdx::Mtohost)
         {
-            cpuToHostData = CpuToHostData{instr->_data};
+            cpuToHostData = CpuToHostData{instr._data};
         }
     }
     void InstructionExecuted()
     {
         numInstr++;
-        numCycles++;
+    }
+    void InstructionsExecuted(Word count)
+    {
+        numInstr += count;
+    }
+
+    // Counter values saved in snapshots
+    struct Counters
+    {
+        Word instret;
+        Word cycle;
+    };
+
+    Counters GetCounters() const
+    {
+        return Counters{numInstr, Cycles()};
+    }
+
+    // cycle goes on from the restored value at the pace of the timing model,
+    // or of instret without one, so attach the model first
+    void SetCounters(const Counters& counters)
+    {
+        numInstr = counters.instret;
+        cycleOffset = counters.cycle - Pace();
+    }
+
+    // The cycle counter follows the model from now on, nullptr goes back to instret
+    void SetTimingModel(const TimingModel* model)
+    {
+        timing = model;
+    }
+
+    bool HasMessage() const
+    {
+        return cpuToHostData.has_value();
     }
 
     std::optional<CpuToHostData> GetMessage()
@@ -49,11 +87,24 @@ public:
         return ret;
     }
 private:
+    // The functional model takes one cycle per instruction, so the cycle
+    // counter is only materialized when it is read
+    Word Cycles() const
+    {
+        return Pace() + cycleOffset;
+    }
+
+    Word Pace() const
+    {
+        return timing ? Word(timing->Cycles()) : numInstr;
+    }
+
     Word numInstr = 0;
-    Word numCycles = 0;
+    Word cycleOffset = 0; // cycle minus Pace, set by restores
     Word coreId = 0;
     std::optional<CpuToHostData> cpuToHostData;
     bool startReg = false;
+    const TimingModel* timing = nullptr;
 
 };
 
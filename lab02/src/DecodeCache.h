@@ -0,0 +1,110 @@
+#ifndef RISCV_SIM_DECODECACHE_H
+#define RISCV_SIM_DECODECACHE_H
+
+#include <vector>
+#include <algorithm>
+
+#include "Instruction.h"
+#include "Decoder.h"
+#include "Memory.h"
+
+// Direct-mapped cache of decoded instructions indexed by PC.
+// Entries hold only the decoded fields, 16 bytes per cached instruction.
+class DecodeCache
+{
+public:
+    DecodeCache()
+        : _entries(size)
+    {
+
+    }
+
+    const DecodedInstruction* Find(Word ip) const
+    {
+        const Entry& entry = _entries[Index(ip)];
+        if (entry.tag == ToWordAddr(ip))
+            return &entry.instr;
+        return nullptr;
+    }
+
+    void Insert(Word ip, const DecodedInstruction& instr)
+    {
+        Entry& entry = _entries[Index(ip)];
+        entry.tag = ToWordAddr(ip);
+        entry.instr = instr;
+        _codeLow = std::min(_codeLow, ip & ~3u);
+        _codeHigh = std::max(_codeHigh, (ip & ~3u) + 4);
+    }
+
+    // Returns the decoded instruction at ip, decoding and caching it on a miss
+    const DecodedInstruction& Fetch(Memory& mem, Word ip)
+    {
+        Entry& entry = _entries[Index(ip)];
+        if (entry.tag != ToWordAddr(ip))
+        {
+            Instruction instr;
+            _decoder.Decode(mem.Request(ip), instr);
+            Insert(ip, instr);
+        }
+        return entry.instr;
+    }
+
+    // Cheap check whether a store may hit decoded code: true for any address
+    // between the lowest and the highest instruction decoded so far
+    bool MayContain(Word addr) const
+    {
+        return addr >= _codeLow && addr < _codeHigh;
+    }
+
+    Word CodeLow() const { return _codeLow; }
+    Word CodeHigh() const { return _codeHigh; }
+
+    // Called for every store: drops the entry if the stored word was cached as code.
+    // Stores that may hit decoded code also bump the generation, so engines
+    // holding their own translations know they have to drop them.
+    void Invalidate(Word addr)
+    {
+        if (!MayContain(addr))
+            return;
+        Entry& entry = _entries[Index(addr)];
+        if (entry.tag == ToWordAddr(addr))
+            entry.tag = invalidTag;
+        _generation++;
+    }
+
+    Word Generation() const
+    {
+        return _generation;
+    }
+
+    void Clear()
+    {
+        for (auto& entry : _entries)
+            entry.tag = invalidTag;
+        _codeLow = ~0u;
+        _codeHigh = 0;
+        _generation++;
+    }
+
+private:
+    // Word addresses are at most 30 bits wide, so this tag never matches
+    static constexpr Word invalidTag = ~0u;
+
+    struct Entry
+    {
+        Word tag = invalidTag;
+        DecodedInstruction instr;
+    };
+
+    static Word ToWordAddr(Word ip) { return ip >> 2u; }
+    static size_t Index(Word ip) { return ToWordAddr(ip) & (size - 1); }
+
+    static constexpr size_t size = 16 * 1024; // number of cached instructions, power of two
+    std::vector<Entry> _entries;
+    Decoder _decoder;
+    Word _codeLow = ~0u;
+    Word _codeHigh = 0;
+    Word _generation = 0;
+};
+
+#endif //RISCV_SIM_DECODECACHE_H
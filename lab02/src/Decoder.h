@@ -5,65 +5,38 @@
 #include "SwitchMaker.h"
 #include "Instruction.h"
 
+// Opcodes are 7 bits wide, so the decoder dispatches through a flat table
+template<>
+struct DenseSwitchKey<Opcode>
+{
+    static constexpr size_t size = 128;
+};
+
 // This decoder implementation is stateless, so it could be a function as well
 class Decoder
 {
 
 public:
 
-    InstructionPtr Decode(Word data)
+    Instruction Decode(Word data)
     {
+        Instruction instr;
+        Decode(data, instr);
+        return instr;
+    }
 
+    // Fills the caller-owned instruction in place, no allocation
+    void Decode(Word data, Instruction& instr)
+    {
         DecodedInstr decoded{data};
 
-        auto instr = (*sMaker).DoOperation(static_cast<Opcode>(decoded.i.opcode), decoded);
-        
-
-        if (instr->_dst.value_or(0) == 0)
-            instr->_dst.reset();
-
-        return instr;
+        instr = Instruction{};
+        sMaker.DoOperation(static_cast<Opcode>(decoded.i.opcode), decoded, instr);
     }
 
 private:
-    class InstructionMaker;
-
-    class _SwitchMaker
-	{
-        private:
-            using UniqueSwitchPtr = std::unique_ptr<InstructionMaker>;
-
-            SwitchMaker<Opcode, UniqueSwitchPtr> sMaker;
-	    public:
-
-            _SwitchMaker()
-            {
-                sMaker.AddCompare(CreateInstance<OpImmMaker>());
-                sMaker.AddCompare(CreateInstance<AmoMaker>());
-                sMaker.AddCompare(CreateInstance<AuipcMaker>());
-                sMaker.AddCompare(CreateInstance<BranchMaker>());
-                sMaker.AddCompare(CreateInstance<JalMaker>());
-                sMaker.AddCompare(CreateInstance<JalrMaker>());
-                sMaker.AddCompare(CreateInstance<LoadMaker>());
-                sMaker.AddCompare(CreateInstance<LuiMaker>());
-                sMaker.AddCompare(CreateInstance<MiscMemMaker>());
-                sMaker.AddCompare(CreateInstance<OpMaker>());
-                sMaker.AddCompare(CreateInstance<StoreMaker>());
-                sMaker.AddCompare(CreateInstance<SystemMaker>());
-
-                sMaker.AddDefault(CreateInstance<DefaultMaker>());
-            }
-
-            SwitchMaker<Opcode, UniqueSwitchPtr>& operator*()
-            {
-                return sMaker;
-            }
-	};
-
     using Imm = int32_t;
 
-    static _SwitchMaker inline sMaker = _SwitchMaker();
-
     static Imm SignExtend(Imm i, unsigned sbit)
     {
         return i + ((0xffffffff << (sbit + 1)) * ((i & (1u << sbit)) >> sbit));
@@ -82,10 +55,22 @@ private:
             uint32_t funct3 : 3;
             uint32_t rs1 : 5;
             uint32_t rs2 : 5;
-            uint32_t reserved1 : 5;
+            uint32_t mulDiv : 1;
+            uint32_t reserved1 : 4;
             uint32_t aluSel : 1;
             uint32_t reserved2 : 1;
         } r;
+        struct aType
+        {
+            uint32_t opcode : 7;
+            uint32_t rd : 5;
+            uint32_t funct3 : 3;
+            uint32_t rs1 : 5;
+            uint32_t rs2 : 5;
+            uint32_t rl : 1;
+            uint32_t aq : 1;
+            uint32_t funct5 : 5;
+        } a;
         struct iType
         {
             uint32_t opcode : 7;
@@ -132,52 +117,33 @@ private:
 
     };
 
+    // Makers are stateless, each one fills an instruction for its opcode
     class InstructionMaker
     {
-        public:
-            InstructionMaker(Opcode _type)
-            {
-                type = _type;
-            }
-
-            Opcode GetSwitchType()
-            {
-                return type;
-            }
-
-            InstructionPtr virtual operator()(DecodedInstr decoded) = 0;
-
         protected:
-            Opcode type;
-
-            InstructionPtr GetNewInstraction()
-            {
-                return std::make_unique<Instruction>();
-            }
-
-            Imm GetimmI(DecodedInstr decoded)
+            static Imm GetimmI(DecodedInstr decoded)
             {
                 return SignExtend(decoded.i.imm11_0, 11);
             }
 
-            Imm GetimmS(DecodedInstr decoded)
+            static Imm GetimmS(DecodedInstr decoded)
             {
                 return SignExtend(decoded.s.imm11_5 << 5u | decoded.s.imm4_0, 11);
             }
 
-            Word GetimmU(DecodedInstr decoded)
+            static Word GetimmU(DecodedInstr decoded)
             {
                 return decoded.u.imm31_12 << 12u;
             }
 
-            Imm GetimmB(DecodedInstr decoded)
+            static Imm GetimmB(DecodedInstr decoded)
             {
                 return SignExtend((decoded.b.imm12 << 12u) | (decoded.b.imm11 << 11u) |
                               (decoded.b.imm10_5 << 5u) | (decoded.b.imm4_1 << 1u),
                               12);
             }
 
-            Imm GetimmJ(DecodedInstr decoded)
+            static Imm GetimmJ(DecodedInstr decoded)
             {
                 return SignExtend((decoded.j.imm20 << 20u) | (decoded.j.imm19_12 << 12u) |
                               (decoded.j.imm11 << 11u) | (decoded.j.imm10_1 << 1u),
@@ -185,34 +151,25 @@ private:
             }
     };
 
-    template<typename T, typename... Args>
-    static std::unique_ptr<InstructionMaker> CreateInstance(Args&&... args)
-    {
-        return std::unique_ptr<InstructionMaker>(new T(std::forward<Args>(args)...));
-    }
-
-
     class OpImmMaker : public InstructionMaker
     {
         using Imm = int32_t;
         public:
             
-            OpImmMaker() : InstructionMaker(Opcode::OpImm) {}
+            static constexpr Opcode type = Opcode::OpImm;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_imm = GetimmI(decoded);
-                instr->_type = IType::Alu;
-                instr->_aluFunc = static_cast<AluFunc>(decoded.i.funct3);
-                if (instr->_aluFunc == AluFunc::Sr)
+                instr.SetImm(GetimmI(decoded));
+                instr._type = IType::Alu;
+                instr._aluFunc = static_cast<AluFunc>(decoded.i.funct3);
+                if (instr._aluFunc == AluFunc::Sr)
                 {
-                    instr->_aluFunc = decoded.r.aluSel ? AluFunc::Sra : AluFunc::Srl;
-                    instr->_imm.value() &= 31u;
+                    instr._aluFunc = decoded.r.aluSel ? AluFunc::Sra : AluFunc::Srl;
+                    instr._imm &= 31u;
                 }
-                instr->_dst = RId(decoded.i.rd);
-                instr->_src1 = RId(decoded.i.rs1);
-                return instr;
+                instr._dst = decoded.i.rd;
+                instr.SetSrc1(decoded.i.rs1);
             }
     };
 
@@ -221,29 +178,34 @@ private:
     {
         public:
 
-            OpMaker() : InstructionMaker(Opcode::Op) {}
+            static constexpr Opcode type = Opcode::Op;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::Alu;
+                instr._type = IType::Alu;
                 auto funct3 = AluFunc(decoded.r.funct3);
-                if (funct3 == AluFunc::Add)
+                if (decoded.r.mulDiv)
                 {
-                    instr->_aluFunc = decoded.r.aluSel == 0 ? AluFunc::Add : AluFunc::Sub;
+                    // funct7 = 0000001, funct3 picks the operation in AluFunc order
+                    bool valid = decoded.r.reserved1 == 0 && decoded.r.aluSel == 0 && decoded.r.reserved2 == 0;
+                    instr._type = valid ? IType::Alu : IType::Unsupported;
+                    instr._aluFunc = valid ? AluFunc(Word(AluFunc::Mul) + decoded.r.funct3) : AluFunc::None;
+                }
+                else if (funct3 == AluFunc::Add)
+                {
+                    instr._aluFunc = decoded.r.aluSel == 0 ? AluFunc::Add : AluFunc::Sub;
                 }
                 else if (funct3 == AluFunc::Sr)
                 {
-                    instr->_aluFunc = decoded.r.aluSel ? AluFunc::Sra : AluFunc::Srl;
+                    instr._aluFunc = decoded.r.aluSel ? AluFunc::Sra : AluFunc::Srl;
                 }
                 else
                 {
-                    instr->_aluFunc = funct3;
+                    instr._aluFunc = funct3;
                 }
-                instr->_dst = RId(decoded.r.rd);
-                instr->_src1 = RId(decoded.r.rs1);
-                instr->_src2 = RId(decoded.r.rs2);
-                return instr;
+                instr._dst = decoded.r.rd;
+                instr.SetSrc1(decoded.r.rs1);
+                instr.SetSrc2(decoded.r.rs2);
 	        }
 
     };
@@ -253,17 +215,15 @@ private:
     {
         public:
 
-            LuiMaker() : InstructionMaker(Opcode::Lui) {}
+            static constexpr Opcode type = Opcode::Lui;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                 instr->_type = IType::Alu;
-                instr->_aluFunc = AluFunc::Add;
-                instr->_dst = RId(decoded.u.rd);
-                instr->_src1 = 0;
-                instr->_imm = GetimmU(decoded);
-                return instr;
+                instr._type = IType::Alu;
+                instr._aluFunc = AluFunc::Add;
+                instr._dst = decoded.u.rd;
+                instr.SetSrc1(0);
+                instr.SetImm(GetimmU(decoded));
             }
     };
 
@@ -271,15 +231,13 @@ private:
     {
         public:
             
-            AuipcMaker() : InstructionMaker(Opcode::Auipc) {}
+            static constexpr Opcode type = Opcode::Auipc;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::Auipc;
-                instr->_dst = RId(decoded.u.rd);
-                instr->_imm = GetimmU(decoded);
-                return instr;
+                instr._type = IType::Auipc;
+                instr._dst = decoded.u.rd;
+                instr.SetImm(GetimmU(decoded));
             }
 
         private:
@@ -290,16 +248,14 @@ private:
         using Imm = int32_t;
         public:
             
-            JalMaker() : InstructionMaker(Opcode::Jal){}
+            static constexpr Opcode type = Opcode::Jal;
             
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::J;
-                instr->_brFunc = BrFunc::AT;
-                instr->_dst = RId(decoded.j.rd);
-                instr->_imm = GetimmJ(decoded);
-                return instr;
+                instr._type = IType::J;
+                instr._brFunc = BrFunc::AT;
+                instr._dst = decoded.j.rd;
+                instr.SetImm(GetimmJ(decoded));
             }
 
         private:
@@ -311,17 +267,15 @@ private:
         using Imm = int32_t;
         public:
             
-            JalrMaker() : InstructionMaker(Opcode::Jalr) {}
+            static constexpr Opcode type = Opcode::Jalr;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::Jr;
-                instr->_brFunc = BrFunc::AT;
-                instr->_dst = RId(decoded.i.rd);
-                instr->_src1 = RId(decoded.i.rs1);
-                instr->_imm = GetimmI(decoded);
-                return instr;
+                instr._type = IType::Jr;
+                instr._brFunc = BrFunc::AT;
+                instr._dst = decoded.i.rd;
+                instr.SetSrc1(decoded.i.rs1);
+                instr.SetImm(GetimmI(decoded));
             }
     };
 
@@ -331,17 +285,17 @@ private:
         using Imm = int32_t;
         public:
             
-            BranchMaker() : InstructionMaker(Opcode::Branch) {}
+            static constexpr Opcode type = Opcode::Branch;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::Br;
-                instr->_brFunc = static_cast<BrFunc>(decoded.b.funct3);
-                instr->_src1 = RId(decoded.b.rs1);
-                instr->_src2 = RId(decoded.b.rs2);
-                instr->_imm = GetimmB(decoded);
-                return instr;
+                // funct3 010 and 011 are reserved
+                bool valid = (decoded.b.funct3 & 0b110u) != 0b010u;
+                instr._type = valid ? IType::Br : IType::Unsupported;
+                instr._brFunc = static_cast<BrFunc>(decoded.b.funct3);
+                instr.SetSrc1(decoded.b.rs1);
+                instr.SetSrc2(decoded.b.rs2);
+                instr.SetImm(GetimmB(decoded));
             }
     };
 
@@ -350,17 +304,15 @@ private:
         using Imm = int32_t;
         public:
             
-            LoadMaker() : InstructionMaker(Opcode::Load) {}
+            static constexpr Opcode type = Opcode::Load;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = decoded.i.funct3 == fnLW ? IType::Ld : IType::Unsupported;
-                instr->_aluFunc = AluFunc::Add;
-                instr->_dst = RId(decoded.i.rd);
-                instr->_src1 = RId(decoded.i.rs1);
-                instr->_imm = GetimmI(decoded);
-                return instr;
+                instr._type = decoded.i.funct3 == fnLW ? IType::Ld : IType::Unsupported;
+                instr._aluFunc = AluFunc::Add;
+                instr._dst = decoded.i.rd;
+                instr.SetSrc1(decoded.i.rs1);
+                instr.SetImm(GetimmI(decoded));
             }
 
     };
@@ -371,17 +323,15 @@ private:
         using Imm = int32_t;
         public:
             
-            StoreMaker() : InstructionMaker(Opcode::Store) {}
+            static constexpr Opcode type = Opcode::Store;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = decoded.i.funct3 == fnSW ? IType::St : IType::Unsupported;
-                instr->_aluFunc = AluFunc::Add;
-                instr->_src1 = RId(decoded.s.rs1);
-                instr->_src2 = RId(decoded.s.rs2);
-                instr->_imm = GetimmS(decoded);
-                return instr;
+                instr._type = decoded.i.funct3 == fnSW ? IType::St : IType::Unsupported;
+                instr._aluFunc = AluFunc::Add;
+                instr.SetSrc1(decoded.s.rs1);
+                instr.SetSrc2(decoded.s.rs2);
+                instr.SetImm(GetimmS(decoded));
             }
     };
 
@@ -391,23 +341,21 @@ private:
         using Imm = int32_t;
         public:
             
-            SystemMaker() : InstructionMaker(Opcode::System) {}
+            static constexpr Opcode type = Opcode::System;
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
                 if (decoded.i.funct3 == fnCSRRW && decoded.i.rd == 0)
                 {
-                    instr->_type = IType::Csrw;
+                    instr._type = IType::Csrw;
                 }
                 else if (decoded.i.funct3 == fnCSRRS && decoded.i.rs1 == 0)
                 {
-                    instr->_type = IType::Csrr;
+                    instr._type = IType::Csrr;
                 }
-                instr->_dst = RId(decoded.i.rd);
-                instr->_src1 = RId(decoded.i.rs1);
-                instr->_csr = static_cast<CsrIdx>(GetimmI(decoded) & 0xfff);
-                return instr;
+                instr._dst = decoded.i.rd;
+                instr.SetSrc1(decoded.i.rs1);
+                instr.SetCsr(static_cast<CsrIdx>(GetimmI(decoded) & 0xfff));
             }
 
     };
@@ -415,74 +363,99 @@ private:
     class MiscMemMaker : public InstructionMaker
     {
         public:
-            
-            MiscMemMaker() : InstructionMaker(Opcode::MiscMem)
-            {
-            }
 
-            InstructionPtr operator()(DecodedInstr decoded) override
-            {
-                return (*this)();
-            }
+            static constexpr Opcode type = Opcode::MiscMem;
 
-            InstructionPtr operator()()
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::Unsupported;
-                instr->_aluFunc = AluFunc::None;
-                instr->_brFunc = BrFunc::NT;
-                return instr;
+                instr._type = IType::Unsupported;
+                instr._aluFunc = AluFunc::None;
+                instr._brFunc = BrFunc::NT;
             }
-
     };
 
 
     class AmoMaker : public InstructionMaker
     {
         public:
-            
-            AmoMaker() : InstructionMaker(Opcode::Amo)
-            {
-            }
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static constexpr Opcode type = Opcode::Amo;
+
+            // Only the word-sized forms exist in RV32A. Every AMO is executed
+            // sequentially consistent, so aq and rl need no handling.
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                return (*this)();
+                auto func = static_cast<AmoFunc>(decoded.a.funct5);
+                if (decoded.a.funct3 != fnAMOW || !IsAmo(func) || (func == AmoFunc::Lr && decoded.a.rs2 != 0))
+                {
+                    instr._type = IType::Unsupported;
+                    instr._aluFunc = AluFunc::None;
+                    return;
+                }
+
+                // The address is rs1 + 0, computed by the ALU as for loads
+                instr._type = IType::Amo;
+                instr._amoFunc = func;
+                instr._aluFunc = AluFunc::Add;
+                instr._dst = decoded.a.rd;
+                instr.SetSrc1(decoded.a.rs1);
+                if (func != AmoFunc::Lr)
+                    instr.SetSrc2(decoded.a.rs2);
+                instr.SetImm(0);
             }
 
-            InstructionPtr operator()()
+        private:
+            static bool IsAmo(AmoFunc func)
             {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::Unsupported;
-                instr->_aluFunc = AluFunc::None;
-                instr->_brFunc = BrFunc::NT;
-                return instr;
+                switch (func)
+                {
+                    case AmoFunc::Add:
+                    case AmoFunc::Swap:
+                    case AmoFunc::Lr:
+                    case AmoFunc::Sc:
+                    case AmoFunc::Xor:
+                    case AmoFunc::Or:
+                    case AmoFunc::And:
+                    case AmoFunc::Min:
+                    case AmoFunc::Max:
+                    case AmoFunc::Minu:
+                    case AmoFunc::Maxu:
+                        return true;
+                    default:
+                        return false;
+                }
             }
-
     };
 
     class DefaultMaker : public InstructionMaker
     {
         public:
-            
-            DefaultMaker() : InstructionMaker(Opcode::System)
-            {
-            }
 
-            InstructionPtr operator()(DecodedInstr decoded) override
+            static void Make(DecodedInstr decoded, Instruction& instr)
             {
-                return (*this)();
-            }
-
-            InstructionPtr operator()()
-            {
-                auto instr = GetNewInstraction();
-                instr->_type = IType::Unsupported;
-                instr->_aluFunc = AluFunc::None;
-                instr->_brFunc = BrFunc::NT;
-                return instr;
+                instr._type = IType::Unsupported;
+                instr._aluFunc = AluFunc::None;
+                instr._brFunc = BrFunc::NT;
             }
     };
+
+    using MakeFunc = void(*)(DecodedInstr decoded, Instruction& instr);
+
+    // Flat 128-entry table indexed by opcode, filled at compile time
+    static constexpr SwitchMaker<Opcode, MakeFunc> sMaker{&DefaultMaker::Make, {
+                {OpImmMaker::type, &OpImmMaker::Make},
+                {AmoMaker::type, &AmoMaker::Make},
+                {AuipcMaker::type, &AuipcMaker::Make},
+                {BranchMaker::type, &BranchMaker::Make},
+                {JalMaker::type, &JalMaker::Make},
+                {JalrMaker::type, &JalrMaker::Make},
+                {LoadMaker::type, &LoadMaker::Make},
+                {LuiMaker::type, &LuiMaker::Make},
+                {MiscMemMaker::type, &MiscMemMaker::Make},
+                {OpMaker::type, &OpMaker::Make},
+                {StoreMaker::type, &StoreMaker::Make},
+                {SystemMaker::type, &SystemMaker::Make},
+            }};
 };
 
 #endif //RISCV_SIM_DECODER_H
@@ -3,153 +3,134 @@
 #define RISCV_SIM_EXECUTOR_H
 
 #include "Instruction.h"
-#include <memory>
-#include <unordered_map>
-#include <math.h>
-#include <limits>
+#include <array>
+#include <stdexcept>
 
 
 class Executor
 {
+    // Reuses the ALU primitives below for its pre-resolved handlers
+    friend class BlockInterpreter;
+    friend class JitEngine;
 public:
-    void Execute(InstructionPtr& instr, Word ip)
+    void Execute(Instruction& instr, Word ip)
     {
         DoAlu(instr, ip);
         ChangeAddress(instr, ip);
     }
 private:
 
-    void DoAlu(InstructionPtr& instr, Word ip)
+    void DoAlu(Instruction& instr, Word ip)
     {
         Word res = 0;
-        if(instr->_src1)
+        if(instr.Has(Instruction::Src1))
         {
-            res = GetOperation.at(instr->_aluFunc)(instr->_src1Val, 
-                instr->_imm.value_or(instr->_src2Val) );
-            if(instr->_type == IType::Ld || instr->_type == IType::St)
+            res = GetOperation[Index(instr._aluFunc)](instr._src1Val,
+                instr.Has(Instruction::Imm) ? instr._imm : instr._src2Val);
+            if(instr._type == IType::Ld || instr._type == IType::St || instr._type == IType::Amo)
             {
-                instr->_addr = res;
+                instr._addr = res;
             }
         }
-        instr->_data = checklist.at(instr->_type)(instr, ip, res);
+        instr._data = checklist[Index(instr._type)](instr, ip, res);
     }
 
-    void ChangeAddress(InstructionPtr& instr, Word ip)
+    void ChangeAddress(Instruction& instr, Word ip)
     {
-        if(GetTransition.at(instr->_brFunc)(instr) && GetChangeAddress.count(instr->_type))
-            instr->_nextIp = GetChangeAddress.at(instr->_type)(instr, ip);
+        if(GetTransition[Index(instr._brFunc)](instr))
+            instr._nextIp = GetChangeAddress[Index(instr._type)](instr, ip);
         else
-            instr->_nextIp = ip + 4;
-    }
-
-    const std::unordered_map<IType, Word(*)(InstructionPtr& instr, Word ip, Word res)> checklist = {
-                {IType::Csrr, GetCsrr},
-                {IType::Csrw, GetCsrw},
-                {IType::St, GetSt},
-                {IType::J, GetJorJr},
-                {IType::Jr, GetJorJr},
-                {IType::Auipc, GetAuipc},
-                {IType::Alu, GetDefault},
-                {IType::Ld, GetDefault},
-                {IType::Br, GetDefault}
-            };
+            instr._nextIp = ip + 4;
+    }
 
-    const std::unordered_map<BrFunc, bool(*)(InstructionPtr& instr)> GetTransition = {
-                {BrFunc::Eq, GetEq},
-                {BrFunc::Neq, GetNeq},
-                {BrFunc::Lt, GetLt},
-                {BrFunc::Ltu, GetLtu},
-                {BrFunc::Ge, GetGe},
-                {BrFunc::Geu, GetGeu},
-                {BrFunc::AT, GetAt},
-                {BrFunc::NT, GetNt}
-            };
+    template<typename Enum>
+    static constexpr size_t Index(Enum value)
+    {
+        return static_cast<size_t>(value);
+    }
 
-    const std::unordered_map<AluFunc, Word(*)(Word, Word)> GetOperation = {
-                {AluFunc::Add, GetAdd},
-                {AluFunc::Sub, GetSub},
-                {AluFunc::And, GetAnd},
-                {AluFunc::Or, GetOr},
-                {AluFunc::Xor, GetXor},
-                {AluFunc::Slt, GetSlt},
-                {AluFunc::Sltu, GetSltu},
-                {AluFunc::Sll, GetSll},
-                {AluFunc::Srl, GetSrl},
-                {AluFunc::Sra, GetSra} 
-            };
+    static Word GetUnsupported(Instruction& instr, Word ip, Word res)
+    {
+        throw std::invalid_argument("Unsupported instruction");
+    }
 
-     const std::unordered_map<IType, Word(*)(InstructionPtr& instr, Word ip)> GetChangeAddress = {
-                {IType::J, GetBrAndJ},
-                {IType::Br, GetBrAndJ},
-                {IType::Jr, GetJr}
-            };
+    static Word GetNone(Word first, Word second)
+    {
+        throw std::invalid_argument("Unsupported ALU function");
+    }
 
-    static Word GetDefault(InstructionPtr& instr, Word ip, Word res)
+    static Word GetDefault(Instruction& instr, Word ip, Word res)
     {
         return res;
     }
 
-    static Word GetCsrr(InstructionPtr& instr, Word ip, Word tmp)
+    static Word GetCsrr(Instruction& instr, Word ip, Word tmp)
+    {
+        return instr._csrVal;
+    }
+
+    static Word GetCsrw(Instruction& instr, Word ip, Word tmp)
     {
-        return instr->_csrVal;
+        return instr._src1Val;
     }
 
-    static Word GetCsrw(InstructionPtr& instr, Word ip, Word tmp)
+    static Word GetSt(Instruction& instr, Word ip, Word tmp)
     {
-        return instr->_src1Val;
+        return instr._src2Val;
     }
 
-    static Word GetSt(InstructionPtr& instr, Word ip, Word tmp)
+    // Operand of the AMO, the memory side is done by Cpu
+    static Word GetAmo(Instruction& instr, Word ip, Word tmp)
     {
-        return instr->_src2Val;
+        return instr.Has(Instruction::Src2) ? instr._src2Val : 0;
     }
 
-    static Word GetJorJr(InstructionPtr& instr, Word ip, Word tmp)
+    static Word GetJorJr(Instruction& instr, Word ip, Word tmp)
     {
         return ip + 4u;
     }
 
-    static Word GetAuipc(InstructionPtr& instr, Word ip, Word tmp)
+    static Word GetAuipc(Instruction& instr, Word ip, Word tmp)
     {
-        return ip + instr->_imm.value();
+        return ip + instr._imm;
     }
 
-    static bool GetEq(InstructionPtr& instr)
+    static bool GetEq(Instruction& instr)
     {
-        return instr->_src1Val == instr->_src2Val;
+        return instr._src1Val == instr._src2Val;
     }
 
-    static bool GetNeq(InstructionPtr& instr)
+    static bool GetNeq(Instruction& instr)
     {
         return !GetEq(instr);
     }
 
-    static bool GetLt(InstructionPtr& instr)
+    static bool GetLt(Instruction& instr)
     {
-        return GetSlt(instr->_src1Val, instr->_src2Val);
+        return GetSlt(instr._src1Val, instr._src2Val);
     }
 
-    static bool GetLtu (InstructionPtr& instr)
+    static bool GetLtu (Instruction& instr)
     {
-        return GetSltu(instr->_src1Val, instr->_src2Val);
+        return GetSltu(instr._src1Val, instr._src2Val);
     }
 
-    static bool GetGe(InstructionPtr& instr)
+    static bool GetGe(Instruction& instr)
     {
         return !GetLt(instr);
     }
 
-    static bool GetGeu(InstructionPtr& instr)
+    static bool GetGeu(Instruction& instr)
     {
         return !GetLtu(instr);
     }
 
-    static bool GetAt(InstructionPtr& instr)
+    static bool GetAt(Instruction& instr)
     {
         return true;
     }
 
-    static bool GetNt(InstructionPtr& instr)
+    static bool GetNt(Instruction& instr)
     {
         return false;
     }
@@ -206,15 +187,141 @@ private:
         return static_cast<int32_t>(first)>> (second % 32);
     }
 
-    static Word GetBrAndJ(InstructionPtr& instr, Word ip)
+    // M extension, division by zero and overflow give the results the spec
+    // defines instead of trapping
+
+    static Word GetMul(Word first, Word second)
     {
-        return  ip + instr->_imm.value();
+        return first * second;
     }
 
-    static Word GetJr(InstructionPtr& instr, Word ip)
+    static Word GetMulh(Word first, Word second)
     {
-        return instr->_src1Val + instr->_imm.value();
+        return Word(uint64_t(int64_t(int32_t(first)) * int64_t(int32_t(second))) >> 32u);
     }
+
+    static Word GetMulhsu(Word first, Word second)
+    {
+        return Word(uint64_t(int64_t(int32_t(first)) * int64_t(second)) >> 32u);
+    }
+
+    static Word GetMulhu(Word first, Word second)
+    {
+        return Word(uint64_t(first) * uint64_t(second) >> 32u);
+    }
+
+    static Word GetDiv(Word first, Word second)
+    {
+        if (second == 0)
+            return ~0u;
+        if (first == 0x80000000u && second == ~0u)
+            return first;
+        return Word(int32_t(first) / int32_t(second));
+    }
+
+    static Word GetDivu(Word first, Word second)
+    {
+        return second == 0 ? ~0u : first / second;
+    }
+
+    static Word GetRem(Word first, Word second)
+    {
+        if (second == 0)
+            return first;
+        if (first == 0x80000000u && second == ~0u)
+            return 0;
+        return Word(int32_t(first) % int32_t(second));
+    }
+
+    static Word GetRemu(Word first, Word second)
+    {
+        return second == 0 ? first : first % second;
+    }
+
+    static Word GetBrAndJ(Instruction& instr, Word ip)
+    {
+        return  ip + instr._imm;
+    }
+
+    static Word GetJr(Instruction& instr, Word ip)
+    {
+        return instr._src1Val + instr._imm;
+    }
+
+    static Word GetNextIp(Instruction& instr, Word ip)
+    {
+        return ip + 4;
+    }
+
+    // Dispatch tables indexed directly by the enum values, see Instruction.h
+
+    static constexpr std::array<Word(*)(Instruction& instr, Word ip, Word res), 11> checklist = {
+                GetUnsupported, // IType::Unsupported
+                GetDefault,     // IType::Alu
+                GetDefault,     // IType::Ld
+                GetSt,          // IType::St
+                GetJorJr,       // IType::J
+                GetJorJr,       // IType::Jr
+                GetDefault,     // IType::Br
+                GetCsrr,        // IType::Csrr
+                GetCsrw,        // IType::Csrw
+                GetAuipc,       // IType::Auipc
+                GetAmo          // IType::Amo
+            };
+
+    static constexpr std::array<bool(*)(Instruction& instr), 10> GetTransition = {
+                GetEq,  // BrFunc::Eq
+                GetNeq, // BrFunc::Neq
+                GetNt,  // reserved, the decoder makes these Unsupported
+                GetNt,  // reserved
+                GetLt,  // BrFunc::Lt
+                GetGe,  // BrFunc::Ge
+                GetLtu, // BrFunc::Ltu
+                GetGeu, // BrFunc::Geu
+                GetAt,  // BrFunc::AT
+                GetNt   // BrFunc::NT
+            };
+
+    static constexpr std::array<Word(*)(Word, Word), 20> GetOperation = {
+                GetAdd,  // AluFunc::Add
+                GetSll,  // AluFunc::Sll
+                GetSlt,  // AluFunc::Slt
+                GetSltu, // AluFunc::Sltu
+                GetXor,  // AluFunc::Xor
+                GetNone, // AluFunc::Sr, always resolved to Sra or Srl by the decoder
+                GetOr,   // AluFunc::Or
+                GetAnd,  // AluFunc::And
+                GetSub,  // AluFunc::Sub
+                GetSra,  // AluFunc::Sra
+                GetSrl,    // AluFunc::Srl
+                GetMul,    // AluFunc::Mul
+                GetMulh,   // AluFunc::Mulh
+                GetMulhsu, // AluFunc::Mulhsu
+                GetMulhu,  // AluFunc::Mulhu
+                GetDiv,    // AluFunc::Div
+                GetDivu,   // AluFunc::Divu
+                GetRem,    // AluFunc::Rem
+                GetRemu,   // AluFunc::Remu
+                GetNone    // AluFunc::None
+            };
+
+    static constexpr std::array<Word(*)(Instruction& instr, Word ip), 11> GetChangeAddress = {
+                GetNextIp, // IType::Unsupported
+                GetNextIp, // IType::Alu
+                GetNextIp, // IType::Ld
+                GetNextIp, // IType::St
+                GetBrAndJ, // IType::J
+                GetJr,     // IType::Jr
+                GetBrAndJ, // IType::Br
+                GetNextIp, // IType::Csrr
+                GetNextIp, // IType::Csrw
+                GetNextIp, // IType::Auipc
+                GetNextIp  // IType::Amo
+            };
 };
 
+static_assert(static_cast<size_t>(IType::Amo) == 10, "update Executor dispatch tables");
+static_assert(static_cast<size_t>(BrFunc::NT) == 9, "update Executor dispatch tables");
+static_assert(static_cast<size_t>(AluFunc::None) == 19, "update Executor dispatch tables");
+
 #endif // RISCV_SIM_EXECUTOR_H
@@ -0,0 +1,180 @@
+#ifndef RISCV_SIM_FORKSERVER_H
+#define RISCV_SIM_FORKSERVER_H
+
+#include <string>
+#include <optional>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <iostream>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Cpu.h"
+#include "Host.h"
+
+// Runs the loaded program once per request in a forked copy-on-write child,
+// so a run costs a fork instead of a process start, ELF load and decoder setup.
+//
+// Protocol over a UNIX stream socket, one request per connection:
+//     client: "run\n" or "run <max instructions>\n", or "quit\n" to stop the server
+//     server: the output of the program, then "exit=<code> instret=<n>\n"
+//             or "timeout instret=<n>\n" if the limit was hit
+class ForkServer
+{
+public:
+    explicit ForkServer(Cpu& cpu)
+        : _cpu(cpu)
+    {
+
+    }
+
+    // Serves requests until "quit", returns false if the socket can't be set up
+    bool Serve(const std::string& path)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = Address(path);
+        unlink(path.c_str());
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0)
+        {
+            std::cerr << "ERROR: server: failed listening on \"" << path << "\"" << std::endl;
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+
+        // Children are never waited for
+        struct sigaction action{};
+        action.sa_handler = SIG_IGN;
+        action.sa_flags = SA_NOCLDWAIT;
+        sigaction(SIGCHLD, &action, nullptr);
+
+        while (true)
+        {
+            int conn = accept(fd, nullptr, nullptr);
+            if (conn < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            std::string request = ReadLine(conn);
+            if (request == "quit")
+            {
+                close(conn);
+                break;
+            }
+
+            std::optional<Word> limit = ParseRun(request);
+            if (!limit)
+            {
+                dprintf(conn, "error: unknown request \"%s\"\n", request.c_str());
+                close(conn);
+                continue;
+            }
+
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(fd);
+                RunChild(conn, *limit);
+            }
+            if (pid < 0)
+                dprintf(conn, "error: fork failed\n");
+            close(conn);
+        }
+
+        close(fd);
+        unlink(path.c_str());
+        return true;
+    }
+
+    // Client side: sends a run request and prints the output of the program.
+    // Returns its exit code, 1 on errors and timeouts.
+    static int Request(const std::string& path, Word limit)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = Address(path);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            std::cerr << "ERROR: client: failed connecting to \"" << path << "\"" << std::endl;
+            if (fd >= 0)
+                close(fd);
+            return 1;
+        }
+
+        std::string request = limit ? "run " + std::to_string(limit) + "\n" : "run\n";
+        std::string reply;
+        char buf[4096];
+        ssize_t n = write(fd, request.data(), request.size());
+        while (n >= 0 && (n = read(fd, buf, sizeof(buf))) > 0)
+            reply.append(buf, n);
+        close(fd);
+
+        // Everything before the status line is the output of the program
+        size_t status = reply.rfind('\n', reply.size() >= 2 ? reply.size() - 2 : 0);
+        status = status == std::string::npos ? 0 : status + 1;
+        fputs(reply.substr(0, status).c_str(), stderr);
+
+        int exitCode = 1;
+        if (std::sscanf(reply.c_str() + status, "exit=%d", &exitCode) != 1)
+        {
+            fprintf(stderr, "%s", reply.c_str() + status);
+            return 1;
+        }
+        return exitCode;
+    }
+
+private:
+    static sockaddr_un Address(const std::string& path)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        return addr;
+    }
+
+    static std::string ReadLine(int fd)
+    {
+        std::string line;
+        char c;
+        while (line.size() < 64 && read(fd, &c, 1) == 1 && c != '\n')
+            line += c;
+        return line;
+    }
+
+    // "run" means no limit, which is 0
+    static std::optional<Word> ParseRun(const std::string& request)
+    {
+        if (request == "run")
+            return 0;
+        unsigned long limit = 0;
+        char end;
+        if (std::sscanf(request.c_str(), "run %lu%c", &limit, &end) == 1)
+            return Word(limit);
+        return std::nullopt;
+    }
+
+    [[noreturn]] void RunChild(int conn, Word limit)
+    {
+        // Host writes the output of the program to stderr
+        dup2(conn, STDERR_FILENO);
+
+        std::optional<int> exitCode = Host{}.Run(_cpu, limit);
+
+        Word instret = _cpu.GetState().counters.instret;
+        if (exitCode)
+            dprintf(conn, "exit=%d instret=%u\n", exitCode.value(), instret);
+        else
+            dprintf(conn, "timeout instret=%u\n", instret);
+        _exit(0);
+    }
+
+    Cpu& _cpu;
+};
+
+#endif //RISCV_SIM_FORKSERVER_H
@@ -0,0 +1,82 @@
+#ifndef RISCV_SIM_HOST_H
+#define RISCV_SIM_HOST_H
+
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <algorithm>
+
+#include "BaseTypes.h"
+
+// Host side of the mtohost CSR: prints what the guest sends and reports
+// its exit code. Shared by every frontend running guest programs.
+class Host
+{
+public:
+    // Output goes to stderr unless another stream is given
+    explicit Host(FILE* out = stderr)
+        : _out(out)
+    {
+
+    }
+
+    // Returns the exit code once the guest has finished
+    std::optional<int> Handle(CpuToHostData msg)
+    {
+        auto type = msg.unpacked.type;
+        auto data = msg.unpacked.data;
+
+        if(type == CpuToHostType::ExitCode) {
+            if(data == 0) {
+                fprintf(_out, "PASSED\n");
+            } else {
+                fprintf(_out, "FAILED: exit code = %d\n", data);
+            }
+            return data;
+        } else if(type == CpuToHostType::PrintChar) {
+            fprintf(_out, "%c", (char)data);
+        } else if(type == CpuToHostType::PrintIntLow) {
+            print_int = uint32_t(data);
+        } else if(type == CpuToHostType::PrintIntHigh) {
+            print_int |= uint32_t(data) << 16;
+            fprintf(_out, "%d", print_int);
+        }
+        return std::nullopt;
+    }
+
+    // Runs cpu until the guest exits or, unless limit is 0, limit
+    // instructions have been executed. Returns the exit code, nullopt on
+    // timeout. A template so that code without a Cpu can include this file.
+    template<typename Hart>
+    std::optional<int> Run(Hart& cpu, Word limit)
+    {
+        constexpr Word runBudget = 1u << 24u;
+        Word remaining = limit;
+        while (true)
+        {
+            // Run may finish the block it is in past its budget, so the
+            // last stretch before the limit goes one instruction at a time
+            Word executed = 1;
+            if (!limit)
+                executed = cpu.Run(runBudget);
+            else if (remaining > Hart::maxBlockLength)
+                executed = cpu.Run(std::min(runBudget, remaining - Hart::maxBlockLength));
+            else
+                cpu.ProcessInstruction();
+            remaining -= std::min(executed, remaining);
+            if (std::optional<CpuToHostData> msg = cpu.GetMessage())
+            {
+                if (std::optional<int> exitCode = Handle(msg.value()))
+                    return exitCode;
+            }
+            if (limit && remaining == 0)
+                return std::nullopt;
+        }
+    }
+
+private:
+    FILE* _out;
+    int32_t print_int = 0;
+};
+
+#endif //RISCV_SIM_HOST_H
@@ -2,8 +2,8 @@
 #ifndef RISCV_SIM_INSTRUCTION_H
 #define RISCV_SIM_INSTRUCTION_H
 
-#include <optional>
-#include <memory>
+#include <cstdint>
+#include <type_traits>
 
 #include "BaseTypes.h"
 #include "PoolAllocator.h"
@@ -29,12 +29,13 @@ enum class CsrIdx : RId
 {
     Instret = 0xc02,
     Cycle   = 0xc00,
+    Hpmcounter3 = 0xc03, // up to hpmcounter31, events of the timing model
     Mhartid = 0xf10,
     Mtohost = 0x780,
     None    = 0xfff,
 };
 
-// LR, SC, FENCE not implemented
+// FENCE not implemented
 // LB(U), LH(U), SB, SH not implemented
 
 // For CSR, only following two are implemented
@@ -43,7 +44,7 @@ enum class CsrIdx : RId
 
 // SCALL, SBREAK not implemented
 
-enum class IType
+enum class IType : uint8_t
 {
     Unsupported,
     Alu,
@@ -54,7 +55,8 @@ enum class IType
     Br,
     Csrr,
     Csrw,
-    Auipc
+    Auipc,
+    Amo
 };
 
 enum class BrFunc : uint8_t
@@ -69,7 +71,24 @@ enum class BrFunc : uint8_t
     NT,
 };
 
-enum class AluFunc
+// funct5 of the A extension, LR and SC included
+enum class AmoFunc : uint8_t
+{
+    Add  = 0b00000,
+    Swap = 0b00001,
+    Lr   = 0b00010,
+    Sc   = 0b00011,
+    Xor  = 0b00100,
+    Or   = 0b01000,
+    And  = 0b01100,
+    Min  = 0b10000,
+    Max  = 0b10100,
+    Minu = 0b11000,
+    Maxu = 0b11100,
+    None = 0xff,
+};
+
+enum class AluFunc : uint8_t
 {
     Add  = 0b000,
     Sll  = 0b001,
@@ -82,20 +101,62 @@ enum class AluFunc
     Sub  = 0b1000,
     Sra,
     Srl,
+    // M extension
+    Mul,
+    Mulh,
+    Mulhsu,
+    Mulhu,
+    Div,
+    Divu,
+    Rem,
+    Remu,
     None,
 };
 
-struct Instruction : public PoolAllocated<Instruction>
+// Decoded fields of an instruction, packed into 12 bytes so that a decoded
+// text segment (or a trace of decoded instructions) stays cache friendly.
+// Register x0 in _dst means "no destination", presence of the other
+// operands is tracked in the _fields bitmask.
+struct DecodedInstruction
 {
+    enum Field : uint8_t
+    {
+        Src1 = 1u << 0,
+        Src2 = 1u << 1,
+        Imm  = 1u << 2,
+        Csr  = 1u << 3,
+    };
+
+    DecodedInstruction()
+        : _dst(0), _src1(0), _src2(0), _csr(0), _fields(0)
+    {
+
+    }
+
+    bool Has(Field field) const { return (_fields & field) != 0; }
+
+    void SetSrc1(RId src1) { _src1 = src1; _fields |= Src1; }
+    void SetSrc2(RId src2) { _src2 = src2; _fields |= Src2; }
+    void SetImm(Word imm) { _imm = imm; _fields |= Imm; }
+    void SetCsr(CsrIdx csr) { _csr = static_cast<RId>(csr); _fields |= Csr; }
+
     IType _type = IType::Unsupported;
     BrFunc _brFunc = BrFunc::NT;
-    AluFunc _aluFunc;
-    std::optional<RId> _dst;
-    std::optional<RId> _src1;
-    std::optional<RId> _src2;
-    std::optional<CsrIdx> _csr;
-    std::optional<Word> _imm;
+    AluFunc _aluFunc = AluFunc::Add;
+    AmoFunc _amoFunc = AmoFunc::None;
+    uint32_t _dst : 5;
+    uint32_t _src1 : 5;
+    uint32_t _src2 : 5;
+    uint32_t _csr : 12;
+    uint32_t _fields : 5;
+    Word _imm = 0;
+};
 
+static_assert(sizeof(DecodedInstruction) <= 16, "DecodedInstruction should stay compact");
+static_assert(std::is_trivially_copyable_v<DecodedInstruction>);
+
+struct Instruction : public DecodedInstruction, public PoolAllocated<Instruction>
+{
     Word _src1Val;
     Word _src2Val;
     Word _csrVal;
@@ -104,8 +165,6 @@ struct Instruction : public PoolAllocated<Instruction>
     Word _nextIp = 0xdeadbeaf;
 };
 
-using InstructionPtr = std::unique_ptr<Instruction>;
-
 // Load
 constexpr uint8_t fnLW    = 0b010;
 //constexpr uint8_t fnLB    = 0b000;
@@ -117,8 +176,7 @@ constexpr uint8_t fnSW    = 0b010;
 //constexpr uint8_t fnSB    = 0b000;
 //constexpr uint8_t fnSH    = 0b001;
 // Amo
-constexpr uint8_t fnLR    = 0b00010;
-constexpr uint8_t fnSC    = 0b00011;
+constexpr uint8_t fnAMOW  = 0b010;
 //MiscMem
 constexpr uint8_t fnFENCE  = 0b000;
 //constexpr uint8_t fnFENCEI = 0b001;
@@ -0,0 +1,253 @@
+#ifndef RISCV_SIM_INTERVALTIMING_H
+#define RISCV_SIM_INTERVALTIMING_H
+
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+#include "TimingModel.h"
+#include "OptionList.h"
+
+// Interval analysis of an out-of-order core: instructions stream through
+// at the dispatch width, limited by the recurrences of loops, and every
+// miss event adds its penalty interval. Load misses less than a ROB apart
+// overlap and cost once. Takes whole blocks, so the block interpreter
+// keeps running and the model is cheap enough for design space sweeps.
+class IntervalTiming : public TimingModel
+{
+public:
+    // Penalty cycles by event, hpmcounter3 and up
+    enum Event
+    {
+        Mispredict,
+        ICacheMiss,
+        DCacheMiss,
+        LongLatency,
+        Events
+    };
+
+    struct Config
+    {
+        Word width = 4;
+        Word robSize = 64;
+        Word frontendDepth = 3; // fetch to dispatch
+        Word resolveLatency = 3; // dispatch to the redirect of a mispredicted transfer
+        Word mulLatency = 3;
+        Word divLatency = 20;
+    };
+
+    // "width=4,rob=64,depth=3,resolve=3,mul=3,div=20", what names the
+    // model in errors
+    static std::optional<Config> Parse(const std::string& text, const std::string& what)
+    {
+        OptionList options(text);
+        Config config;
+        config.width = options.Get("width", config.width);
+        config.robSize = options.Get("rob", config.robSize);
+        config.frontendDepth = options.Get("depth", config.frontendDepth);
+        config.resolveLatency = options.Get("resolve", config.resolveLatency);
+        config.mulLatency = options.Get("mul", config.mulLatency);
+        config.divLatency = options.Get("div", config.divLatency);
+
+        bool ok = options.Check(what);
+        if (config.width == 0 || config.robSize == 0)
+            ok = OptionList::Error(what, "width and rob have to be at least 1");
+        if (config.frontendDepth + config.resolveLatency == 0)
+            ok = OptionList::Error(what, "depth + resolve has to be at least 1");
+
+        if (!ok)
+            return std::nullopt;
+        return config;
+    }
+
+    IntervalTiming(const Config& config, Cache* icache, Cache* dcache, BranchPredictor* predictor)
+        : _config(config), _icache(icache), _dcache(dcache), _predictor(predictor),
+          _mulPenalty(Exposed(config.mulLatency)), _divPenalty(Exposed(config.divLatency)),
+          // The cycle of the fetch group ending with the transfer is in the
+          // base already
+          _mispredictPenalty(config.frontendDepth + config.resolveLatency - 1)
+    {
+
+    }
+
+    bool TakesBlocks() const override
+    {
+        return true;
+    }
+
+    void RetireBlock(const BlockTrace& block) override
+    {
+        if (_icache)
+        {
+            Word line = _icache->GetConfig().lineSize;
+            Word end = block.start + 4 * block.count;
+            for (Word addr = block.start; addr < end; addr = (addr | (line - 1)) + 1)
+                Add(ICacheMiss, _icache->Access(addr, false));
+        }
+
+        for (Word i = 0; i < block.accessCount; i++)
+            Access(block.accesses[i].addr, block.accesses[i].write);
+
+        const BlockTrace::Profile& profile = block.profile;
+        Add(LongLatency, profile.multiplies * _mulPenalty + profile.divides * _divPenalty);
+
+        _instructions += block.count;
+        _slots += block.count;
+        bool taken = block.nextIp != block.start + 4 * block.count;
+        if (block.count == profile.length && IsControl(profile.last))
+        {
+            Instruction last;
+            static_cast<DecodedInstruction&>(last) = profile.last;
+            last._nextIp = block.nextIp;
+            if (Redirects(last, profile.lastIp))
+                Add(Mispredict, _mispredictPenalty + ResolveDelay(profile, block.count));
+        }
+        if (taken)
+        {
+            // A taken transfer ends the fetch group, a loop can't go
+            // faster than the dependences it carries between iterations
+            Word cycles = Groups();
+            if (block.nextIp == block.start)
+                cycles = std::max(cycles, profile.recurrence);
+            _base += cycles;
+            _slots = 0;
+        }
+    }
+
+    // Instructions the block interpreter doesn't run come one by one
+    void Retire(const Instruction& instr, Word ip) override
+    {
+        if (_icache)
+            Add(ICacheMiss, _icache->Access(ip, false));
+        if (IsMemory(instr))
+            Access(instr._addr, IsWrite(instr));
+        if (IsMultiply(instr))
+            Add(LongLatency, _mulPenalty);
+        if (IsDivide(instr))
+            Add(LongLatency, _divPenalty);
+        if (Redirects(instr, ip))
+            Add(Mispredict, _mispredictPenalty);
+        _instructions++;
+        _slots++;
+        if (IsControl(instr) && instr._nextIp != ip + 4)
+        {
+            _base += Groups();
+            _slots = 0;
+        }
+    }
+
+    uint64_t Cycles() const override
+    {
+        uint64_t penalties = 0;
+        for (uint64_t penalty : _penalties)
+            penalties += penalty;
+        return Base() + penalties;
+    }
+
+    uint64_t Counter(Word index) const override
+    {
+        return index >= 3 && index < 3 + Events ? _penalties[index - 3] : 0;
+    }
+
+    uint64_t GetPenalty(Event event) const
+    {
+        return _penalties[event];
+    }
+
+    void Report(std::ostream& out) const override
+    {
+        static const char* const events[] = {"mispredicts", "icache", "dcache", "long latency"};
+        ReportCycles(out, Cycles(), _instructions);
+        out << "interval: width " << _config.width << ", rob " << _config.robSize << "\n"
+            << "    cycles base " << Base();
+        for (int event = Mispredict; event < Events; event++)
+            out << ", " << events[event] << " " << _penalties[event];
+        out << "\n";
+        if (_icache)
+            _icache->Report(out, "icache");
+        if (_dcache)
+            _dcache->Report(out, "dcache");
+        if (_predictor)
+            _predictor->Report(out);
+    }
+
+private:
+    // Fetch groups of the instructions since the last taken transfer
+    Word Groups() const
+    {
+        return (_slots + _config.width - 1) / _config.width;
+    }
+
+    // Plus the fill of the pipeline ahead of the first instruction
+    uint64_t Base() const
+    {
+        return _base + Groups() + (_instructions ? _config.frontendDepth + _config.resolveLatency : 0);
+    }
+
+    // Cycles the transfer ending a block waits for its operands: the chain
+    // feeding it has to issue, as far as that outlasts the fetch groups
+    // ahead of the transfer, and a producer in its own group is at least a
+    // cycle ahead
+    Word ResolveDelay(const BlockTrace::Profile& profile, Word count) const
+    {
+        Word position = _slots - 1;
+        Word behind = position / _config.width - (_slots - count) / _config.width;
+        Word delay = profile.resolveDepth > behind ? profile.resolveDepth - behind : 0;
+        bool sameGroup = profile.resolveDistance != 0 && profile.resolveDistance <= position % _config.width;
+        return std::max<Word>(delay, sameGroup);
+    }
+
+    void Add(Event event, uint64_t cycles)
+    {
+        _penalties[event] += cycles;
+    }
+
+    // Stores drain from the store buffer, a load miss overlaps with the
+    // misses of the ROB it is in
+    void Access(Word addr, bool write)
+    {
+        if (!_dcache)
+            return;
+        Word penalty = _dcache->Access(addr, write);
+        if (penalty == 0 || write)
+            return;
+        if (_lastMiss && _instructions - _lastMiss.value() < _config.robSize)
+            return;
+        _lastMiss = _instructions;
+        Add(DCacheMiss, penalty);
+    }
+
+    // What the ROB can't hide of a long operation
+    Word Exposed(Word latency) const
+    {
+        Word hidden = _config.robSize / _config.width;
+        return latency > hidden ? latency - hidden : 0;
+    }
+
+    bool Redirects(const Instruction& instr, Word ip)
+    {
+        if (!IsControl(instr))
+            return false;
+        if (_predictor)
+            return _predictor->Mispredicts(instr, ip);
+        return instr._nextIp != ip + 4;
+    }
+
+    Config _config;
+    Cache* _icache;
+    Cache* _dcache;
+    BranchPredictor* _predictor;
+    Word _mulPenalty;
+    Word _divPenalty;
+    Word _mispredictPenalty;
+    uint64_t _base = 0;
+    Word _slots = 0; // dispatched since the last taken transfer
+    uint64_t _penalties[Events] = {};
+    std::optional<uint64_t> _lastMiss;
+    uint64_t _instructions = 0;
+};
+
+#endif //RISCV_SIM_INTERVALTIMING_H
@@ -0,0 +1,607 @@
+#ifndef RISCV_SIM_JITENGINE_H
+#define RISCV_SIM_JITENGINE_H
+
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstddef>
+
+#include "Instruction.h"
+#include "DecodeCache.h"
+#include "Memory.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define RISCV_SIM_JIT 1
+#include <sys/mman.h>
+#include "X86Emitter.h"
+#endif
+
+// Dynamic binary translator from RV32I basic blocks to x86-64 code.
+// Blocks are the same as in BlockInterpreter: they end with a branch or jump
+// and never contain CSR accesses or unsupported instructions. A block gets
+// compiled once it has been entered hotThreshold times, until then (and for
+// everything that can't be compiled) Execute returns 0 and the caller falls
+// back to the interpreters.
+//
+// Inside a block the most used guest registers live in host registers, they
+// are loaded on entry and written back on every exit. Direct exits are
+// patched into jumps to the target block once it is compiled, indirect ones
+// look the target up in a table, so control stays in native code until the
+// instruction budget passed to Execute runs out.
+class JitEngine
+{
+public:
+    JitEngine(Memory& mem, DecodeCache& decodeCache)
+        : _mem(mem), _decodeCache(decodeCache)
+    {
+
+    }
+
+    ~JitEngine()
+    {
+#ifdef RISCV_SIM_JIT
+        if (_buffer)
+            munmap(_buffer, bufferSize);
+#endif
+    }
+
+    JitEngine(const JitEngine&) = delete;
+    JitEngine& operator=(const JitEngine&) = delete;
+
+    // hotThreshold = 0 disables the JIT. Returns false if the host can't run it.
+    bool Enable(Word hotThreshold)
+    {
+        _hotThreshold = hotThreshold;
+#ifdef RISCV_SIM_JIT
+        if (hotThreshold != 0 && !_buffer)
+        {
+            void* buffer = mmap(nullptr, bufferSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffer == MAP_FAILED)
+            {
+                _hotThreshold = 0;
+                return false;
+            }
+            _buffer = static_cast<uint8_t*>(buffer);
+            _table.resize(tableSize);
+            _counters.resize(tableSize);
+            Flush();
+        }
+        return true;
+#else
+        _hotThreshold = 0;
+        return hotThreshold == 0;
+#endif
+    }
+
+    bool Enabled() const
+    {
+        return _hotThreshold != 0;
+    }
+
+    // Runs compiled code starting at ip for at most about maxInstructions
+    // instructions (a block is never interrupted) and moves ip past it.
+    // Returns the number of guest instructions executed, 0 if ip is not compiled.
+    Word Execute(Word& ip, std::array<Word, 32>& regs, Word maxInstructions)
+    {
+#ifdef RISCV_SIM_JIT
+        if (!Enabled())
+            return 0;
+
+        if (_generation != _decodeCache.Generation())
+        {
+            Flush();
+            _generation = _decodeCache.Generation();
+        }
+
+        const uint8_t* code = Lookup(ip);
+        if (!code)
+        {
+            Counter& counter = _counters[Index(ip)];
+            if (counter.ip != ip)
+                counter = Counter{ip, 0};
+            if (++counter.count < _hotThreshold)
+                return 0;
+            code = Compile(ip);
+            if (!code)
+                return 0;
+        }
+
+        Context ctx{};
+        ctx.regs = regs.data();
+        ctx.mem = reinterpret_cast<uint8_t*>(_mem.Data());
+        ctx.table = _table.data();
+        ctx.dirty = _mem.DirtyMap();
+        ctx.lastDirtyPage = invalidIp;
+        ctx.limit = maxInstructions;
+        ctx.codeLow = _decodeCache.CodeLow();
+        ctx.codeHigh = _decodeCache.CodeHigh();
+
+        reinterpret_cast<void (*)(Context*, const uint8_t*)>(_enter)(&ctx, code);
+
+        ip = ctx.nextIp;
+        if (ctx.codeWritten)
+            _decodeCache.Invalidate(ctx.storeAddr);
+        return ctx.executed;
+#else
+        return 0;
+#endif
+    }
+
+#ifdef RISCV_SIM_JIT
+private:
+    using Reg = X86Emitter::Reg;
+
+    // Shared with the generated code, offsets are taken with offsetof
+    struct Context
+    {
+        Word* regs;
+        uint8_t* mem;
+        const void* table;
+        uint64_t* dirty;
+        Word lastDirtyPage;
+        Word nextIp;
+        Word executed;
+        Word limit;
+        Word codeLow;
+        Word codeHigh;
+        Word storeAddr;
+        Word codeWritten;
+    };
+
+    struct TableEntry
+    {
+        Word ip;
+        const uint8_t* code;
+    };
+
+    struct Counter
+    {
+        Word ip;
+        Word count;
+    };
+
+    static_assert(sizeof(TableEntry) == 16, "the indirect jump lookup expects 16-byte entries");
+
+    static constexpr size_t bufferSize = 64 * 1024 * 1024;
+    static constexpr size_t maxBlockCode = 64 * 1024; // more than any block can take
+    static constexpr size_t tableSize = 16 * 1024;    // power of two
+    static constexpr Word maxBlockLength = 64;
+    static constexpr Word invalidIp = ~0u;
+
+    // Host registers: r15 = context, r14 = guest memory, r13 = guest registers,
+    // rax, rcx, rdx are scratch, the rest hold guest registers
+    static constexpr Reg ctxReg = X86Emitter::R15;
+    static constexpr Reg memReg = X86Emitter::R14;
+    static constexpr Reg regsReg = X86Emitter::R13;
+    static constexpr std::array<Reg, 9> cacheRegs = {
+            X86Emitter::Rbx, X86Emitter::Rbp, X86Emitter::Rsi, X86Emitter::Rdi,
+            X86Emitter::R8, X86Emitter::R9, X86Emitter::R10, X86Emitter::R11, X86Emitter::R12
+    };
+    static constexpr Reg noReg = X86Emitter::Rsp;
+
+    static size_t Index(Word ip) { return (ip >> 2u) & (tableSize - 1); }
+
+    const uint8_t* Lookup(Word ip) const
+    {
+        const TableEntry& entry = _table[Index(ip)];
+        return entry.ip == ip && ip != invalidIp ? entry.code : nullptr;
+    }
+
+    void Flush()
+    {
+        _pendingExits.clear();
+        _emitter.Reset(_buffer, bufferSize);
+        EmitStubs();
+        // Empty slots lead to the return stub, so indirect jumps need no extra check
+        std::fill(_table.begin(), _table.end(), TableEntry{invalidIp, _return});
+    }
+
+    // enter(ctx, code) saves the callee-saved registers, sets up the fixed ones
+    // and jumps to code; the return stub undoes it
+    void EmitStubs()
+    {
+        X86Emitter& e = _emitter;
+        _enter = e.Current();
+        for (Reg reg : savedRegs)
+            e.Push(reg);
+        e.Mov64(ctxReg, X86Emitter::Rdi);
+        e.Load64(memReg, ctxReg, offsetof(Context, mem));
+        e.Load64(regsReg, ctxReg, offsetof(Context, regs));
+        e.Jmp(X86Emitter::Rsi);
+
+        _return = e.Current();
+        for (auto it = savedRegs.rbegin(); it != savedRegs.rend(); ++it)
+            e.Pop(*it);
+        e.Ret();
+    }
+
+    static constexpr std::array<Reg, 6> savedRegs = {
+            X86Emitter::Rbx, X86Emitter::Rbp, X86Emitter::R12,
+            X86Emitter::R13, X86Emitter::R14, X86Emitter::R15
+    };
+
+    const uint8_t* Compile(Word start)
+    {
+        std::vector<DecodedInstruction> instrs;
+        for (Word ip = start; instrs.size() < maxBlockLength; ip += 4)
+        {
+            const DecodedInstruction& instr = _decodeCache.Fetch(_mem, ip);
+            if (!IsCompilable(instr))
+                break;
+            instrs.push_back(instr);
+            if (IsBlockEnd(instr))
+                break;
+        }
+        if (instrs.empty())
+            return nullptr;
+
+        if (!_emitter.HasRoom(maxBlockCode))
+        {
+            Flush();
+        }
+
+        AllocateRegisters(instrs);
+        const uint8_t* code = _emitter.Current();
+        EmitBlock(start, instrs);
+
+        for (size_t rel32 : _pendingExits[start])
+            _emitter.Patch(rel32, code);
+        _pendingExits.erase(start);
+
+        _table[Index(start)] = TableEntry{start, code};
+        return code;
+    }
+
+    static bool IsCompilable(const DecodedInstruction& instr)
+    {
+        switch (instr._type)
+        {
+            case IType::Alu:
+                // Of the M extension only mul is compiled, the rest runs in
+                // the block interpreter
+                return instr._aluFunc <= AluFunc::Mul && instr._aluFunc != AluFunc::Sr;
+            case IType::Ld:
+            case IType::St:
+            case IType::J:
+            case IType::Jr:
+            case IType::Br:
+            case IType::Auipc:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool IsBlockEnd(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::Br || instr._type == IType::J || instr._type == IType::Jr;
+    }
+
+    // Guest registers used at least twice in the block get a host register
+    void AllocateRegisters(const std::vector<DecodedInstruction>& instrs)
+    {
+        std::array<unsigned, 32> uses{};
+        _written.fill(false);
+        for (const auto& instr : instrs)
+        {
+            if (instr.Has(Instruction::Src1))
+                uses[instr._src1]++;
+            if (instr.Has(Instruction::Src2))
+                uses[instr._src2]++;
+            uses[instr._dst]++;
+            _written[instr._dst] = true;
+        }
+        uses[0] = 0;
+
+        std::array<RId, 32> order;
+        for (RId i = 0; i < 32; i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](RId a, RId b) { return uses[a] > uses[b]; });
+
+        _hostReg.fill(noReg);
+        for (size_t i = 0; i < cacheRegs.size() && uses[order[i]] >= 2; i++)
+            _hostReg[order[i]] = cacheRegs[i];
+    }
+
+    void EmitBlock(Word start, const std::vector<DecodedInstruction>& instrs)
+    {
+        X86Emitter& e = _emitter;
+
+        // Budget check before anything is modified
+        e.Load(X86Emitter::Rax, ctxReg, offsetof(Context, executed));
+        e.Op(X86Emitter::Cmp, X86Emitter::Rax, ctxReg, offsetof(Context, limit));
+        size_t body = e.Jcc(X86Emitter::Below);
+        e.Store(ctxReg, offsetof(Context, nextIp), start);
+        e.Patch(e.Jmp(), _return);
+        e.Patch(body, e.Current());
+
+        for (RId reg = 1; reg < 32; reg++)
+            if (_hostReg[reg] != noReg)
+                e.Load(_hostReg[reg], regsReg, RegOffset(reg));
+
+        Word ip = start;
+        Word count = 0;
+        for (const auto& instr : instrs)
+        {
+            count++;
+            EmitInstruction(instr, ip, count);
+            ip += 4;
+        }
+
+        if (!IsBlockEnd(instrs.back()))
+            EmitExit(ip, count);
+    }
+
+    void EmitInstruction(const DecodedInstruction& instr, Word ip, Word count)
+    {
+        X86Emitter& e = _emitter;
+        const Reg rax = X86Emitter::Rax;
+        const Reg rcx = X86Emitter::Rcx;
+        const Reg rdx = X86Emitter::Rdx;
+
+        switch (instr._type)
+        {
+            case IType::Alu:
+                if (instr._dst == 0)
+                    break;
+                if (instr.Has(Instruction::Imm) && instr._src1 == 0)
+                    WriteConst(instr._dst, Executor::GetOperation[size_t(instr._aluFunc)](0, instr._imm));
+                else
+                    EmitAlu(instr);
+                break;
+            case IType::Auipc:
+                WriteConst(instr._dst, ip + instr._imm);
+                break;
+            case IType::Ld:
+                if (instr._dst == 0)
+                    break;
+                Read(rax, instr._src1);
+                e.OpImm(X86Emitter::Add, rax, instr._imm);
+                e.OpImm(X86Emitter::And, rax, Memory::AddressMask());
+                e.LoadIndexed(rax, memReg, rax);
+                Write(instr._dst, rax);
+                break;
+            case IType::St:
+            {
+                Read(rax, instr._src1);
+                e.OpImm(X86Emitter::Add, rax, instr._imm);
+                e.Mov(rdx, rax);
+                e.OpImm(X86Emitter::And, rax, Memory::AddressMask());
+                Read(rcx, instr._src2);
+                e.StoreIndexed(memReg, rax, rcx);
+
+                // Mark the page dirty, stores in a row mostly hit the same page.
+                // Locked as other harts may share the bitmap.
+                e.Mov(rcx, rdx);
+                e.Shift(X86Emitter::Shr, rcx, Memory::PageBits());
+                e.Op(X86Emitter::Cmp, rcx, ctxReg, offsetof(Context, lastDirtyPage));
+                size_t samePage = e.Jcc(X86Emitter::Equal);
+                e.Store(ctxReg, offsetof(Context, lastDirtyPage), rcx);
+                e.Load64(rax, ctxReg, offsetof(Context, dirty));
+                e.LockBts(rax, rcx);
+                e.Patch(samePage, e.Current());
+
+                // Stores into decoded code leave the block right after the store
+                e.Op(X86Emitter::Cmp, rdx, ctxReg, offsetof(Context, codeLow));
+                size_t below = e.Jcc(X86Emitter::Below);
+                e.Op(X86Emitter::Cmp, rdx, ctxReg, offsetof(Context, codeHigh));
+                size_t above = e.Jcc(X86Emitter::AboveEqual);
+                e.Store(ctxReg, offsetof(Context, storeAddr), rdx);
+                e.Store(ctxReg, offsetof(Context, codeWritten), 1u);
+                EmitExit(ip + 4, count, false);
+                e.Patch(below, e.Current());
+                e.Patch(above, e.Current());
+                break;
+            }
+            case IType::J:
+                if (instr._dst != 0)
+                    WriteConst(instr._dst, ip + 4);
+                EmitExit(ip + instr._imm, count);
+                break;
+            case IType::Jr:
+                Read(rax, instr._src1);
+                e.OpImm(X86Emitter::Add, rax, instr._imm);
+                if (instr._dst != 0)
+                    WriteConst(instr._dst, ip + 4);
+                EmitIndirectExit(count);
+                break;
+            case IType::Br:
+                EmitBranch(instr, ip, count);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void EmitAlu(const DecodedInstruction& instr)
+    {
+        X86Emitter& e = _emitter;
+        const Reg rax = X86Emitter::Rax;
+        const Reg rcx = X86Emitter::Rcx;
+        bool imm = instr.Has(Instruction::Imm);
+
+        Read(rax, instr._src1);
+        switch (instr._aluFunc)
+        {
+            case AluFunc::Add: Operate(X86Emitter::Add, instr, imm); break;
+            case AluFunc::Sub: Operate(X86Emitter::Sub, instr, imm); break;
+            case AluFunc::And: Operate(X86Emitter::And, instr, imm); break;
+            case AluFunc::Or:  Operate(X86Emitter::Or, instr, imm); break;
+            case AluFunc::Xor: Operate(X86Emitter::Xor, instr, imm); break;
+            case AluFunc::Slt:
+                Operate(X86Emitter::Cmp, instr, imm);
+                e.Set(X86Emitter::Less, rax);
+                break;
+            case AluFunc::Sltu:
+                Operate(X86Emitter::Cmp, instr, imm);
+                e.Set(X86Emitter::Below, rax);
+                break;
+            case AluFunc::Sll:
+            case AluFunc::Srl:
+            case AluFunc::Sra:
+            {
+                uint8_t digit = instr._aluFunc == AluFunc::Sll ? X86Emitter::Shl :
+                                instr._aluFunc == AluFunc::Srl ? X86Emitter::Shr : X86Emitter::Sar;
+                if (imm)
+                    e.Shift(digit, rax, instr._imm & 31u);
+                else
+                {
+                    Read(rcx, instr._src2);
+                    e.Shift(digit, rax);
+                }
+                break;
+            }
+            case AluFunc::Mul:
+                Read(rcx, instr._src2);
+                e.Imul(rax, rcx);
+                break;
+            default:
+                break;
+        }
+        Write(instr._dst, rax);
+    }
+
+    // rax op= src2 or imm
+    void Operate(X86Emitter::AluOp op, const DecodedInstruction& instr, bool imm)
+    {
+        X86Emitter& e = _emitter;
+        if (imm)
+            e.OpImm(op, X86Emitter::Rax, instr._imm);
+        else if (instr._src2 == 0)
+            e.OpImm(op, X86Emitter::Rax, 0);
+        else if (_hostReg[instr._src2] != noReg)
+            e.Op(op, X86Emitter::Rax, _hostReg[instr._src2]);
+        else
+            e.Op(op, X86Emitter::Rax, regsReg, RegOffset(instr._src2));
+    }
+
+    void EmitBranch(const DecodedInstruction& instr, Word ip, Word count)
+    {
+        X86Emitter& e = _emitter;
+        Word target = ip + instr._imm;
+
+        X86Emitter::Cond cond;
+        switch (instr._brFunc)
+        {
+            case BrFunc::Eq:  cond = X86Emitter::Equal; break;
+            case BrFunc::Neq: cond = X86Emitter::NotEqual; break;
+            case BrFunc::Lt:  cond = X86Emitter::Less; break;
+            case BrFunc::Ge:  cond = X86Emitter::GreaterEqual; break;
+            case BrFunc::Ltu: cond = X86Emitter::Below; break;
+            case BrFunc::Geu: cond = X86Emitter::AboveEqual; break;
+            case BrFunc::AT:
+                EmitExit(target, count);
+                return;
+            default:
+                EmitExit(ip + 4, count);
+                return;
+        }
+
+        Read(X86Emitter::Rax, instr._src1);
+        Operate(X86Emitter::Cmp, instr, false);
+        size_t taken = e.Jcc(cond);
+        EmitExit(ip + 4, count);
+        e.Patch(taken, e.Current());
+        EmitExit(target, count);
+    }
+
+    void WriteBack()
+    {
+        for (RId reg = 1; reg < 32; reg++)
+            if (_hostReg[reg] != noReg && _written[reg])
+                _emitter.Store(regsReg, RegOffset(reg), _hostReg[reg]);
+    }
+
+    // Leaves the block for a known ip, the final jump is linked to the target
+    // block once it is compiled
+    void EmitExit(Word target, Word count, bool link = true)
+    {
+        X86Emitter& e = _emitter;
+        WriteBack();
+        e.OpImm(X86Emitter::Add, ctxReg, offsetof(Context, executed), count);
+        e.Store(ctxReg, offsetof(Context, nextIp), target);
+        size_t rel32 = e.Jmp();
+
+        const uint8_t* code = link ? Lookup(target) : nullptr;
+        e.Patch(rel32, code ? code : _return);
+        if (link && !code)
+            _pendingExits[target].push_back(rel32);
+    }
+
+    // Leaves the block for the ip in eax
+    void EmitIndirectExit(Word count)
+    {
+        X86Emitter& e = _emitter;
+        const Reg rax = X86Emitter::Rax;
+        const Reg rcx = X86Emitter::Rcx;
+
+        WriteBack();
+        e.OpImm(X86Emitter::Add, ctxReg, offsetof(Context, executed), count);
+        e.Store(ctxReg, offsetof(Context, nextIp), rax);
+
+        e.Mov(rcx, rax);
+        e.Shift(X86Emitter::Shr, rcx, 2);
+        e.OpImm(X86Emitter::And, rcx, tableSize - 1);
+        e.Shift(X86Emitter::Shl, rcx, 4);
+        e.Add64(rcx, ctxReg, offsetof(Context, table));
+        e.Op(X86Emitter::Cmp, rax, rcx, offsetof(TableEntry, ip));
+        e.Patch(e.Jcc(X86Emitter::NotEqual), _return);
+        e.Jmp(rcx, offsetof(TableEntry, code));
+    }
+
+    void Read(Reg dst, RId reg)
+    {
+        if (reg == 0)
+            _emitter.Op(X86Emitter::Xor, dst, dst);
+        else if (_hostReg[reg] != noReg)
+            _emitter.Mov(dst, _hostReg[reg]);
+        else
+            _emitter.Load(dst, regsReg, RegOffset(reg));
+    }
+
+    void Write(RId reg, Reg src)
+    {
+        if (reg == 0)
+            return;
+        if (_hostReg[reg] != noReg)
+            _emitter.Mov(_hostReg[reg], src);
+        else
+            _emitter.Store(regsReg, RegOffset(reg), src);
+    }
+
+    void WriteConst(RId reg, Word value)
+    {
+        if (reg == 0)
+            return;
+        if (_hostReg[reg] != noReg)
+            _emitter.Mov(_hostReg[reg], value);
+        else
+            _emitter.Store(regsReg, RegOffset(reg), value);
+    }
+
+    static int32_t RegOffset(RId reg)
+    {
+        return static_cast<int32_t>(reg * sizeof(Word));
+    }
+
+    uint8_t* _buffer = nullptr;
+    X86Emitter _emitter;
+    const uint8_t* _enter = nullptr;
+    const uint8_t* _return = nullptr;
+    std::vector<TableEntry> _table;
+    std::vector<Counter> _counters;
+    std::unordered_map<Word, std::vector<size_t>> _pendingExits;
+    std::array<Reg, 32> _hostReg;
+    std::array<bool, 32> _written;
+#endif
+
+private:
+    Memory& _mem;
+    DecodeCache& _decodeCache;
+    Word _hotThreshold = 0;
+    Word _generation = 0;
+};
+
+#endif //RISCV_SIM_JITENGINE_H
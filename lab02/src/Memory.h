@@ -4,49 +4,89 @@
 
 #include "Instruction.h"
 #include <iostream>
-#include <fstream>
 #include <elf.h>
 #include <cstring>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+// Guest RAM is a single 4 GiB reservation, so every 32-bit guest address is
+// a valid offset and needs no bounds check. Pages are only backed by the OS
+// when they are first touched and start zeroed.
 class Memory
 {
 public:
     Memory()
     {
-        mem.fill(0);
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED)
+            throw std::bad_alloc();
+        mem = static_cast<Word*>(addr);
+        dirty.resize(pageCount / 64);
     }
 
-    bool LoadElf(const std::string& elf_filename)
+    ~Memory()
     {
-        std::ifstream elffile;
-        elffile.open(elf_filename, std::ios::in | std::ios::binary);
+        munmap(mem, size);
+    }
+
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+
+    // Loadable segment of an ELF file, as placed in guest memory
+    struct Segment
+    {
+        Word addr;
+        Word size;
+        bool executable;
+    };
+
+    // Loads PT_LOAD segments of the file, their list goes to segments if given
+    bool LoadElf(const std::string& elf_filename, std::vector<Segment>* segments = nullptr)
+    {
+        // Map the file instead of reading it, aligned parts of the segments
+        // are then mapped into guest memory without copying
+        clear_pages();
+        image.reset();
 
-        if (!elffile.is_open()) {
+        auto image_file = std::make_unique<MappedFile>();
+        MappedFile& file = *image_file;
+        file.fd = open(elf_filename.c_str(), O_RDONLY);
+        if (file.fd < 0) {
             std::cerr << "ERROR: load_elf: failed opening file \"" << elf_filename << "\"" << std::endl;
             return false;
         }
 
-        elffile.seekg(0, elffile.end);
-        size_t buf_sz = elffile.tellg();
-        elffile.seekg(0, elffile.beg);
-
-        // Read the entire file. If it doesn't fit in host memory, it won't fit in the risc-v processor
-        std::vector<char> buf(buf_sz);
-        elffile.read(buf.data(), buf_sz);
-
-        if (!elffile) {
+        struct stat st;
+        if (fstat(file.fd, &st) != 0) {
             std::cerr << "ERROR: load_elf: failed reading elf header" << std::endl;
             return false;
         }
+        size_t buf_sz = st.st_size;
 
         if (buf_sz < sizeof(Elf32_Ehdr)) {
             std::cerr << "ERROR: load_elf: file too small to be a valid elf file" << std::endl;
             return false;
         }
 
+        void* data = mmap(nullptr, buf_sz, PROT_READ, MAP_PRIVATE, file.fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "ERROR: load_elf: failed reading elf header" << std::endl;
+            return false;
+        }
+        file.data = static_cast<char*>(data);
+        file.size = buf_sz;
+        char* buf = file.data;
+
         // make sure the header matches elf32 or elf64
-        Elf32_Ehdr *ehdr = (Elf32_Ehdr *) buf.data();
+        Elf32_Ehdr *ehdr = (Elf32_Ehdr *) buf;
         unsigned char* e_ident = ehdr->e_ident;
         if (e_ident[EI_MAG0] != ELFMAG0
             || e_ident[EI_MAG1] != ELFMAG1
@@ -56,33 +96,256 @@ public:
             return false;
         }
 
+        bool loaded;
         if (e_ident[EI_CLASS] == ELFCLASS32) {
             // 32-bit ELF
-            return this->load_elf_specific<Elf32_Ehdr, Elf32_Phdr>(buf.data(), buf_sz);
+            loaded = this->load_elf_specific<Elf32_Ehdr, Elf32_Phdr>(file, segments);
         } else if (e_ident[EI_CLASS] == ELFCLASS64) {
             // 64-bit ELF
-            return this->load_elf_specific<Elf64_Ehdr, Elf64_Phdr>(buf.data(), buf_sz);
+            loaded = this->load_elf_specific<Elf64_Ehdr, Elf64_Phdr>(file, segments);
         } else {
             std::cerr << "ERROR: load_elf: file is neither 32-bit nor 64-bit" << std::endl;
             return false;
         }
+
+        // The mapping stays as the pristine image for ResetToImage, a file
+        // that failed halfway is dropped again
+        if (loaded)
+            image = std::move(image_file);
+        else
+            clear_pages();
+        return loaded;
+    }
+
+    // Restores every page written since LoadElf to its loaded contents,
+    // the cost is proportional to the number of written pages
+    void ResetToImage()
+    {
+        for (size_t i = 0; i < dirty.size(); i++)
+        {
+            uint64_t bits = dirty[i];
+            dirty[i] = 0;
+            while (bits)
+            {
+                restore_page(i * 64 + __builtin_ctzll(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    bool IsDirty(Word addr) const
+    {
+        return dirty[addr >> (pageBits + 6)] >> (addr >> pageBits & 63u) & 1u;
+    }
+
+    // Pages loaded or written since LoadElf, every other page is zero
+    std::vector<Word> UsedPages() const
+    {
+        std::vector<Word> pages;
+        for (const auto& slice : slices)
+            for (size_t page = slice.addr >> pageBits; page << pageBits < slice.addr + slice.length; page++)
+                pages.push_back(Word(page << pageBits));
+        for (size_t i = 0; i < dirty.size(); i++)
+            for (uint64_t bits = dirty[i]; bits; bits &= bits - 1)
+                pages.push_back(Word((i * 64 + __builtin_ctzll(bits)) << pageBits));
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+        return pages;
+    }
+
+    // Whole-page access for snapshots, addr is page aligned
+    const void* Page(Word addr) const
+    {
+        return reinterpret_cast<const char*>(mem) + addr;
+    }
+
+    void WritePage(Word addr, const void* data)
+    {
+        mark_dirty(addr);
+        std::memcpy(reinterpret_cast<char*>(mem) + addr, data, pageSize);
+    }
+
+    static constexpr size_t PageSize()
+    {
+        return pageSize;
+    }
+
+    // Bitmap of written pages for generated code, bit n stands for page n
+    uint64_t* DirtyMap()
+    {
+        return dirty.data();
+    }
+
+    static constexpr Word PageBits()
+    {
+        return pageBits;
     }
     Word Request(Word ip)
     {
         return mem[ToWordAddr(ip)];
     }
 
-    void Request(InstructionPtr& instr)
+    void Store(Word addr, Word data)
+    {
+        mark_dirty(addr);
+        mem[ToWordAddr(addr)] = data;
+    }
+
+    // Raw guest memory for generated code, addresses have to be masked with AddressMask
+    Word* Data()
     {
-        if (instr->_type == IType::Ld)
-            instr->_data = mem[ToWordAddr(instr->_addr)];
-        else if (instr->_type == IType::St)
-            mem[ToWordAddr(instr->_addr)] = instr->_data;
+        return mem;
+    }
+
+    static constexpr Word AddressMask()
+    {
+        return ~3u;
+    }
+
+    // A extension: read-modify-write of the word at addr done with a host
+    // atomic, so harts on other threads see it whole. Returns the old value.
+    Word AtomicRmw(AmoFunc func, Word addr, Word value)
+    {
+        mark_dirty(addr);
+        std::atomic_ref<Word> word(mem[ToWordAddr(addr)]);
+        switch (func)
+        {
+            case AmoFunc::Swap: return word.exchange(value);
+            case AmoFunc::Add:  return word.fetch_add(value);
+            case AmoFunc::Xor:  return word.fetch_xor(value);
+            case AmoFunc::And:  return word.fetch_and(value);
+            case AmoFunc::Or:   return word.fetch_or(value);
+            default: break;
+        }
+        Word old = word.load();
+        while (!word.compare_exchange_weak(old, AmoResult(func, old, value)))
+            ;
+        return old;
+    }
+
+    Word AtomicLoad(Word addr)
+    {
+        return std::atomic_ref<Word>(mem[ToWordAddr(addr)]).load();
+    }
+
+    // Stores desired if the word still holds expected
+    bool CompareExchange(Word addr, Word expected, Word desired)
+    {
+        mark_dirty(addr);
+        return std::atomic_ref<Word>(mem[ToWordAddr(addr)]).compare_exchange_strong(expected, desired);
+    }
+
+    // Value an AMO writes back, old is the value in memory
+    static Word AmoResult(AmoFunc func, Word old, Word value)
+    {
+        switch (func)
+        {
+            case AmoFunc::Swap: return value;
+            case AmoFunc::Add:  return old + value;
+            case AmoFunc::Xor:  return old ^ value;
+            case AmoFunc::And:  return old & value;
+            case AmoFunc::Or:   return old | value;
+            case AmoFunc::Min:  return SignedWord(old) < SignedWord(value) ? old : value;
+            case AmoFunc::Max:  return SignedWord(old) > SignedWord(value) ? old : value;
+            case AmoFunc::Minu: return std::min(old, value);
+            case AmoFunc::Maxu: return std::max(old, value);
+            default:            return old;
+        }
+    }
+
+    void Request(Instruction& instr)
+    {
+        if (instr._type == IType::Ld)
+            instr._data = mem[ToWordAddr(instr._addr)];
+        else if (instr._type == IType::St)
+            Store(instr._addr, instr._data);
     }
 
 private:
+    struct MappedFile
+    {
+        int fd = -1;
+        char* data = nullptr;
+        size_t size = 0;
+
+        ~MappedFile()
+        {
+            if (data)
+                munmap(data, size);
+            if (fd >= 0)
+                close(fd);
+        }
+    };
+
+    // Part of the file copied or mapped to guest memory
+    struct Slice
+    {
+        size_t offset;
+        size_t addr;
+        size_t length;
+    };
+
+    // Harts sharing the memory may mark pages of the same word at once,
+    // the read-modify-write is only needed for the first store to a page
+    void mark_dirty(Word addr)
+    {
+        uint64_t& word = dirty[addr >> (pageBits + 6)];
+        uint64_t bit = uint64_t(1) << (addr >> pageBits & 63u);
+        if (!(__atomic_load_n(&word, __ATOMIC_RELAXED) & bit))
+            __atomic_fetch_or(&word, bit, __ATOMIC_RELAXED);
+    }
+
+    // Zeroes every page loaded or written so far and forgets about them,
+    // the pages go back to the OS along with mappings of the old file
+    void clear_pages() {
+        auto memptr = reinterpret_cast<char*>(mem);
+        for (Word page : UsedPages()) {
+            if (mmap(memptr + page, pageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+                std::memset(memptr + page, 0, pageSize);
+        }
+        slices.clear();
+        std::fill(dirty.begin(), dirty.end(), 0);
+    }
+
+    void restore_page(size_t page) {
+        auto memptr = reinterpret_cast<char*>(mem);
+        size_t start = page << pageBits;
+        size_t end = start + pageSize;
+        std::memset(memptr + start, 0, pageSize);
+        for (const auto& slice : slices) {
+            size_t from = std::max(start, slice.addr);
+            size_t to = std::min(end, slice.addr + slice.length);
+            if (from < to)
+                std::memcpy(memptr + from, image->data + slice.offset + (from - slice.addr), to - from);
+        }
+    }
+
+    // Whole pages of the slice are mapped copy-on-write straight from the file
+    // when file offset and address agree modulo the page size, only the
+    // unaligned head and tail are copied
+    void load_slice(const MappedFile& file, size_t offset, size_t addr, size_t length) {
+        slices.push_back(Slice{offset, addr, length});
+        auto memptr = reinterpret_cast<char*>(mem);
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t head = (page - addr % page) % page;
+        if (offset % page == addr % page && head < length) {
+            size_t pages = (length - head) / page * page;
+            if (pages != 0 && mmap(memptr + addr + head, pages, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_FIXED, file.fd, offset + head) != MAP_FAILED) {
+                size_t tail = head + pages;
+                std::memcpy(memptr + addr, file.data + offset, head);
+                std::memcpy(memptr + addr + tail, file.data + offset + tail, length - tail);
+                return;
+            }
+        }
+        std::memcpy(memptr + addr, file.data + offset, length);
+    }
+
     template <typename Elf_Ehdr, typename Elf_Phdr>
-    bool load_elf_specific(char* buf, size_t buf_sz) {
+    bool load_elf_specific(const MappedFile& file, std::vector<Segment>* segments) {
+        char* buf = file.data;
+        size_t buf_sz = file.size;
         // 64-bit ELF
         Elf_Ehdr *ehdr = (Elf_Ehdr*) buf;
         Elf_Phdr *phdr = (Elf_Phdr*) (buf + ehdr->e_phoff);
@@ -90,7 +353,7 @@ private:
             std::cerr << "ERROR: load_elf: file too small for expected number of program header tables" << std::endl;
             return false;
         }
-        auto memptr = reinterpret_cast<char*>(mem.data());
+        auto memptr = reinterpret_cast<char*>(mem);
         // loop through program header tables
         for (int i = 0 ; i < ehdr->e_phnum ; i++) {
             if ((phdr[i].p_type == PT_LOAD) && (phdr[i].p_memsz > 0)) {
@@ -98,8 +361,12 @@ private:
                     std::cerr << "ERROR: load_elf: file size is larger than memory size" << std::endl;
                     return false;
                 }
+                if (phdr[i].p_memsz > size || phdr[i].p_paddr > size - phdr[i].p_memsz) {
+                    std::cerr << "ERROR: load_elf: segment is outside of the 32-bit address space" << std::endl;
+                    return false;
+                }
                 if (phdr[i].p_filesz > 0) {
-                    if (phdr[i].p_offset + phdr[i].p_filesz > buf_sz) {
+                    if (phdr[i].p_filesz > buf_sz || phdr[i].p_offset > buf_sz - phdr[i].p_filesz) {
                         std::cerr << "ERROR: load_elf: file section overflow" << std::endl;
                         return false;
                     }
@@ -107,13 +374,17 @@ private:
                     // start of file section: buf + phdr[i].p_offset
                     // end of file section: buf + phdr[i].p_offset + phdr[i].p_filesz
                     // start of memory: phdr[i].p_paddr
-                    std::memcpy(memptr + phdr[i].p_paddr, buf + phdr[i].p_offset, phdr[i].p_filesz);
+                    load_slice(file, phdr[i].p_offset, phdr[i].p_paddr, phdr[i].p_filesz);
                 }
                 if (phdr[i].p_memsz > phdr[i].p_filesz) {
                     // copy 0's to fill up remaining memory
                     size_t zeros_sz = phdr[i].p_memsz - phdr[i].p_filesz;
                     std::memset(memptr + phdr[i].p_paddr + phdr[i].p_filesz, 0, zeros_sz);
                 }
+                if (segments) {
+                    segments->push_back(Segment{Word(phdr[i].p_paddr), Word(phdr[i].p_memsz),
+                                                (phdr[i].p_flags & PF_X) != 0});
+                }
             }
         }
         return true;
@@ -121,8 +392,14 @@ private:
 
 
     static Word ToWordAddr(Word ip) { return ip >> 2u; }
-    static constexpr size_t size = 128*1024; // memory size in 4-byte words
-    std::array<Word, size> mem;
+    static constexpr size_t size = size_t(1) << 32u; // memory size in bytes
+    static constexpr size_t pageBits = 12;           // dirty pages are 4 KiB
+    static constexpr size_t pageSize = size_t(1) << pageBits;
+    static constexpr size_t pageCount = size >> pageBits;
+    Word* mem = nullptr;
+    std::vector<uint64_t> dirty;
+    std::vector<Slice> slices;
+    std::unique_ptr<MappedFile> image;
 };
 
 #endif //RISCV_SIM_DATAMEMORY_H
@@ -0,0 +1,85 @@
+#ifndef RISCV_SIM_OPTIONLIST_H
+#define RISCV_SIM_OPTIONLIST_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <cstdlib>
+#include <iostream>
+
+#include "BaseTypes.h"
+
+// Parses option strings of timing models, "size=32k,ways=4,policy=lru".
+// Numbers take k and m suffixes. Every key has to be asked for, the rest
+// is reported by Check.
+class OptionList
+{
+public:
+    explicit OptionList(const std::string& text)
+    {
+        size_t start = 0;
+        while (start < text.size())
+        {
+            size_t end = text.find(',', start);
+            if (end == std::string::npos)
+                end = text.size();
+            std::string item = text.substr(start, end - start);
+            size_t eq = item.find('=');
+            if (eq == std::string::npos)
+                _options[item] = "";
+            else
+                _options[item.substr(0, eq)] = item.substr(eq + 1);
+            start = end + 1;
+        }
+    }
+
+    std::string Get(const std::string& key, const std::string& fallback)
+    {
+        _used.insert(key);
+        auto it = _options.find(key);
+        return it == _options.end() ? fallback : it->second;
+    }
+
+    Word Get(const std::string& key, Word fallback)
+    {
+        std::string value = Get(key, std::string());
+        if (value.empty())
+            return fallback;
+
+        char* end = nullptr;
+        unsigned long number = std::strtoul(value.c_str(), &end, 0);
+        if (*end == 'k' || *end == 'K')
+            number <<= 10u;
+        else if (*end == 'm' || *end == 'M')
+            number <<= 20u;
+        else if (*end != '\0')
+            _bad.insert(key);
+        return Word(number);
+    }
+
+    // Reports unknown keys and malformed numbers, what names the model
+    bool Check(const std::string& what) const
+    {
+        bool ok = true;
+        for (const auto& [key, value] : _options)
+            if (_used.count(key) == 0)
+                ok = Error(what, "unknown option \"" + key + "\"");
+        for (const auto& key : _bad)
+            ok = Error(what, "\"" + key + "\" has to be a number");
+        return ok;
+    }
+
+    // Always false, so that parsers can write ok = Error(...)
+    static bool Error(const std::string& what, const std::string& message)
+    {
+        std::cerr << "ERROR: " << what << ": " << message << std::endl;
+        return false;
+    }
+
+private:
+    std::map<std::string, std::string> _options;
+    std::set<std::string> _used;
+    std::set<std::string> _bad;
+};
+
+#endif //RISCV_SIM_OPTIONLIST_H
@@ -0,0 +1,354 @@
+#ifndef RISCV_SIM_OUTOFORDERTIMING_H
+#define RISCV_SIM_OUTOFORDERTIMING_H
+
+#include <queue>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <iostream>
+#include <iomanip>
+
+#include "TimingModel.h"
+#include "OptionList.h"
+
+// Trace driven out-of-order superscalar core. Retired instructions come in
+// program order and get the cycles they are fetched, dispatched into the
+// ROB, issue queue and load/store queue, issued, completed and committed.
+// Renaming leaves only true dependences, through registers and through
+// stores to the same word, with as many physical registers as the ROB
+// needs. Fetch follows the predictor and restarts once a mispredicted
+// transfer completes. Without a predictor branches are predicted not taken.
+class OutOfOrderTiming : public TimingModel
+{
+public:
+    // Cycles dispatch waits for a full structure, hpmcounter3 and up
+    enum Stall
+    {
+        RobFull,
+        IssueQueueFull,
+        LoadStoreQueueFull,
+        Stalls
+    };
+
+    struct Config
+    {
+        Word robSize = 64;
+        Word issueQueueSize = 32;
+        Word loadStoreQueueSize = 16;
+        Word fetchWidth = 4;
+        Word issueWidth = 4;
+        Word commitWidth = 4;
+        Word frontendDepth = 3; // fetch to dispatch, also the refill after a redirect
+        Word mulLatency = 3;
+        Word divLatency = 20;
+        Word loadLatency = 2;
+    };
+
+    // "rob=64,iq=32,lsq=16,fetch=4,issue=4,commit=4,depth=3,mul=3,div=20,load=2",
+    // what names the model in errors
+    static std::optional<Config> Parse(const std::string& text, const std::string& what)
+    {
+        OptionList options(text);
+        Config config;
+        config.robSize = options.Get("rob", config.robSize);
+        config.issueQueueSize = options.Get("iq", config.issueQueueSize);
+        config.loadStoreQueueSize = options.Get("lsq", config.loadStoreQueueSize);
+        config.fetchWidth = options.Get("fetch", config.fetchWidth);
+        config.issueWidth = options.Get("issue", config.issueWidth);
+        config.commitWidth = options.Get("commit", config.commitWidth);
+        config.frontendDepth = options.Get("depth", config.frontendDepth);
+        config.mulLatency = options.Get("mul", config.mulLatency);
+        config.divLatency = options.Get("div", config.divLatency);
+        config.loadLatency = options.Get("load", config.loadLatency);
+
+        bool ok = options.Check(what);
+        if (config.robSize == 0 || config.issueQueueSize == 0 || config.loadStoreQueueSize == 0)
+            ok = OptionList::Error(what, "rob, iq and lsq need at least one entry");
+        if (config.fetchWidth == 0 || config.issueWidth == 0 || config.commitWidth == 0 ||
+            config.fetchWidth > 255 || config.issueWidth > 255)
+            ok = OptionList::Error(what, "widths have to be between 1 and 255");
+        if (config.mulLatency == 0 || config.divLatency == 0 || config.loadLatency == 0)
+            ok = OptionList::Error(what, "latencies have to be at least 1");
+
+        if (!ok)
+            return std::nullopt;
+        return config;
+    }
+
+    OutOfOrderTiming(const Config& config, Cache* icache, Cache* dcache, BranchPredictor* predictor)
+        : _config(config), _icache(icache), _dcache(dcache), _predictor(predictor),
+          _rob(config.robSize, -1), _loadStoreQueue(config.loadStoreQueueSize, -1),
+          _robOccupancy(robBuckets)
+    {
+
+    }
+
+    void Retire(const Instruction& instr, Word ip) override
+    {
+        // Fetch groups of fetchWidth, a taken transfer ends the group
+        int64_t fetch = std::max(_fetchCycle, _redirect);
+        if (fetch != _fetchCycle)
+            _fetched = 0;
+        if (_icache)
+            fetch += _icache->Access(ip, false);
+        _fetchCycle = fetch;
+        if (++_fetched == _config.fetchWidth || (IsControl(instr) && instr._nextIp != ip + 4))
+        {
+            _fetchCycle++;
+            _fetched = 0;
+        }
+
+        // Dispatch in order, as wide as fetch
+        int64_t dispatch = std::max(fetch + _config.frontendDepth, _dispatchCycle);
+        if (dispatch == _dispatchCycle && _dispatched == _config.fetchWidth)
+            dispatch++;
+        bool memory = IsMemory(instr);
+        int64_t ready = dispatch;
+        Stall cause = Stalls;
+        auto hold = [&](int64_t until, Stall stall) {
+            if (until > dispatch)
+            {
+                dispatch = until;
+                cause = stall;
+            }
+        };
+        hold(_rob[_robHead], RobFull);
+        if (memory)
+            hold(_loadStoreQueue[_loadStoreHead], LoadStoreQueueFull);
+        while (!_issueQueue.empty() && _issueQueue.top() <= dispatch)
+            _issueQueue.pop();
+        if (_issueQueue.size() >= _config.issueQueueSize)
+        {
+            hold(_issueQueue.top(), IssueQueueFull);
+            _issueQueue.pop();
+        }
+        if (cause != Stalls)
+            RecordStall(cause, dispatch - ready);
+        if (dispatch != _dispatchCycle)
+            _dispatched = 0;
+        _dispatchCycle = dispatch;
+        _dispatched++;
+        RecordOccupancy(dispatch);
+
+        // Issue once the operands are there, as wide as the issue width
+        int64_t operands = dispatch + 1;
+        if (instr.Has(Instruction::Src1))
+            operands = std::max(operands, _registerReady[instr._src1]);
+        if (instr.Has(Instruction::Src2))
+            operands = std::max(operands, _registerReady[instr._src2]);
+        auto store = _storeReady.end();
+        if (memory)
+            store = _storeReady.find(instr._addr & ~3u);
+        if (instr._type != IType::St && store != _storeReady.end())
+            operands = std::max(operands, store->second); // forwarded from the store
+        int64_t issue = Issue(operands);
+        _issueQueue.push(issue);
+
+        Word latency = 1;
+        if (IsMultiply(instr))
+            latency = _config.mulLatency;
+        else if (IsDivide(instr))
+            latency = _config.divLatency;
+        if (memory)
+        {
+            // Stores write the cache from the store buffer after commit
+            Word penalty = _dcache ? _dcache->Access(instr._addr, IsWrite(instr)) : 0;
+            if (instr._type != IType::St)
+                latency = _config.loadLatency + penalty;
+        }
+        int64_t complete = issue + latency;
+        if (instr._dst != 0)
+            _registerReady[instr._dst] = complete;
+        if (IsWrite(instr))
+            _storeReady[instr._addr & ~3u] = complete;
+
+        // Commit in order, as wide as the commit width
+        int64_t commit = std::max(complete, _commitCycle);
+        if (commit == _commitCycle && _committed == _config.commitWidth)
+            commit++;
+        if (commit != _commitCycle)
+            _committed = 0;
+        _commitCycle = commit;
+        _committed++;
+
+        _rob[_robHead] = commit;
+        _robHead = (_robHead + 1) % _rob.size();
+        if (memory)
+        {
+            _loadStoreQueue[_loadStoreHead] = commit;
+            _loadStoreHead = (_loadStoreHead + 1) % _loadStoreQueue.size();
+        }
+
+        if (Redirects(instr, ip))
+        {
+            _redirect = complete + 1;
+            _mispredicts++;
+        }
+        _instructions++;
+    }
+
+    uint64_t Cycles() const override
+    {
+        return uint64_t(_commitCycle + 1);
+    }
+
+    uint64_t Counter(Word index) const override
+    {
+        return index >= 3 && index < 3 + Stalls ? _stalls[index - 3].cycles : 0;
+    }
+
+    uint64_t GetStalls(Stall stall) const
+    {
+        return _stalls[stall].cycles;
+    }
+
+    void Report(std::ostream& out) const override
+    {
+        static const char* const stalls[] = {"rob full", "iq full", "lsq full"};
+        ReportCycles(out, Cycles(), _instructions);
+        out << "ooo: rob " << _config.robSize << ", iq " << _config.issueQueueSize << ", lsq "
+            << _config.loadStoreQueueSize << ", fetch/issue/commit " << _config.fetchWidth << "/"
+            << _config.issueWidth << "/" << _config.commitWidth << ", IPC " << std::fixed << std::setprecision(3)
+            << (_instructions ? double(_instructions) / Cycles() : 0.0) << ", mispredicts " << _mispredicts << "\n";
+
+        out << "    rob occupancy at dispatch:";
+        for (size_t bucket = 0; bucket < robBuckets; bucket++)
+            out << " " << BucketStart(bucket) << "+ " << Percent(_robOccupancy[bucket], _instructions) << "%";
+        out << "\n";
+
+        for (int stall = RobFull; stall < Stalls; stall++)
+        {
+            const StallStats& stats = _stalls[stall];
+            out << "    " << stalls[stall] << ": " << stats.cycles << " cycles in " << stats.events << " stalls";
+            for (size_t bucket = 0; bucket < std::size(stats.lengths); bucket++)
+                if (stats.lengths[bucket])
+                    out << ", " << LengthLabel(bucket) << ": " << stats.lengths[bucket];
+            out << "\n";
+        }
+        if (_icache)
+            _icache->Report(out, "icache");
+        if (_dcache)
+            _dcache->Report(out, "dcache");
+        if (_predictor)
+            _predictor->Report(out);
+    }
+
+private:
+    // Lengths in power of two buckets, 1, 2-3, ... 64+
+    struct StallStats
+    {
+        uint64_t cycles = 0;
+        uint64_t events = 0;
+        uint64_t lengths[7] = {};
+    };
+
+    static constexpr size_t robBuckets = 8;
+    static constexpr size_t calendarSize = 1u << 16u;
+
+    static std::string Percent(uint64_t part, uint64_t whole)
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%.1f", whole ? 100.0 * part / whole : 0.0);
+        return text;
+    }
+
+    // 1, 2-3, 4-7, ... 64+
+    static std::string LengthLabel(size_t bucket)
+    {
+        if (bucket == 0)
+            return "1";
+        if (bucket + 1 == std::size(StallStats{}.lengths))
+            return std::to_string(1u << bucket) + "+";
+        return std::to_string(1u << bucket) + "-" + std::to_string((2u << bucket) - 1);
+    }
+
+    Word BucketStart(size_t bucket) const
+    {
+        return Word((uint64_t(_config.robSize) * bucket + robBuckets - 1) / robBuckets);
+    }
+
+    void RecordStall(Stall stall, int64_t cycles)
+    {
+        StallStats& stats = _stalls[stall];
+        stats.cycles += cycles;
+        stats.events++;
+        size_t bucket = std::min<size_t>(63 - __builtin_clzll(uint64_t(cycles)), std::size(stats.lengths) - 1);
+        stats.lengths[bucket]++;
+    }
+
+    // Instructions in the ROB when this one enters it, the ring holds the
+    // commit cycles of the last robSize instructions
+    void RecordOccupancy(int64_t dispatch)
+    {
+        size_t occupancy = 0;
+        for (int64_t commit : _rob)
+            occupancy += commit > dispatch;
+        _robOccupancy[std::min(occupancy * robBuckets / _config.robSize, robBuckets - 1)]++;
+    }
+
+    // The first cycle from ready with an issue slot left. Issue cycles stay
+    // within a window far smaller than the calendar, old slots get reused.
+    int64_t Issue(int64_t ready)
+    {
+        for (int64_t cycle = ready;; cycle++)
+        {
+            Slot& slot = _calendar[size_t(cycle) % calendarSize];
+            if (slot.cycle != cycle)
+                slot = Slot{cycle, 0};
+            if (slot.issued < _config.issueWidth)
+            {
+                slot.issued++;
+                return cycle;
+            }
+        }
+    }
+
+    bool Redirects(const Instruction& instr, Word ip)
+    {
+        if (!IsControl(instr))
+            return false;
+        if (_predictor)
+            return _predictor->Mispredicts(instr, ip);
+        return instr._nextIp != ip + 4;
+    }
+
+    struct Slot
+    {
+        int64_t cycle = -1;
+        Word issued = 0;
+    };
+
+    Config _config;
+    Cache* _icache;
+    Cache* _dcache;
+    BranchPredictor* _predictor;
+
+    int64_t _fetchCycle = 0;
+    Word _fetched = 0;
+    int64_t _redirect = 0;
+    int64_t _dispatchCycle = 0;
+    Word _dispatched = 0;
+    int64_t _commitCycle = -1;
+    Word _committed = 0;
+
+    std::vector<int64_t> _rob;            // commit cycles, oldest at _robHead
+    size_t _robHead = 0;
+    std::vector<int64_t> _loadStoreQueue; // same for memory instructions
+    size_t _loadStoreHead = 0;
+    std::priority_queue<int64_t, std::vector<int64_t>, std::greater<>> _issueQueue; // issue cycles
+    std::vector<Slot> _calendar = std::vector<Slot>(calendarSize);
+    int64_t _registerReady[32] = {};
+    std::unordered_map<Word, int64_t> _storeReady;
+
+    std::vector<uint64_t> _robOccupancy;
+    StallStats _stalls[Stalls];
+    uint64_t _mispredicts = 0;
+    uint64_t _instructions = 0;
+};
+
+#endif //RISCV_SIM_OUTOFORDERTIMING_H
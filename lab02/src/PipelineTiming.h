@@ -0,0 +1,259 @@
+#ifndef RISCV_SIM_PIPELINETIMING_H
+#define RISCV_SIM_PIPELINETIMING_H
+
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+#include "TimingModel.h"
+#include "OptionList.h"
+
+// Classic in-order IF/ID/EX/MEM/WB pipeline. Instead of stepping cycles it
+// computes when each retired instruction enters every stage: a stage takes
+// an instruction once the previous one has left it, EX waits for operands
+// and fetch waits for redirects. Caches stretch IF and MEM, multiplies and
+// divides hold EX. Without a predictor branches are predicted not taken.
+class PipelineTiming : public TimingModel
+{
+public:
+    enum Stage
+    {
+        Fetch,
+        Decode,
+        Execute,
+        MemoryAccess,
+        WriteBack,
+        Stages
+    };
+
+    // Read through hpmcounter3 and up, in this order
+    enum Stall
+    {
+        Data,       // waiting for operands
+        Control,    // fetch redirected after a taken or mispredicted transfer
+        Structural, // multi-cycle units and busy stages
+        ICache,
+        DCache,
+        Stalls
+    };
+
+    enum class Forwarding
+    {
+        None, // through the register file only, written in the first half of WB
+        Ex,   // EX/MEM -> EX, ALU results
+        Mem,  // MEM/WB -> EX, load results and ALU results a cycle later
+        Full,
+    };
+
+    struct Config
+    {
+        Forwarding forwarding = Forwarding::Full;
+        Stage resolve = Execute; // where branches and jalr redirect fetch, jal always does in ID
+        Word mulLatency = 3;
+        Word divLatency = 20;
+    };
+
+    // "forward=full|ex|mem|none,resolve=id|ex|mem,mul=3,div=20", what names
+    // the model in errors
+    static std::optional<Config> Parse(const std::string& text, const std::string& what)
+    {
+        OptionList options(text);
+        Config config;
+        config.mulLatency = options.Get("mul", config.mulLatency);
+        config.divLatency = options.Get("div", config.divLatency);
+        std::string forward = options.Get("forward", std::string("full"));
+        std::string resolve = options.Get("resolve", std::string("ex"));
+
+        bool ok = options.Check(what);
+        if (forward == "full")
+            config.forwarding = Forwarding::Full;
+        else if (forward == "ex")
+            config.forwarding = Forwarding::Ex;
+        else if (forward == "mem")
+            config.forwarding = Forwarding::Mem;
+        else if (forward == "none")
+            config.forwarding = Forwarding::None;
+        else
+            ok = OptionList::Error(what, "forward has to be full, ex, mem or none");
+
+        if (resolve == "id")
+            config.resolve = Decode;
+        else if (resolve == "ex")
+            config.resolve = Execute;
+        else if (resolve == "mem")
+            config.resolve = MemoryAccess;
+        else
+            ok = OptionList::Error(what, "resolve has to be id, ex or mem");
+
+        if (config.mulLatency == 0 || config.divLatency == 0)
+            ok = OptionList::Error(what, "latencies have to be at least 1");
+
+        if (!ok)
+            return std::nullopt;
+        return config;
+    }
+
+    // The predictor only decides whether fetch is redirected, its penalty
+    // is replaced by the bubbles up to the resolve stage
+    PipelineTiming(const Config& config, Cache* icache, Cache* dcache, BranchPredictor* predictor)
+        : _config(config), _icache(icache), _dcache(dcache), _predictor(predictor)
+    {
+        // A phantom instruction ahead of the first one, which then
+        // enters IF at cycle 0
+        for (int stage = Fetch; stage < Stages; stage++)
+            _enter[stage] = int64_t(stage) - 1;
+    }
+
+    void Retire(const Instruction& instr, Word ip) override
+    {
+        Word latency[Stages] = {1, 1, ExecuteLatency(instr), 1, 1};
+        if (_icache)
+            latency[Fetch] += _icache->Access(ip, false);
+        if (_dcache && IsMemory(instr))
+            latency[MemoryAccess] += _dcache->Access(instr._addr, IsWrite(instr));
+
+        bool store = instr._type == IType::St || instr._type == IType::Amo;
+        bool decodeBranch = _config.resolve == Decode && (instr._type == IType::Br || instr._type == IType::Jr);
+        int64_t operands = 0;
+        if (instr.Has(Instruction::Src1))
+            operands = _ready[instr._src1] + decodeBranch;
+        if (instr.Has(Instruction::Src2) && !store)
+            operands = std::max(operands, _ready[instr._src2] + decodeBranch);
+        int64_t storeData = instr.Has(Instruction::Src2) && store ? _ready[instr._src2] : 0;
+
+        // Each stage is entered once the previous instruction has left it,
+        // later if a stall holds the instruction back
+        int64_t enter[Stages];
+        std::optional<Stall> cause[Stages];
+        for (int stage = Fetch; stage < Stages; stage++)
+        {
+            int64_t time = stage + 1 < Stages ? _enter[stage + 1] : _enter[stage] + 1;
+            auto hold = [&](int64_t until, Stall stall) {
+                if (until > time)
+                {
+                    time = until;
+                    cause[stage] = stall;
+                }
+            };
+            if (stage == Fetch)
+                hold(_redirect, Control);
+            else if (latency[stage - 1] > 1)
+                hold(enter[stage - 1] + latency[stage - 1], LatencyCause(Stage(stage - 1)));
+            else
+                time = std::max(time, enter[stage - 1] + 1);
+            if (stage == Execute)
+                hold(operands, Data);
+            if (stage == MemoryAccess)
+                hold(storeData, Data);
+            enter[stage] = time;
+        }
+
+        // Cycles the instruction retires later than right after the previous
+        // one go to the last stall that held it back
+        int64_t excess = enter[WriteBack] - _enter[WriteBack] - 1;
+        if (excess > 0)
+        {
+            int stage = WriteBack;
+            while (stage > Fetch && !cause[stage])
+                stage--;
+            _stalls[cause[stage].value_or(Structural)] += excess;
+        }
+
+        if (instr._dst != 0)
+            _ready[instr._dst] = Ready(instr, enter, latency);
+
+        if (Redirects(instr, ip))
+        {
+            Stage stage = instr._type == IType::J ? Decode : _config.resolve;
+            _redirect = enter[stage] + latency[stage];
+        }
+        std::copy(enter, enter + Stages, _enter);
+        _instructions++;
+    }
+
+    uint64_t Cycles() const override
+    {
+        return uint64_t(_enter[WriteBack] + 1);
+    }
+
+    uint64_t Counter(Word index) const override
+    {
+        return index >= 3 && index < 3 + Stalls ? _stalls[index - 3] : 0;
+    }
+
+    uint64_t GetStalls(Stall stall) const
+    {
+        return _stalls[stall];
+    }
+
+    void Report(std::ostream& out) const override
+    {
+        static const char* const forwarding[] = {"none", "ex", "mem", "full"};
+        static const char* const stages[] = {"if", "id", "ex", "mem", "wb"};
+        static const char* const stalls[] = {"data", "control", "structural", "icache", "dcache"};
+        ReportCycles(out, Cycles(), _instructions);
+        out << "pipeline: forwarding " << forwarding[int(_config.forwarding)] << ", branches resolved in "
+            << stages[_config.resolve] << ", mul " << _config.mulLatency << ", div " << _config.divLatency << "\n"
+            << "    stall cycles";
+        for (int stall = Data; stall < Stalls; stall++)
+            out << " " << stalls[stall] << " " << _stalls[stall];
+        out << "\n";
+        if (_icache)
+            _icache->Report(out, "icache");
+        if (_dcache)
+            _dcache->Report(out, "dcache");
+        if (_predictor)
+            _predictor->Report(out);
+    }
+
+private:
+    static Stall LatencyCause(Stage stage)
+    {
+        return stage == Fetch ? ICache : stage == MemoryAccess ? DCache : Structural;
+    }
+
+    Word ExecuteLatency(const Instruction& instr) const
+    {
+        if (IsMultiply(instr))
+            return _config.mulLatency;
+        return IsDivide(instr) ? _config.divLatency : 1;
+    }
+
+    // The first cycle a consumer can spend in EX with the result
+    int64_t Ready(const Instruction& instr, const int64_t* enter, const Word* latency) const
+    {
+        int64_t registerFile = enter[WriteBack] + 1;
+        int64_t memEnd = enter[MemoryAccess] + latency[MemoryAccess];
+        bool ex = _config.forwarding == Forwarding::Ex || _config.forwarding == Forwarding::Full;
+        bool mem = _config.forwarding == Forwarding::Mem || _config.forwarding == Forwarding::Full;
+        if (instr._type == IType::Ld || instr._type == IType::Amo)
+            return mem ? memEnd : registerFile;
+        if (ex)
+            return enter[Execute] + latency[Execute];
+        return mem ? memEnd : registerFile;
+    }
+
+    bool Redirects(const Instruction& instr, Word ip)
+    {
+        if (!IsControl(instr))
+            return false;
+        if (_predictor)
+            return _predictor->Mispredicts(instr, ip);
+        return instr._nextIp != ip + 4;
+    }
+
+    Config _config;
+    Cache* _icache;
+    Cache* _dcache;
+    BranchPredictor* _predictor;
+    int64_t _enter[Stages];    // of the previous instruction
+    int64_t _redirect = 0;     // earliest fetch of the next instruction
+    int64_t _ready[32] = {};
+    uint64_t _stalls[Stalls] = {};
+    uint64_t _instructions = 0;
+};
+
+#endif //RISCV_SIM_PIPELINETIMING_H
@@ -3,6 +3,7 @@
 #define RISCV_SIM_REGISTERFILE_H
 
 #include "Instruction.h"
+#include <array>
 
 class RegisterFile
 {
@@ -12,18 +13,23 @@ public:
         _r.fill(0);
     }
 
-    void Read(InstructionPtr& instr)
+    void Read(Instruction& instr)
     {
-        if (instr->_src1)
-            instr->_src1Val = _r.at(instr->_src1.value());
+        if (instr.Has(Instruction::Src1))
+            instr._src1Val = _r[instr._src1];
 
-        if (instr->_src2)
-            instr->_src2Val = _r.at(instr->_src2.value());
+        if (instr.Has(Instruction::Src2))
+            instr._src2Val = _r[instr._src2];
     }
-    void Write(InstructionPtr& instr)
+    void Write(Instruction& instr)
     {
-        if (instr->_dst)
-            _r.at(instr->_dst.value()) = instr->_data;
+        if (instr._dst != 0)
+            _r[instr._dst] = instr._data;
+    }
+    // Direct access for the block interpreter, which must keep x0 zero itself
+    std::array<Word, 32>& Registers()
+    {
+        return _r;
     }
 private:
     std::array<Word, 32> _r;
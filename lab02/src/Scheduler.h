@@ -0,0 +1,134 @@
+#ifndef RISCV_SIM_SCHEDULER_H
+#define RISCV_SIM_SCHEDULER_H
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <optional>
+#include <exception>
+#include <coroutine>
+
+#include "Smp.h"
+#include "Host.h"
+
+// Deterministic alternative to Smp::Run: every hart is a coroutine that runs
+// a quantum of instructions and suspends. Harts take turns on the calling
+// thread, the order of every round is a permutation drawn from the seed,
+// so the same seed always gives the same interleaving.
+//
+// Blocks are never split, so a quantum ends at the first block boundary
+// after quantum instructions.
+class Scheduler
+{
+public:
+    Scheduler(Smp& smp, Word quantum, uint64_t seed)
+        : _smp(smp), _quantum(std::max(quantum, 1u)), _seed(seed)
+    {
+
+    }
+
+    // Runs all harts until one of them exits, returns its exit code
+    int Run(FILE* out = stderr)
+    {
+        std::vector<HartTask> tasks;
+        for (unsigned i = 0; i < _smp.Harts(); i++)
+            tasks.push_back(RunHart(_smp.Hart(i), _quantum));
+        std::vector<Host> hosts(tasks.size(), Host{out});
+
+        std::mt19937_64 rng(_seed);
+        std::vector<unsigned> order(tasks.size());
+        std::iota(order.begin(), order.end(), 0);
+        while (true)
+        {
+            // std::shuffle differs between standard libraries, this doesn't
+            for (size_t i = order.size() - 1; i > 0; i--)
+                std::swap(order[i], order[rng() % (i + 1)]);
+
+            for (unsigned hart : order)
+                while (std::optional<CpuToHostData> msg = tasks[hart].Resume())
+                    if (std::optional<int> exitCode = hosts[hart].Handle(msg.value()))
+                        return exitCode.value();
+        }
+    }
+
+private:
+    // Coroutine running one hart. It suspends with a message whenever the
+    // hart writes to mtohost and with nothing at the end of a quantum.
+    class HartTask
+    {
+    public:
+        struct promise_type
+        {
+            std::optional<CpuToHostData> value;
+
+            HartTask get_return_object() { return HartTask{Handle::from_promise(*this)}; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+
+            std::suspend_always yield_value(std::optional<CpuToHostData> msg)
+            {
+                value = msg;
+                return {};
+            }
+        };
+
+        using Handle = std::coroutine_handle<promise_type>;
+
+        explicit HartTask(Handle handle)
+            : _handle(handle)
+        {
+
+        }
+
+        HartTask(HartTask&& other) noexcept
+            : _handle(std::exchange(other._handle, nullptr))
+        {
+
+        }
+
+        HartTask(const HartTask&) = delete;
+        HartTask& operator=(const HartTask&) = delete;
+        HartTask& operator=(HartTask&&) = delete;
+
+        ~HartTask()
+        {
+            if (_handle)
+                _handle.destroy();
+        }
+
+        // Runs the hart up to its next message or the end of the quantum
+        std::optional<CpuToHostData> Resume()
+        {
+            _handle.resume();
+            return _handle.promise().value;
+        }
+
+    private:
+        Handle _handle;
+    };
+
+    static HartTask RunHart(Cpu& cpu, Word quantum)
+    {
+        while (true)
+        {
+            for (Word left = quantum; left != 0;)
+            {
+                Word executed = cpu.Run(left);
+                left -= std::min(executed, left);
+                if (std::optional<CpuToHostData> msg = cpu.GetMessage())
+                    co_yield msg;
+            }
+            co_yield std::nullopt;
+        }
+    }
+
+    Smp& _smp;
+    Word _quantum;
+    uint64_t _seed;
+};
+
+#endif //RISCV_SIM_SCHEDULER_H
@@ -0,0 +1,125 @@
+#ifndef RISCV_SIM_SMP_H
+#define RISCV_SIM_SMP_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <optional>
+#include <condition_variable>
+
+#include "Cpu.h"
+#include "Memory.h"
+#include "Host.h"
+
+// Several harts sharing one Memory, each running on its own host thread.
+// Hart i reads i from mhartid. Messages of all harts are handled by one
+// host loop in the order they arrive, the first exit code ends the run.
+//
+// Every hart has its own decode cache, so code written by one hart is
+// not seen by harts that have already decoded it.
+class Smp
+{
+public:
+    Smp(Memory& mem, unsigned harts)
+    {
+        for (unsigned i = 0; i < harts; i++)
+            _harts.push_back(std::make_unique<Cpu>(mem));
+    }
+
+    unsigned Harts() const
+    {
+        return _harts.size();
+    }
+
+    Cpu& Hart(unsigned i)
+    {
+        return *_harts[i];
+    }
+
+    bool EnableJit(Word hotThreshold)
+    {
+        bool enabled = true;
+        for (auto& hart : _harts)
+            enabled = hart->EnableJit(hotThreshold) && enabled;
+        return enabled;
+    }
+
+    void Reset(Word ip)
+    {
+        for (unsigned i = 0; i < _harts.size(); i++)
+            _harts[i]->Reset(ip, i);
+    }
+
+    // Runs all harts until one of them exits, returns its exit code
+    int Run(FILE* out = stderr)
+    {
+        _stop = false;
+        _messages.clear();
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < _harts.size(); i++)
+            threads.emplace_back([this, i] { RunHart(i); });
+
+        // Every hart prints through its own Host, halves of printed ints
+        // from different harts mustn't mix
+        std::vector<Host> hosts(_harts.size(), Host{out});
+        std::optional<int> exitCode;
+        while (!exitCode)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _ready.wait(lock, [this] { return !_messages.empty(); });
+            std::deque<Message> messages;
+            messages.swap(_messages);
+            lock.unlock();
+
+            for (const Message& msg : messages)
+                if (!exitCode)
+                    exitCode = hosts[msg.hart].Handle(msg.data);
+        }
+
+        _stop = true;
+        for (auto& thread : threads)
+            thread.join();
+        return exitCode.value();
+    }
+
+private:
+    struct Message
+    {
+        unsigned hart;
+        CpuToHostData data;
+    };
+
+    void RunHart(unsigned i)
+    {
+        Cpu& cpu = *_harts[i];
+        while (!_stop.load(std::memory_order_relaxed))
+        {
+            cpu.Run(runBudget);
+            std::optional<CpuToHostData> msg = cpu.GetMessage();
+            if (!msg)
+                continue;
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _messages.push_back(Message{i, msg.value()});
+            }
+            _ready.notify_one();
+            if (msg->unpacked.type == CpuToHostType::ExitCode)
+                return;
+        }
+    }
+
+    // Instructions a hart runs between checks whether the run is over
+    static constexpr Word runBudget = 1u << 16u;
+
+    std::vector<std::unique_ptr<Cpu>> _harts;
+    std::atomic<bool> _stop{false};
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<Message> _messages;
+};
+
+#endif //RISCV_SIM_SMP_H
@@ -0,0 +1,253 @@
+#ifndef RISCV_SIM_SNAPSHOT_H
+#define RISCV_SIM_SNAPSHOT_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Cpu.h"
+#include "Memory.h"
+
+// Snapshot file: a header followed by checkpoints. The first checkpoint has
+// every page the program uses, later ones only the pages that changed since
+// the previous one. Each checkpoint is
+//
+//     Snapshot::Record, page addresses, padding to a page boundary, pages
+//
+// so the pages of the file can be mapped and copied into guest memory as is.
+// Restoring checkpoint n applies checkpoints 0..n, the latest copy of a page wins.
+class Snapshot
+{
+public:
+    static constexpr char magic[8] = {'R', 'V', 'S', 'N', 'A', 'P', '0', '1'};
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t pageSize;
+        uint32_t reserved;
+    };
+
+    struct Record
+    {
+        CpuState state;
+        uint32_t pageCount;
+    };
+
+    static size_t Align(size_t offset)
+    {
+        return (offset + Memory::PageSize() - 1) / Memory::PageSize() * Memory::PageSize();
+    }
+
+    // Offset of the pages of a checkpoint starting at offset
+    static size_t PagesOffset(size_t offset, uint32_t pageCount)
+    {
+        return Align(offset + sizeof(Record) + pageCount * sizeof(Word));
+    }
+};
+
+// Appends checkpoints to a snapshot file
+class SnapshotWriter
+{
+public:
+    ~SnapshotWriter()
+    {
+        if (_fd >= 0)
+            close(_fd);
+    }
+
+    bool Open(const std::string& path)
+    {
+        _fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (_fd < 0)
+        {
+            std::cerr << "ERROR: snapshot: failed opening \"" << path << "\"" << std::endl;
+            return false;
+        }
+        Snapshot::Header header{};
+        std::memcpy(header.magic, Snapshot::magic, sizeof(header.magic));
+        header.pageSize = Memory::PageSize();
+        _size = Snapshot::Align(sizeof(header));
+        _latest.clear();
+        return Write(&header, sizeof(header), 0);
+    }
+
+    // Saves the state of cpu and mem, only pages that differ from their
+    // latest saved copy are written
+    bool Checkpoint(Cpu& cpu, const Memory& mem)
+    {
+        const size_t pageSize = Memory::PageSize();
+        std::vector<Word> pages;
+        std::vector<char> saved(pageSize);
+        for (Word addr : mem.UsedPages())
+        {
+            auto latest = _latest.find(addr);
+            if (latest != _latest.end())
+            {
+                if (pread(_fd, saved.data(), pageSize, latest->second) != ssize_t(pageSize))
+                    return Error();
+                if (std::memcmp(saved.data(), mem.Page(addr), pageSize) == 0)
+                    continue;
+            }
+            pages.push_back(addr);
+        }
+
+        Snapshot::Record record{cpu.GetState(), uint32_t(pages.size())};
+        size_t offset = _size;
+        size_t pagesOffset = Snapshot::PagesOffset(offset, record.pageCount);
+        if (!Write(&record, sizeof(record), offset) ||
+            !Write(pages.data(), pages.size() * sizeof(Word), offset + sizeof(record)))
+            return false;
+        for (size_t i = 0; i < pages.size(); i++)
+        {
+            size_t pageOffset = pagesOffset + i * pageSize;
+            if (!Write(mem.Page(pages[i]), pageSize, pageOffset))
+                return false;
+            _latest[pages[i]] = pageOffset;
+        }
+        _size = pagesOffset + pages.size() * pageSize;
+        // Keeps the file size right even for a checkpoint without pages
+        if (ftruncate(_fd, _size) != 0)
+            return Error();
+        _count++;
+        return true;
+    }
+
+    size_t Checkpoints() const
+    {
+        return _count;
+    }
+
+private:
+    bool Write(const void* data, size_t size, size_t offset)
+    {
+        if (size != 0 && pwrite(_fd, data, size, offset) != ssize_t(size))
+            return Error();
+        return true;
+    }
+
+    static bool Error()
+    {
+        std::cerr << "ERROR: snapshot: failed writing checkpoint" << std::endl;
+        return false;
+    }
+
+    int _fd = -1;
+    size_t _size = 0;
+    size_t _count = 0;
+    std::unordered_map<Word, size_t> _latest; // page address -> file offset of its latest copy
+};
+
+// Maps a snapshot file and restores its checkpoints, as many times as needed
+class SnapshotReader
+{
+public:
+    ~SnapshotReader()
+    {
+        if (_data)
+            munmap(_data, _size);
+    }
+
+    bool Open(const std::string& path)
+    {
+        if (_data)
+            munmap(_data, _size);
+        _data = nullptr;
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Snapshot::Header))
+        {
+            std::cerr << "ERROR: snapshot: failed opening \"" << path << "\"" << std::endl;
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        _size = st.st_size;
+        void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            std::cerr << "ERROR: snapshot: failed mapping \"" << path << "\"" << std::endl;
+            return false;
+        }
+        _data = static_cast<char*>(data);
+
+        auto header = reinterpret_cast<const Snapshot::Header*>(_data);
+        if (std::memcmp(header->magic, Snapshot::magic, sizeof(header->magic)) != 0 ||
+            header->pageSize != Memory::PageSize())
+        {
+            std::cerr << "ERROR: snapshot: \"" << path << "\" is not a snapshot file" << std::endl;
+            return false;
+        }
+
+        _records.clear();
+        for (size_t offset = Snapshot::Align(sizeof(Snapshot::Header)); offset < _size;)
+        {
+            if (offset + sizeof(Snapshot::Record) > _size)
+                return Truncated(path);
+            auto record = reinterpret_cast<const Snapshot::Record*>(_data + offset);
+            size_t end = Snapshot::PagesOffset(offset, record->pageCount) + record->pageCount * Memory::PageSize();
+            if (end > _size)
+                return Truncated(path);
+            _records.push_back(offset);
+            offset = end;
+        }
+        return true;
+    }
+
+    size_t Checkpoints() const
+    {
+        return _records.size();
+    }
+
+    // Restores checkpoint index into cpu and mem. mem has to be fresh or
+    // hold the same program, pages written since LoadElf are reset first.
+    bool Restore(size_t index, Cpu& cpu, Memory& mem)
+    {
+        if (index >= _records.size())
+        {
+            std::cerr << "ERROR: snapshot: no checkpoint " << index << std::endl;
+            return false;
+        }
+
+        // Latest copy of every page up to the checkpoint, each page is copied once
+        std::unordered_map<Word, const char*> pages;
+        for (size_t i = 0; i <= index; i++)
+        {
+            size_t offset = _records[i];
+            auto record = reinterpret_cast<const Snapshot::Record*>(_data + offset);
+            auto addrs = reinterpret_cast<const Word*>(_data + offset + sizeof(Snapshot::Record));
+            const char* page = _data + Snapshot::PagesOffset(offset, record->pageCount);
+            for (uint32_t j = 0; j < record->pageCount; j++, page += Memory::PageSize())
+                pages[addrs[j]] = page;
+        }
+
+        mem.ResetToImage();
+        for (const auto& [addr, page] : pages)
+            mem.WritePage(addr, page);
+
+        auto record = reinterpret_cast<const Snapshot::Record*>(_data + _records[index]);
+        cpu.SetState(record->state);
+        return true;
+    }
+
+private:
+    static bool Truncated(const std::string& path)
+    {
+        std::cerr << "ERROR: snapshot: \"" << path << "\" is truncated" << std::endl;
+        return false;
+    }
+
+    char* _data = nullptr;
+    size_t _size = 0;
+    std::vector<size_t> _records; // file offsets of the checkpoints
+};
+
+#endif //RISCV_SIM_SNAPSHOT_H
@@ -0,0 +1,512 @@
+#ifndef RISCV_SIM_STATICTRANSLATOR_H
+#define RISCV_SIM_STATICTRANSLATOR_H
+
+#include <array>
+#include <vector>
+#include <set>
+#include <string>
+#include <ostream>
+#include <cstdio>
+
+#include "Instruction.h"
+#include "Decoder.h"
+#include "Memory.h"
+
+// Ahead-of-time translator of a loaded guest program into a C++ translation
+// unit. Every basic block of the executable segments becomes a function that
+// keeps the guest registers it uses in locals and returns the next ip, the
+// generated main() dispatches between them and handles mtohost with Host,
+// like main.cpp does. The result is built with the host compiler:
+//
+//     c++ -O2 -I src program.cpp -o program
+//
+// Block starts are found statically: entry, branch and jump targets, return
+// addresses and addresses materialized with lui/auipc + addi. An indirect
+// jump anywhere else stops the program with an error. Self-modifying code is
+// not supported, stores never change the translated code.
+class StaticTranslator
+{
+public:
+    StaticTranslator(Memory& mem, const std::vector<Memory::Segment>& segments)
+        : _mem(mem), _segments(segments)
+    {
+
+    }
+
+    void Translate(std::ostream& out, Word entry, const std::string& source)
+    {
+        FindBlocks(entry);
+
+        out << "// Generated by riscv_aot from " << source << ", do not edit\n\n"
+            << "#include <cstdint>\n"
+            << "#include <cstdio>\n"
+            << "#include <cstring>\n"
+            << "#include <optional>\n"
+            << "#include <stdexcept>\n"
+            << "#include <sys/mman.h>\n\n"
+            << "#include \"BaseTypes.h\"\n"
+            << "#include \"Host.h\"\n\n"
+            << "namespace\n{\n";
+        WriteRuntime(out);
+        WriteImage(out);
+        for (Word start : _blocks)
+            WriteBlock(out, start);
+        WriteDispatch(out);
+        out << "}\n\n";
+        WriteMain(out, entry);
+    }
+
+    const std::set<Word>& Blocks() const
+    {
+        return _blocks;
+    }
+
+private:
+    Instruction Decode(Word ip)
+    {
+        Instruction instr;
+        _decoder.Decode(_mem.Request(ip), instr);
+        return instr;
+    }
+
+    bool IsCode(Word addr) const
+    {
+        if (addr % 4 != 0)
+            return false;
+        for (const auto& segment : _segments)
+            if (segment.executable && addr >= segment.addr && addr - segment.addr < segment.size)
+                return true;
+        return false;
+    }
+
+    // Csrw ends a block as well, a write to mtohost may stop the program
+    static bool IsBlockEnd(const Instruction& instr)
+    {
+        switch (instr._type)
+        {
+            case IType::Br:
+            case IType::J:
+            case IType::Jr:
+            case IType::Csrw:
+            case IType::Unsupported:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void AddBlock(Word addr)
+    {
+        if (IsCode(addr))
+            _blocks.insert(addr);
+    }
+
+    void FindBlocks(Word entry)
+    {
+        _blocks.clear();
+        _blocks.insert(entry);
+
+        for (const auto& segment : _segments)
+        {
+            if (!segment.executable)
+                continue;
+
+            // Registers holding a constant known from lui/auipc/addi since the last block end
+            std::array<bool, 32> known{};
+            std::array<Word, 32> values{};
+            for (Word ip = segment.addr; ip - segment.addr < segment.size; ip += 4)
+            {
+                Instruction instr = Decode(ip);
+                bool isConst = false;
+                Word value = 0;
+                if (instr._type == IType::Auipc)
+                {
+                    isConst = true;
+                    value = ip + instr._imm;
+                }
+                else if (instr._type == IType::Alu && instr._aluFunc == AluFunc::Add &&
+                         instr.Has(Instruction::Imm) && (instr._src1 == 0 || known[instr._src1]))
+                {
+                    isConst = true;
+                    value = (instr._src1 == 0 ? 0 : values[instr._src1]) + instr._imm;
+                }
+                else if (instr._type == IType::Jr && known[instr._src1])
+                    AddBlock(values[instr._src1] + instr._imm);
+
+                if (instr._type == IType::Br || instr._type == IType::J)
+                    AddBlock(ip + instr._imm);
+
+                if (isConst)
+                    AddBlock(value);
+                known[instr._dst] = isConst && instr._dst != 0;
+                values[instr._dst] = value;
+
+                if (IsBlockEnd(instr))
+                {
+                    AddBlock(ip + 4);
+                    known.fill(false);
+                }
+            }
+        }
+    }
+
+    static std::string Hex(Word value)
+    {
+        char buf[16];
+        std::snprintf(buf, sizeof(buf), "0x%08xu", value);
+        return buf;
+    }
+
+    static std::string Reg(RId reg)
+    {
+        return reg == 0 ? "Word(0)" : "x" + std::to_string(reg);
+    }
+
+    void WriteRuntime(std::ostream& out)
+    {
+        out << "    constexpr Word addressMask = " << Hex(Memory::AddressMask()) << ";\n"
+            << "    constexpr size_t memBytes = size_t(addressMask) + 4;\n\n"
+            << "    struct Context\n"
+            << "    {\n"
+            << "        Word* mem;\n"
+            << "        Word instret;\n"
+            << "        Host host;\n"
+            << "        std::optional<int> exitCode;\n"
+            << "        Word reserved = ~0u; // address reserved by LR\n"
+            << "    };\n\n"
+            << "    inline Word Load(Context& c, Word addr)\n"
+            << "    {\n"
+            << "        return c.mem[(addr & addressMask) >> 2];\n"
+            << "    }\n\n"
+            << "    inline void Store(Context& c, Word addr, Word data)\n"
+            << "    {\n"
+            << "        c.mem[(addr & addressMask) >> 2] = data;\n"
+            << "    }\n\n";
+    }
+
+    void WriteImage(std::ostream& out)
+    {
+        std::vector<std::string> parts;
+        for (size_t i = 0; i < _segments.size(); i++)
+        {
+            const auto& segment = _segments[i];
+            Word end = segment.addr + (segment.size + 3) / 4 * 4;
+            while (end > segment.addr && _mem.Request(end - 4) == 0)
+                end -= 4;
+            if (end == segment.addr)
+                continue;
+
+            std::string name = "segment" + std::to_string(i);
+            out << "    const Word " << name << "[] = {";
+            for (Word addr = segment.addr; addr < end; addr += 4)
+            {
+                if ((addr - segment.addr) % 32 == 0)
+                    out << "\n           ";
+                out << " " << Hex(_mem.Request(addr)) << ",";
+            }
+            out << "\n    };\n\n";
+            parts.push_back("{" + Hex(segment.addr) + ", " + name + ", sizeof(" + name + ")}");
+        }
+
+        out << "    struct ImagePart\n"
+            << "    {\n"
+            << "        Word addr;\n"
+            << "        const Word* data;\n"
+            << "        size_t size;\n"
+            << "    };\n\n"
+            << "    const ImagePart image[] = {\n";
+        for (const auto& part : parts)
+            out << "        " << part << ",\n";
+        out << "    };\n\n";
+    }
+
+    void WriteBlock(std::ostream& out, Word start)
+    {
+        std::vector<Instruction> instrs;
+        Word ip = start;
+        do
+        {
+            instrs.push_back(Decode(ip));
+            ip += 4;
+        } while (!IsBlockEnd(instrs.back()) && IsCode(ip) && _blocks.count(ip) == 0);
+
+        std::array<bool, 32> used{};
+        _written.fill(false);
+        for (const auto& instr : instrs)
+        {
+            if (instr.Has(Instruction::Src1))
+                used[instr._src1] = true;
+            if (instr.Has(Instruction::Src2))
+                used[instr._src2] = true;
+            used[instr._dst] = true;
+            _written[instr._dst] = true;
+        }
+        used[0] = _written[0] = false;
+
+        out << "    Word " << BlockName(start) << "(Word* r, Context& c)\n"
+            << "    {\n";
+        for (RId reg = 1; reg < 32; reg++)
+            if (used[reg])
+                out << "        Word " << Reg(reg) << " = r[" << reg << "];\n";
+
+        ip = start;
+        Word count = 0;
+        for (const auto& instr : instrs)
+        {
+            count++;
+            WriteInstruction(out, instr, ip, count);
+            ip += 4;
+        }
+        if (!IsBlockEnd(instrs.back()))
+            WriteExit(out, count, Hex(ip), "        ");
+        out << "    }\n\n";
+    }
+
+    void WriteInstruction(std::ostream& out, const Instruction& instr, Word ip, Word count)
+    {
+        const std::string indent = "        ";
+        std::string src1 = Reg(instr._src1);
+        std::string src2 = instr.Has(Instruction::Imm) ? Hex(instr._imm) : Reg(instr._src2);
+        std::string dst = Reg(instr._dst);
+        bool hasDst = instr._dst != 0;
+
+        switch (instr._type)
+        {
+            case IType::Alu:
+                if (hasDst)
+                    out << indent << dst << " = " << AluExpression(instr._aluFunc, src1, src2) << ";\n";
+                break;
+            case IType::Auipc:
+                if (hasDst)
+                    out << indent << dst << " = " << Hex(ip + instr._imm) << ";\n";
+                break;
+            case IType::Ld:
+                if (hasDst)
+                    out << indent << dst << " = Load(c, " << src1 << " + " << Hex(instr._imm) << ");\n";
+                break;
+            case IType::St:
+                out << indent << "Store(c, " << src1 << " + " << Hex(instr._imm) << ", " << Reg(instr._src2) << ");\n";
+                break;
+            case IType::Csrr:
+                if (hasDst)
+                    out << indent << dst << " = " << CsrExpression(instr, count - 1) << ";\n";
+                break;
+            case IType::Amo:
+                WriteAmo(out, instr, indent);
+                break;
+            case IType::Csrw:
+                if (static_cast<CsrIdx>(instr._csr) == CsrIdx::Mtohost)
+                    out << indent << "c.exitCode = c.host.Handle(CpuToHostData{" << src1 << "});\n";
+                WriteExit(out, count, Hex(ip + 4), indent);
+                break;
+            case IType::J:
+                if (hasDst)
+                    out << indent << dst << " = " << Hex(ip + 4) << ";\n";
+                WriteExit(out, count, Hex(ip + instr._imm), indent);
+                break;
+            case IType::Jr:
+                out << indent << "Word target = " << src1 << " + " << Hex(instr._imm) << ";\n";
+                if (hasDst)
+                    out << indent << dst << " = " << Hex(ip + 4) << ";\n";
+                WriteExit(out, count, "target", indent);
+                break;
+            case IType::Br:
+            {
+                std::string cond = BranchCondition(instr._brFunc, src1, Reg(instr._src2));
+                if (cond != "false")
+                {
+                    out << indent << "if (" << cond << ")\n" << indent << "{\n";
+                    WriteExit(out, count, Hex(ip + instr._imm), indent + "    ");
+                    out << indent << "}\n";
+                }
+                if (cond != "true")
+                    WriteExit(out, count, Hex(ip + 4), indent);
+                break;
+            }
+            default:
+                WriteBack(out, indent);
+                out << indent << "c.instret += " << count - 1 << ";\n"
+                    << indent << "throw std::invalid_argument(\"Unsupported instruction\");\n";
+                break;
+        }
+    }
+
+    // The generated program has a single hart, so AMOs need no host atomics
+    // and an SC succeeds whenever its LR reserved the same address
+    static void WriteAmo(std::ostream& out, const Instruction& instr, const std::string& indent)
+    {
+        std::string addr = Reg(instr._src1);
+        std::string dst = Reg(instr._dst);
+        bool hasDst = instr._dst != 0;
+        switch (instr._amoFunc)
+        {
+            case AmoFunc::Lr:
+                out << indent << "c.reserved = " << addr << " & addressMask;\n";
+                if (hasDst)
+                    out << indent << dst << " = Load(c, " << addr << ");\n";
+                break;
+            case AmoFunc::Sc:
+                out << indent << "{\n"
+                    << indent << "    bool stored = c.reserved == (" << addr << " & addressMask);\n"
+                    << indent << "    if (stored)\n"
+                    << indent << "        Store(c, " << addr << ", " << Reg(instr._src2) << ");\n"
+                    << indent << "    c.reserved = ~0u;\n";
+                if (hasDst)
+                    out << indent << "    " << dst << " = Word(!stored);\n";
+                out << indent << "}\n";
+                break;
+            default:
+                out << indent << "{\n"
+                    << indent << "    Word old = Load(c, " << addr << ");\n"
+                    << indent << "    Store(c, " << addr << ", " << AmoExpression(instr._amoFunc, "old", Reg(instr._src2)) << ");\n";
+                if (hasDst)
+                    out << indent << "    " << dst << " = old;\n";
+                out << indent << "}\n";
+                break;
+        }
+    }
+
+    // Memory::AmoResult semantics
+    static std::string AmoExpression(AmoFunc func, const std::string& a, const std::string& b)
+    {
+        switch (func)
+        {
+            case AmoFunc::Swap: return b;
+            case AmoFunc::Add:  return a + " + " + b;
+            case AmoFunc::Xor:  return a + " ^ " + b;
+            case AmoFunc::And:  return a + " & " + b;
+            case AmoFunc::Or:   return a + " | " + b;
+            case AmoFunc::Min:  return "SignedWord(" + a + ") < SignedWord(" + b + ") ? " + a + " : " + b;
+            case AmoFunc::Max:  return "SignedWord(" + a + ") > SignedWord(" + b + ") ? " + a + " : " + b;
+            case AmoFunc::Minu: return a + " < " + b + " ? " + a + " : " + b;
+            case AmoFunc::Maxu: return a + " > " + b + " ? " + a + " : " + b;
+            default:            return a;
+        }
+    }
+
+    // Executor semantics, see GetOperation
+    static std::string AluExpression(AluFunc func, const std::string& a, const std::string& b)
+    {
+        switch (func)
+        {
+            case AluFunc::Add:  return a + " + " + b;
+            case AluFunc::Sub:  return a + " - " + b;
+            case AluFunc::And:  return a + " & " + b;
+            case AluFunc::Or:   return a + " | " + b;
+            case AluFunc::Xor:  return a + " ^ " + b;
+            case AluFunc::Slt:  return "Word(SignedWord(" + a + ") < SignedWord(" + b + "))";
+            case AluFunc::Sltu: return "Word(" + a + " < " + b + ")";
+            case AluFunc::Sll:  return a + " << (" + b + " % 32)";
+            case AluFunc::Srl:  return a + " >> (" + b + " % 32)";
+            case AluFunc::Sra:  return "Word(SignedWord(" + a + ") >> (" + b + " % 32))";
+            case AluFunc::Mul:  return a + " * " + b;
+            case AluFunc::Mulh:
+                return "Word(uint64_t(int64_t(SignedWord(" + a + ")) * int64_t(SignedWord(" + b + "))) >> 32)";
+            case AluFunc::Mulhsu:
+                return "Word(uint64_t(int64_t(SignedWord(" + a + ")) * int64_t(" + b + ")) >> 32)";
+            case AluFunc::Mulhu:
+                return "Word(uint64_t(" + a + ") * uint64_t(" + b + ") >> 32)";
+            case AluFunc::Div:
+                return "(" + b + " == 0 ? ~0u : " + a + " == 0x80000000u && " + b + " == ~0u ? " + a +
+                       " : Word(SignedWord(" + a + ") / SignedWord(" + b + ")))";
+            case AluFunc::Divu: return "(" + b + " == 0 ? ~0u : " + a + " / " + b + ")";
+            case AluFunc::Rem:
+                return "(" + b + " == 0 ? " + a + " : " + a + " == 0x80000000u && " + b + " == ~0u ? 0u" +
+                       " : Word(SignedWord(" + a + ") % SignedWord(" + b + ")))";
+            case AluFunc::Remu: return "(" + b + " == 0 ? " + a + " : " + a + " % " + b + ")";
+            default:            return "throw std::invalid_argument(\"Unsupported ALU function\"), Word(0)";
+        }
+    }
+
+    static std::string BranchCondition(BrFunc func, const std::string& a, const std::string& b)
+    {
+        switch (func)
+        {
+            case BrFunc::Eq:  return a + " == " + b;
+            case BrFunc::Neq: return a + " != " + b;
+            case BrFunc::Lt:  return "SignedWord(" + a + ") < SignedWord(" + b + ")";
+            case BrFunc::Ge:  return "SignedWord(" + a + ") >= SignedWord(" + b + ")";
+            case BrFunc::Ltu: return a + " < " + b;
+            case BrFunc::Geu: return a + " >= " + b;
+            case BrFunc::AT:  return "true";
+            default:          return "false";
+        }
+    }
+
+    // Cycle counts the same as instret, see CsrFile
+    static std::string CsrExpression(const Instruction& instr, Word executed)
+    {
+        switch (static_cast<CsrIdx>(instr._csr))
+        {
+            case CsrIdx::Instret:
+            case CsrIdx::Cycle:
+                return "c.instret + " + std::to_string(executed);
+            default:
+                return "Word(0)";
+        }
+    }
+
+    void WriteBack(std::ostream& out, const std::string& indent)
+    {
+        for (RId reg = 1; reg < 32; reg++)
+            if (_written[reg])
+                out << indent << "r[" << reg << "] = " << Reg(reg) << ";\n";
+    }
+
+    void WriteExit(std::ostream& out, Word count, const std::string& target, const std::string& indent)
+    {
+        WriteBack(out, indent);
+        out << indent << "c.instret += " << count << ";\n"
+            << indent << "return " << target << ";\n";
+    }
+
+    static std::string BlockName(Word start)
+    {
+        char buf[16];
+        std::snprintf(buf, sizeof(buf), "Block_%08x", start);
+        return buf;
+    }
+
+    void WriteDispatch(std::ostream& out)
+    {
+        out << "    Word Dispatch(Word ip, Word* r, Context& c)\n"
+            << "    {\n"
+            << "        switch (ip)\n"
+            << "        {\n";
+        for (Word start : _blocks)
+            out << "            case " << Hex(start) << ": return " << BlockName(start) << "(r, c);\n";
+        out << "            default:\n"
+            << "                fprintf(stderr, \"ERROR: no translated code at 0x%08x\\n\", ip);\n"
+            << "                c.exitCode = 1;\n"
+            << "                return ip;\n"
+            << "        }\n"
+            << "    }\n";
+    }
+
+    static void WriteMain(std::ostream& out, Word entry)
+    {
+        out << "int main()\n"
+            << "{\n"
+            << "    void* mem = mmap(nullptr, memBytes, PROT_READ | PROT_WRITE,\n"
+            << "                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);\n"
+            << "    if (mem == MAP_FAILED)\n"
+            << "        return 1;\n"
+            << "    for (const auto& part : image)\n"
+            << "        std::memcpy(reinterpret_cast<char*>(mem) + part.addr, part.data, part.size);\n\n"
+            << "    Context c{static_cast<Word*>(mem), 0, Host{}, std::nullopt};\n"
+            << "    Word r[32] = {};\n"
+            << "    Word ip = " << Hex(entry) << ";\n"
+            << "    while (!c.exitCode)\n"
+            << "        ip = Dispatch(ip, r, c);\n"
+            << "    return c.exitCode.value();\n"
+            << "}\n";
+    }
+
+    Memory& _mem;
+    std::vector<Memory::Segment> _segments;
+    Decoder _decoder;
+    std::set<Word> _blocks;
+    std::array<bool, 32> _written{};
+};
+
+#endif //RISCV_SIM_STATICTRANSLATOR_H
@@ -5,6 +5,9 @@
 #include <optional>
 #include <stdexcept>
 #include <utility>
+#include <array>
+#include <initializer_list>
+#include <type_traits>
 
 // namespace Creator
 // {
@@ -15,7 +18,15 @@
 //     }
 // }
 
-template<typename SwitchType, typename Compare>
+// Small enum keys can be switched through a flat table instead of a hash map.
+// Specialize with size = number of possible key values to enable it.
+template<typename SwitchType>
+struct DenseSwitchKey
+{
+    static constexpr size_t size = 0;
+};
+
+template<typename SwitchType, typename Compare, typename Enable = void>
 class SwitchMaker
 {
     public:
@@ -35,8 +46,9 @@ class SwitchMaker
         template<typename... Args>
         auto DoOperation(SwitchType type, Args&&... args)
         {
-            if(operation.count(type) != 0)
-                return (*operation[type])(std::forward<Args>(args)...);
+            auto it = operation.find(type);
+            if(it != operation.end())
+                return (*it->second)(std::forward<Args>(args)...);
             else if(defaultComp)
                 return (**defaultComp)(std::forward<Args>(args)...);
             else
@@ -64,5 +76,46 @@ class SwitchMaker
         std::optional<Compare> defaultComp;
 };
 
+// Dense-key version: every possible key has a slot, empty slots hold the default,
+// so DoOperation is a single indexed load. Compare must be a literal type
+// (e.g. a function pointer) for the table to be built at compile time.
+template<typename SwitchType, typename Compare>
+class SwitchMaker<SwitchType, Compare, std::enable_if_t<(DenseSwitchKey<SwitchType>::size > 0)>>
+{
+    public:
+        static constexpr size_t size = DenseSwitchKey<SwitchType>::size;
+
+        constexpr SwitchMaker(Compare defaultComp,
+                              std::initializer_list<std::pair<SwitchType, Compare>> comps)
+            : operation{}, defaultComp(defaultComp)
+        {
+            for(auto& slot : operation)
+                slot = defaultComp;
+            for(auto& comp : comps)
+                operation[static_cast<size_t>(comp.first)] = comp.second;
+        }
+
+        // type must be less than size
+        template<typename... Args>
+        constexpr auto DoOperation(SwitchType type, Args&&... args) const
+        {
+            return operation[static_cast<size_t>(type)](std::forward<Args>(args)...);
+        }
+
+        constexpr const Compare& GetCompare(SwitchType type) const
+        {
+            return operation[static_cast<size_t>(type)];
+        }
+
+        constexpr const Compare& GetDefaultCompare() const
+        {
+            return defaultComp;
+        }
+
+    private:
+        std::array<Compare, size> operation;
+        Compare defaultComp;
+};
+
 
-#endif // RISCV_SIM_SWITCHMAKER_H
\ No newline at end of file
+#endif // RISCV_SIM_SWITCHMAKER_H
@@ -0,0 +1,130 @@
+#ifndef RISCV_SIM_TESTRUNNER_H
+#define RISCV_SIM_TESTRUNNER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <optional>
+#include <filesystem>
+#include <system_error>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Cpu.h"
+#include "Memory.h"
+#include "Host.h"
+
+struct TestResult
+{
+    enum class Status
+    {
+        Passed,
+        Failed,  // nonzero exit code
+        Timeout, // instruction limit reached
+        Error,   // the ELF couldn't be loaded
+    };
+
+    std::string path;
+    Status status = Status::Error;
+    int exitCode = 0;
+    Word instret = 0;
+    double seconds = 0;
+    std::string output; // what the program printed through mtohost
+};
+
+// Runs guest programs in this process, each with its own Memory and Cpu,
+// on as many threads as requested
+class TestRunner
+{
+public:
+    // jitThreshold as for Cpu::EnableJit, limit = 0 means no instruction limit
+    explicit TestRunner(Word jitThreshold = 0, Word limit = 0)
+        : _jitThreshold(jitThreshold), _limit(limit)
+    {
+
+    }
+
+    TestResult Run(const std::string& path) const
+    {
+        auto start = std::chrono::steady_clock::now();
+        TestResult result;
+        result.path = path;
+
+        Memory mem;
+        if (mem.LoadElf(path))
+        {
+            Cpu cpu{mem};
+            cpu.EnableJit(_jitThreshold);
+            cpu.Reset(0x200);
+
+            char* buf = nullptr;
+            size_t size = 0;
+            FILE* out = open_memstream(&buf, &size);
+            std::optional<int> exitCode = Host{out ? out : stderr}.Run(cpu, _limit);
+            if (out)
+            {
+                fclose(out);
+                result.output.assign(buf, size);
+                free(buf);
+            }
+
+            result.instret = cpu.GetState().counters.instret;
+            result.exitCode = exitCode.value_or(0);
+            if (!exitCode)
+                result.status = TestResult::Status::Timeout;
+            else
+                result.status = *exitCode == 0 ? TestResult::Status::Passed : TestResult::Status::Failed;
+        }
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // Results are in the order of paths. threads = 0 uses every host core.
+    std::vector<TestResult> RunAll(const std::vector<std::string>& paths, unsigned threads = 0) const
+    {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = std::min<size_t>(threads, std::max<size_t>(paths.size(), 1));
+
+        std::vector<TestResult> results(paths.size());
+        std::atomic<size_t> next{0};
+        auto worker = [&]
+        {
+            for (size_t i = next++; i < paths.size(); i = next++)
+                results[i] = Run(paths[i]);
+        };
+
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; i++)
+            pool.emplace_back(worker);
+        worker();
+        for (auto& thread : pool)
+            thread.join();
+        return results;
+    }
+
+    // A directory stands for the *.riscv files in it, sorted by name
+    static std::vector<std::string> Collect(const std::string& path)
+    {
+        std::error_code error;
+        if (!std::filesystem::is_directory(path, error))
+            return {path};
+
+        std::vector<std::string> files;
+        for (const auto& entry : std::filesystem::directory_iterator(path, error))
+            if (entry.is_regular_file() && entry.path().extension() == ".riscv")
+                files.push_back(entry.path().string());
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+private:
+    Word _jitThreshold;
+    Word _limit;
+};
+
+#endif //RISCV_SIM_TESTRUNNER_H
@@ -0,0 +1,162 @@
+#ifndef RISCV_SIM_TIMINGMODEL_H
+#define RISCV_SIM_TIMINGMODEL_H
+
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+
+#include "Instruction.h"
+#include "Cache.h"
+#include "BranchPredictor.h"
+
+// A basic block run by the block interpreter, for timing models that take
+// whole blocks, see TimingModel::TakesBlocks
+struct BlockTrace
+{
+    static constexpr Word maxAccesses = 64;
+
+    // Known when the block is translated
+    struct Profile
+    {
+        Word length = 0;
+        Word multiplies = 0;
+        Word divides = 0;
+        Word recurrence = 0;     // longest dependence chain from a register to itself
+        Word resolveDepth = 0;   // dependence chain in the block feeding last
+        Word resolveDistance = 0; // from the last instruction last depends on, 0 if none
+        Word lastIp = 0;
+        DecodedInstruction last; // the control transfer ending the block, if any
+    };
+
+    struct Access
+    {
+        Word addr;
+        bool write;
+    };
+
+    Word start = 0;
+    Word count = 0; // less than profile.length if a store to code cut the block short
+    Word nextIp = 0;
+    Profile profile;
+    Word accessCount = 0;
+    Access accesses[maxAccesses];
+};
+
+// Timing models see every instruction the hart retires, in program order,
+// and own its cycle count, which the Cycle CSR reads. They never change
+// what the program computes.
+class TimingModel
+{
+public:
+    virtual ~TimingModel() = default;
+
+    // instr has just been executed at ip: _addr holds the address of memory
+    // accesses and _nextIp the next pc
+    virtual void Retire(const Instruction& instr, Word ip) = 0;
+
+    // Cycles taken by the instructions retired so far
+    virtual uint64_t Cycles() const = 0;
+
+    // Event counter index for hpmcounter3..31, 0 if the model has none
+    virtual uint64_t Counter(Word index) const
+    {
+        return 0;
+    }
+
+    virtual void Report(std::ostream& out) const = 0;
+
+    // Models that only need block level events return true and keep the
+    // block interpreter running, everything else still comes through Retire
+    virtual bool TakesBlocks() const
+    {
+        return false;
+    }
+
+    virtual void RetireBlock(const BlockTrace& block)
+    {
+
+    }
+
+protected:
+    static bool IsMemory(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::Ld || instr._type == IType::St || instr._type == IType::Amo;
+    }
+
+    // AMOs read and write, only LR leaves memory alone
+    static bool IsWrite(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::St || (instr._type == IType::Amo && instr._amoFunc != AmoFunc::Lr);
+    }
+
+    static bool IsControl(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::Br || instr._type == IType::J || instr._type == IType::Jr;
+    }
+
+    static bool IsMultiply(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::Alu && instr._aluFunc >= AluFunc::Mul && instr._aluFunc < AluFunc::Div;
+    }
+
+    static bool IsDivide(const DecodedInstruction& instr)
+    {
+        return instr._type == IType::Alu && instr._aluFunc >= AluFunc::Div && instr._aluFunc < AluFunc::None;
+    }
+
+    static void ReportCycles(std::ostream& out, uint64_t cycles, uint64_t instructions)
+    {
+        out << "cycles " << cycles << ", instructions " << instructions << ", CPI "
+            << std::fixed << std::setprecision(3) << (instructions ? double(cycles) / instructions : 0.0) << "\n";
+    }
+};
+
+// One cycle per instruction plus the penalties of the components given:
+// a fetch goes to icache, loads and stores go to dcache and control
+// transfers to the branch predictor
+class PenaltyTiming : public TimingModel
+{
+public:
+    PenaltyTiming(Cache* icache, Cache* dcache, BranchPredictor* predictor = nullptr)
+        : _icache(icache), _dcache(dcache), _predictor(predictor)
+    {
+
+    }
+
+    void Retire(const Instruction& instr, Word ip) override
+    {
+        _instructions++;
+        _cycles++;
+        if (_icache)
+            _cycles += _icache->Access(ip, false);
+        if (_dcache && IsMemory(instr))
+            _cycles += _dcache->Access(instr._addr, IsWrite(instr));
+        if (_predictor)
+            _cycles += _predictor->Resolve(instr, ip);
+    }
+
+    uint64_t Cycles() const override
+    {
+        return _cycles;
+    }
+
+    void Report(std::ostream& out) const override
+    {
+        ReportCycles(out, _cycles, _instructions);
+        if (_icache)
+            _icache->Report(out, "icache");
+        if (_dcache)
+            _dcache->Report(out, "dcache");
+        if (_predictor)
+            _predictor->Report(out);
+    }
+
+private:
+    Cache* _icache;
+    Cache* _dcache;
+    BranchPredictor* _predictor;
+    uint64_t _cycles = 0;
+    uint64_t _instructions = 0;
+};
+
+#endif //RISCV_SIM_TIMINGMODEL_H
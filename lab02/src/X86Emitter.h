@@ -0,0 +1,331 @@
+#ifndef RISCV_SIM_X86EMITTER_H
+#define RISCV_SIM_X86EMITTER_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// Minimal x86-64 machine code emitter, only the instruction forms used by the JIT.
+// All arithmetic is on 32-bit registers, memory operands are [base + disp32]
+// or [base + index].
+class X86Emitter
+{
+public:
+    enum Reg : uint8_t
+    {
+        Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi,
+        R8, R9, R10, R11, R12, R13, R14, R15
+    };
+
+    enum Cond : uint8_t
+    {
+        Below = 0x2, AboveEqual = 0x3, Equal = 0x4, NotEqual = 0x5,
+        Less = 0xc, GreaterEqual = 0xd,
+    };
+
+    // Two-operand ALU instructions: opcode of "op r/m32, r32", of "op r32, r/m32"
+    // and the /digit of "op r/m32, imm32"
+    struct AluOp
+    {
+        uint8_t toRm;
+        uint8_t fromRm;
+        uint8_t digit;
+    };
+
+    static constexpr AluOp Add = {0x01, 0x03, 0};
+    static constexpr AluOp Or  = {0x09, 0x0b, 1};
+    static constexpr AluOp And = {0x21, 0x23, 4};
+    static constexpr AluOp Sub = {0x29, 0x2b, 5};
+    static constexpr AluOp Xor = {0x31, 0x33, 6};
+    static constexpr AluOp Cmp = {0x39, 0x3b, 7};
+
+    // /digit of the shift instructions
+    static constexpr uint8_t Shl = 4;
+    static constexpr uint8_t Shr = 5;
+    static constexpr uint8_t Sar = 7;
+
+    void Reset(uint8_t* code, size_t capacity)
+    {
+        _code = code;
+        _capacity = capacity;
+        _size = 0;
+    }
+
+    size_t Size() const { return _size; }
+    uint8_t* Current() const { return _code + _size; }
+
+    // Space for the longest sequence emitted between capacity checks
+    bool HasRoom(size_t bytes) const { return _size + bytes <= _capacity; }
+
+    // op reg, reg (32-bit)
+    void Op(AluOp op, Reg dst, Reg src)
+    {
+        Rex(false, src, 0, dst);
+        Byte(op.toRm);
+        ModRmReg(src, dst);
+    }
+
+    // imul dst, src (32-bit)
+    void Imul(Reg dst, Reg src)
+    {
+        Rex(false, dst, 0, src);
+        Byte(0x0f);
+        Byte(0xaf);
+        ModRmReg(dst, src);
+    }
+
+    // op reg, [base + disp] (32-bit)
+    void Op(AluOp op, Reg dst, Reg base, int32_t disp)
+    {
+        Rex(false, dst, 0, base);
+        Byte(op.fromRm);
+        ModRmMem(dst, base, disp);
+    }
+
+    // op reg, imm32 (32-bit)
+    void OpImm(AluOp op, Reg dst, uint32_t imm)
+    {
+        Rex(false, 0, 0, dst);
+        Byte(0x81);
+        ModRmReg(op.digit, dst);
+        Dword(imm);
+    }
+
+    // op dword [base + disp], imm32
+    void OpImm(AluOp op, Reg base, int32_t disp, uint32_t imm)
+    {
+        Rex(false, 0, 0, base);
+        Byte(0x81);
+        ModRmMem(op.digit, base, disp);
+        Dword(imm);
+    }
+
+    // add reg, [base + disp] (64-bit)
+    void Add64(Reg dst, Reg base, int32_t disp)
+    {
+        Rex(true, dst, 0, base);
+        Byte(0x03);
+        ModRmMem(dst, base, disp);
+    }
+
+    void Mov(Reg dst, Reg src)
+    {
+        Rex(false, src, 0, dst);
+        Byte(0x89);
+        ModRmReg(src, dst);
+    }
+
+    // mov reg, reg (64-bit)
+    void Mov64(Reg dst, Reg src)
+    {
+        Rex(true, src, 0, dst);
+        Byte(0x89);
+        ModRmReg(src, dst);
+    }
+
+    void Mov(Reg dst, uint32_t imm)
+    {
+        Rex(false, 0, 0, dst);
+        Byte(0xb8 + (dst & 7));
+        Dword(imm);
+    }
+
+    // mov reg, dword [base + disp]
+    void Load(Reg dst, Reg base, int32_t disp)
+    {
+        Rex(false, dst, 0, base);
+        Byte(0x8b);
+        ModRmMem(dst, base, disp);
+    }
+
+    // mov reg, qword [base + disp]
+    void Load64(Reg dst, Reg base, int32_t disp)
+    {
+        Rex(true, dst, 0, base);
+        Byte(0x8b);
+        ModRmMem(dst, base, disp);
+    }
+
+    // mov dword [base + disp], reg
+    void Store(Reg base, int32_t disp, Reg src)
+    {
+        Rex(false, src, 0, base);
+        Byte(0x89);
+        ModRmMem(src, base, disp);
+    }
+
+    // mov dword [base + disp], imm32
+    void Store(Reg base, int32_t disp, uint32_t imm)
+    {
+        Rex(false, 0, 0, base);
+        Byte(0xc7);
+        ModRmMem(0, base, disp);
+        Dword(imm);
+    }
+
+    // mov reg, dword [base + index]
+    void LoadIndexed(Reg dst, Reg base, Reg index)
+    {
+        Rex(false, dst, index, base);
+        Byte(0x8b);
+        ModRmSib(dst, base, index);
+    }
+
+    // mov dword [base + index], reg
+    void StoreIndexed(Reg base, Reg index, Reg src)
+    {
+        Rex(false, src, index, base);
+        Byte(0x89);
+        ModRmSib(src, base, index);
+    }
+
+    // lock bts qword [base], bit (64-bit bit offset, may go past the qword)
+    void LockBts(Reg base, Reg bit)
+    {
+        Byte(0xf0);
+        Rex(true, bit, 0, base);
+        Byte(0x0f);
+        Byte(0xab);
+        ModRmMem(bit, base, 0);
+    }
+
+    // shift reg, cl
+    void Shift(uint8_t digit, Reg dst)
+    {
+        Rex(false, 0, 0, dst);
+        Byte(0xd3);
+        ModRmReg(digit, dst);
+    }
+
+    // shift reg, imm8
+    void Shift(uint8_t digit, Reg dst, uint8_t imm)
+    {
+        Rex(false, 0, 0, dst);
+        Byte(0xc1);
+        ModRmReg(digit, dst);
+        Byte(imm);
+    }
+
+    // setcc + movzx, dst must be one of rax, rcx, rdx, rbx
+    void Set(Cond cond, Reg dst)
+    {
+        Byte(0x0f);
+        Byte(0x90 + cond);
+        ModRmReg(0, dst);
+        Byte(0x0f);
+        Byte(0xb6);
+        ModRmReg(dst, dst);
+    }
+
+    void Push(Reg reg)
+    {
+        Rex(false, 0, 0, reg);
+        Byte(0x50 + (reg & 7));
+    }
+
+    void Pop(Reg reg)
+    {
+        Rex(false, 0, 0, reg);
+        Byte(0x58 + (reg & 7));
+    }
+
+    void Ret()
+    {
+        Byte(0xc3);
+    }
+
+    // jmp reg
+    void Jmp(Reg target)
+    {
+        Rex(false, 0, 0, target);
+        Byte(0xff);
+        ModRmReg(4, target);
+    }
+
+    // jmp qword [base + disp]
+    void Jmp(Reg base, int32_t disp)
+    {
+        Rex(false, 0, 0, base);
+        Byte(0xff);
+        ModRmMem(4, base, disp);
+    }
+
+    // Jumps return the offset of their rel32 field for Patch()
+    size_t Jmp()
+    {
+        Byte(0xe9);
+        Dword(0);
+        return _size - 4;
+    }
+
+    size_t Jcc(Cond cond)
+    {
+        Byte(0x0f);
+        Byte(0x80 + cond);
+        Dword(0);
+        return _size - 4;
+    }
+
+    void Patch(size_t rel32, const uint8_t* target)
+    {
+        PatchAt(_code + rel32, target);
+    }
+
+    static void PatchAt(uint8_t* rel32, const uint8_t* target)
+    {
+        int32_t rel = static_cast<int32_t>(target - (rel32 + 4));
+        std::memcpy(rel32, &rel, sizeof(rel));
+    }
+
+private:
+    void Byte(uint8_t byte)
+    {
+        _code[_size++] = byte;
+    }
+
+    void Dword(uint32_t dword)
+    {
+        std::memcpy(_code + _size, &dword, sizeof(dword));
+        _size += sizeof(dword);
+    }
+
+    void Rex(bool wide, uint8_t reg, uint8_t index, uint8_t base)
+    {
+        uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+        if (rex != 0x40)
+            Byte(rex);
+    }
+
+    void ModRmReg(uint8_t reg, uint8_t rm)
+    {
+        Byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    // Always disp32, so rbp/r13 as base need no special case
+    void ModRmMem(uint8_t reg, uint8_t base, int32_t disp)
+    {
+        Byte(0x80 | (reg & 7) << 3 | (base & 7));
+        if ((base & 7) == Rsp)
+            Byte(0x24);
+        Dword(static_cast<uint32_t>(disp));
+    }
+
+    void ModRmSib(uint8_t reg, uint8_t base, uint8_t index)
+    {
+        if ((base & 7) == Rbp)
+        {
+            Byte(0x44 | (reg & 7) << 3);
+            Byte((index & 7) << 3 | (base & 7));
+            Byte(0);
+            return;
+        }
+        Byte(0x04 | (reg & 7) << 3);
+        Byte((index & 7) << 3 | (base & 7));
+    }
+
+    uint8_t* _code = nullptr;
+    size_t _capacity = 0;
+    size_t _size = 0;
+};
+
+#endif //RISCV_SIM_X86EMITTER_H
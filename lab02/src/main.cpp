@@ -1,43 +1,239 @@
 #include "Cpu.h"
 #include "Memory.h"
 #include "BaseTypes.h"
+#include "Host.h"
+#include "Snapshot.h"
+#include "ForkServer.h"
+#include "Smp.h"
+#include "Scheduler.h"
+#include "Cache.h"
+#include "BranchPredictor.h"
+#include "TimingModel.h"
+#include "PipelineTiming.h"
+#include "OutOfOrderTiming.h"
+#include "IntervalTiming.h"
 
+#include <memory>
 #include <optional>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 
-int main()
+int main(int argc, char** argv)
 {
+    // --jit turns on the JIT, --jit-threshold=N sets how many times a block
+    // runs in the interpreter before it gets compiled.
+    // --checkpoint=FILE saves a checkpoint every --checkpoint-interval=N
+    // instructions, --restore=FILE starts from the last checkpoint in FILE.
+    // --server=SOCKET serves runs of the loaded program over a UNIX socket,
+    // --connect=SOCKET requests one run from such a server, limited to
+    // --limit=N instructions if given.
+    // --harts=N runs N harts sharing the memory, each on its own thread.
+    // --quantum=N or --seed=S runs them in turns instead, N instructions at
+    // a time in an order drawn from S, which makes the run reproducible.
+    // --icache[=CFG] and --dcache[=CFG] count cycles with L1 caches, see
+    // Cache::Parse for CFG, and print the statistics at exit. --bpred[=CFG]
+    // adds the mispredictions of BranchPredictor::Parse. --pipeline[=CFG]
+    // counts cycles of the 5-stage pipeline of PipelineTiming::Parse instead,
+    // the caches and the predictor then feed into it. --ooo[=CFG] does the
+    // same with the out-of-order core of OutOfOrderTiming::Parse, and
+    // --interval[=CFG] estimates it from IntervalTiming::Parse at close to
+    // functional speed.
+    Word jitThreshold = 0;
+    const char* checkpointFile = nullptr;
+    Word checkpointInterval = 1000000;
+    const char* restoreFile = nullptr;
+    const char* serverSocket = nullptr;
+    const char* connectSocket = nullptr;
+    Word limit = 0;
+    unsigned harts = 1;
+    std::optional<Word> quantum;
+    std::optional<uint64_t> seed;
+    std::optional<Cache::Config> icacheConfig;
+    std::optional<Cache::Config> dcacheConfig;
+    std::optional<BranchPredictor::Config> bpredConfig;
+    std::optional<PipelineTiming::Config> pipelineConfig;
+    std::optional<OutOfOrderTiming::Config> oooConfig;
+    std::optional<IntervalTiming::Config> intervalConfig;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--jit") == 0)
+            jitThreshold = jitThreshold ? jitThreshold : 16;
+        else if (std::strncmp(argv[i], "--jit-threshold=", 16) == 0)
+            jitThreshold = std::strtoul(argv[i] + 16, nullptr, 10);
+        else if (std::strncmp(argv[i], "--checkpoint=", 13) == 0)
+            checkpointFile = argv[i] + 13;
+        else if (std::strncmp(argv[i], "--checkpoint-interval=", 22) == 0)
+            checkpointInterval = std::strtoul(argv[i] + 22, nullptr, 10);
+        else if (std::strncmp(argv[i], "--restore=", 10) == 0)
+            restoreFile = argv[i] + 10;
+        else if (std::strncmp(argv[i], "--server=", 9) == 0)
+            serverSocket = argv[i] + 9;
+        else if (std::strncmp(argv[i], "--connect=", 10) == 0)
+            connectSocket = argv[i] + 10;
+        else if (std::strncmp(argv[i], "--limit=", 8) == 0)
+            limit = std::strtoul(argv[i] + 8, nullptr, 10);
+        else if (std::strncmp(argv[i], "--harts=", 8) == 0)
+            harts = std::max(1ul, std::strtoul(argv[i] + 8, nullptr, 10));
+        else if (std::strncmp(argv[i], "--quantum=", 10) == 0)
+            quantum = std::strtoul(argv[i] + 10, nullptr, 10);
+        else if (std::strncmp(argv[i], "--seed=", 7) == 0)
+            seed = std::strtoull(argv[i] + 7, nullptr, 10);
+        else if (std::strcmp(argv[i], "--icache") == 0 || std::strncmp(argv[i], "--icache=", 9) == 0)
+        {
+            icacheConfig = Cache::Parse(argv[i][8] ? argv[i] + 9 : "", "--icache");
+            if (!icacheConfig)
+                return 1;
+        }
+        else if (std::strcmp(argv[i], "--dcache") == 0 || std::strncmp(argv[i], "--dcache=", 9) == 0)
+        {
+            dcacheConfig = Cache::Parse(argv[i][8] ? argv[i] + 9 : "", "--dcache");
+            if (!dcacheConfig)
+                return 1;
+        }
+        else if (std::strcmp(argv[i], "--bpred") == 0 || std::strncmp(argv[i], "--bpred=", 8) == 0)
+        {
+            bpredConfig = BranchPredictor::Parse(argv[i][7] ? argv[i] + 8 : "", "--bpred");
+            if (!bpredConfig)
+                return 1;
+        }
+        else if (std::strcmp(argv[i], "--pipeline") == 0 || std::strncmp(argv[i], "--pipeline=", 11) == 0)
+        {
+            pipelineConfig = PipelineTiming::Parse(argv[i][10] ? argv[i] + 11 : "", "--pipeline");
+            if (!pipelineConfig)
+                return 1;
+        }
+        else if (std::strcmp(argv[i], "--ooo") == 0 || std::strncmp(argv[i], "--ooo=", 6) == 0)
+        {
+            oooConfig = OutOfOrderTiming::Parse(argv[i][5] ? argv[i] + 6 : "", "--ooo");
+            if (!oooConfig)
+                return 1;
+        }
+        else if (std::strcmp(argv[i], "--interval") == 0 || std::strncmp(argv[i], "--interval=", 11) == 0)
+        {
+            intervalConfig = IntervalTiming::Parse(argv[i][10] ? argv[i] + 11 : "", "--interval");
+            if (!intervalConfig)
+                return 1;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--jit] [--jit-threshold=N] [--checkpoint=FILE] "
+                            "[--checkpoint-interval=N] [--restore=FILE] [--server=SOCKET] "
+                            "[--connect=SOCKET] [--limit=N] [--harts=N] [--quantum=N] [--seed=S] "
+                            "[--icache[=CFG]] [--dcache[=CFG]] [--bpred[=CFG]] "
+                            "[--pipeline[=CFG]] [--ooo[=CFG]] [--interval[=CFG]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (connectSocket)
+        return ForkServer::Request(connectSocket, limit);
+
     Memory mem;
     mem.LoadElf("program");
+
+    bool timed = icacheConfig || dcacheConfig || bpredConfig || pipelineConfig || oooConfig || intervalConfig;
+    if (timed && (harts > 1 || serverSocket))
+    {
+        fprintf(stderr, "timing models can't be combined with --harts or the server\n");
+        return 1;
+    }
+    if (bool(pipelineConfig) + bool(oooConfig) + bool(intervalConfig) > 1)
+    {
+        fprintf(stderr, "--pipeline, --ooo and --interval are different cores, pick one\n");
+        return 1;
+    }
+
+    if (harts > 1)
+    {
+        if (checkpointFile || restoreFile || serverSocket)
+        {
+            fprintf(stderr, "--harts can't be combined with checkpoints or the server\n");
+            return 1;
+        }
+        Smp smp{mem, harts};
+        if (!smp.EnableJit(jitThreshold))
+            fprintf(stderr, "JIT is not supported on this host, using the interpreter\n");
+        smp.Reset(0x200);
+        if (quantum || seed)
+            return Scheduler{smp, quantum.value_or(1000), seed.value_or(0)}.Run();
+        return smp.Run();
+    }
+
     Cpu cpu{mem};
+    if (!cpu.EnableJit(jitThreshold))
+        fprintf(stderr, "JIT is not supported on this host, using the interpreter\n");
     cpu.Reset(0x200);
 
-    int32_t print_int = 0;
+    std::optional<Cache> icache;
+    std::optional<Cache> dcache;
+    if (icacheConfig)
+        icache.emplace(icacheConfig.value());
+    if (dcacheConfig)
+        dcache.emplace(dcacheConfig.value());
+    std::optional<BranchPredictor> bpred;
+    if (bpredConfig)
+        bpred.emplace(bpredConfig.value());
+    std::unique_ptr<TimingModel> timing;
+    Cache* icachePtr = icache ? &icache.value() : nullptr;
+    Cache* dcachePtr = dcache ? &dcache.value() : nullptr;
+    BranchPredictor* bpredPtr = bpred ? &bpred.value() : nullptr;
+    if (pipelineConfig)
+        timing = std::make_unique<PipelineTiming>(pipelineConfig.value(), icachePtr, dcachePtr, bpredPtr);
+    else if (oooConfig)
+        timing = std::make_unique<OutOfOrderTiming>(oooConfig.value(), icachePtr, dcachePtr, bpredPtr);
+    else if (intervalConfig)
+        timing = std::make_unique<IntervalTiming>(intervalConfig.value(), icachePtr, dcachePtr, bpredPtr);
+    else if (timed)
+        timing = std::make_unique<PenaltyTiming>(icachePtr, dcachePtr, bpredPtr);
+    cpu.SetTimingModel(timing.get());
+
+    if (restoreFile)
+    {
+        SnapshotReader snapshot;
+        if (!snapshot.Open(restoreFile) || snapshot.Checkpoints() == 0 ||
+            !snapshot.Restore(snapshot.Checkpoints() - 1, cpu, mem))
+            return 1;
+    }
+
+    if (serverSocket)
+        return ForkServer{cpu}.Serve(serverSocket) ? 0 : 1;
+
+    SnapshotWriter checkpoints;
+    if (checkpointFile && (checkpointInterval == 0 || !checkpoints.Open(checkpointFile)))
+        return 1;
+
+    // Run returns on a message from the guest or once about the budget it
+    // was given has run, then it is simply called again. The budget bounds
+    // the counters inside a single call, with checkpoints it also stops at
+    // the next one.
+    constexpr Word runBudget = 1u << 24u;
+    Word untilCheckpoint = checkpointInterval;
+    Host host;
     while (true)
     {
-        cpu.ProcessInstruction();
+        if (checkpointFile)
+        {
+            Word executed = cpu.Run(std::min(runBudget, untilCheckpoint));
+            untilCheckpoint -= std::min(executed, untilCheckpoint);
+            if (untilCheckpoint == 0)
+            {
+                if (!checkpoints.Checkpoint(cpu, mem))
+                    return 1;
+                untilCheckpoint = checkpointInterval;
+            }
+        }
+        else
+            cpu.Run(runBudget);
         std::optional<CpuToHostData> msg = cpu.GetMessage();
         if (!msg)
             continue;
 
-        auto type = msg.value().unpacked.type;
-        auto data = msg.value().unpacked.data;
-
-        if(type == CpuToHostType::ExitCode) {
-            if(data == 0) {
-                fprintf(stderr, "PASSED\n");
-                return 0;
-            } else {
-                fprintf(stderr, "FAILED: exit code = %d\n", data);
-                return data;
-            }
-            break;
-        } else if(type == CpuToHostType::PrintChar) {
-            fprintf(stderr, "%c", (char)data);
-        } else if(type == CpuToHostType::PrintIntLow) {
-            print_int = uint32_t(data);
-        } else if(type == CpuToHostType::PrintIntHigh) {
-            print_int |= uint32_t(data) << 16;
-            fprintf(stderr, "%d", print_int);
+        if (std::optional<int> exitCode = host.Handle(msg.value()))
+        {
+            if (timing)
+                timing->Report(std::cerr);
+            return exitCode.value();
         }
     }
 }
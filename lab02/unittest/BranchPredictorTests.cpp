@@ -0,0 +1,46 @@
+#include "doctest.h"
+
+#include "BranchPredictor.h"
+
+namespace
+{
+    Instruction Control(IType type, RId dst, RId src1, Word nextIp)
+    {
+        Instruction instr;
+        instr._type = type;
+        instr._dst = dst;
+        instr._src1 = src1;
+        instr._nextIp = nextIp;
+        return instr;
+    }
+}
+
+TEST_SUITE("BranchPredictor"){
+    TEST_CASE("Loop branches are learned"){
+        for (auto kind : {"bimodal", "gshare", "tournament", "tage"})
+        {
+            auto config = BranchPredictor::Parse(std::string("bht=") + kind, "test");
+            REQUIRE(config);
+            BranchPredictor predictor{config.value()};
+            // taken 9 times out of 10, then falls through
+            for (int i = 0; i < 100; i++)
+                predictor.Resolve(Control(IType::Br, 0, 0, i % 10 == 9 ? 0x104 : 0x80), 0x100);
+            CHECK_LT(predictor.GetStats(BranchPredictor::Branch).mispredicted, 20);
+        }
+    }
+
+    TEST_CASE("Returns come from the RAS"){
+        BranchPredictor predictor{BranchPredictor::Config{}};
+        // two call sites of a function at 0x400 that returns with jalr x0, 0(ra)
+        for (int i = 0; i < 10; i++)
+        {
+            Word call = i % 2 ? 0x200 : 0x300;
+            predictor.Resolve(Control(IType::J, 1, 0, 0x400), call);
+            CHECK_EQ(predictor.Resolve(Control(IType::Jr, 0, 1, call + 4), 0x40c), 0);
+        }
+        CHECK_EQ(predictor.GetStats(BranchPredictor::Return).executed, 10);
+        CHECK_EQ(predictor.GetStats(BranchPredictor::Return).mispredicted, 0);
+        CHECK_EQ(predictor.GetStats(BranchPredictor::Jump).mispredicted, 2);
+        CHECK_EQ(predictor.GetBranches().at(0x40c).executed, 10);
+    }
+}
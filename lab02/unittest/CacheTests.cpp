@@ -0,0 +1,47 @@
+#include "doctest.h"
+
+#include "Cache.h"
+
+TEST_SUITE("Cache"){
+    TEST_CASE("LRU keeps the recently used line"){
+        // One set of two ways, lines 0x00, 0x40 and 0x80 all map to it
+        Cache cache{Cache::Config{128, 64, 2, Cache::Replacement::Lru, Cache::WritePolicy::WriteBack, 10}};
+        CHECK_EQ(cache.Access(0x00, false), 10);
+        CHECK_EQ(cache.Access(0x44, true), 10);
+        CHECK_EQ(cache.Access(0x08, false), 0);
+        CHECK_EQ(cache.Access(0x80, false), 10); // evicts the dirty 0x40
+        CHECK_EQ(cache.Access(0x00, false), 0);
+        CHECK_EQ(cache.Access(0x40, false), 10);
+
+        const Cache::Stats& stats = cache.GetStats();
+        CHECK_EQ(stats.reads, 5);
+        CHECK_EQ(stats.writes, 1);
+        CHECK_EQ(stats.readMisses, 3);
+        CHECK_EQ(stats.writeMisses, 1);
+        CHECK_EQ(stats.evictions, 2);
+        CHECK_EQ(stats.writebacks, 1);
+    }
+
+    TEST_CASE("Write-through stores don't allocate"){
+        Cache cache{Cache::Config{128, 64, 2, Cache::Replacement::Plru, Cache::WritePolicy::WriteThrough, 10}};
+        CHECK_EQ(cache.Access(0x00, true), 0);
+        CHECK_EQ(cache.Access(0x00, false), 10);
+        CHECK_EQ(cache.Access(0x00, true), 0);
+        CHECK_EQ(cache.GetStats().memoryWrites, 2);
+        CHECK_EQ(cache.GetStats().writebacks, 0);
+    }
+
+    TEST_CASE("Parse"){
+        auto config = Cache::Parse("size=32k,line=64,ways=4,policy=plru,write=through,penalty=50", "test");
+        REQUIRE(config);
+        CHECK_EQ(config->size, 32 * 1024);
+        CHECK_EQ(config->lineSize, 64);
+        CHECK_EQ(config->ways, 4);
+        CHECK(config->replacement == Cache::Replacement::Plru);
+        CHECK(config->writePolicy == Cache::WritePolicy::WriteThrough);
+        CHECK_EQ(config->missPenalty, 50);
+        CHECK_FALSE(Cache::Parse("size=3000", "test"));
+        CHECK_FALSE(Cache::Parse("line=2048m,ways=2", "test"));
+        CHECK_FALSE(Cache::Parse("colour=red", "test"));
+    }
+}
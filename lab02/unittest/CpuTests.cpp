@@ -0,0 +1,442 @@
+#include "doctest.h"
+
+#include "Cpu.h"
+#include "Snapshot.h"
+#include "Smp.h"
+#include "Scheduler.h"
+#include "Host.h"
+#include "TimingModel.h"
+#include "IntervalTiming.h"
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include <sys/stat.h>
+
+namespace
+{
+    constexpr Word START = 0x200;
+    constexpr Word DATA  = 0x1000;
+
+    Word EncodeI(Word opcode, Word rd, Word funct3, Word rs1, int32_t imm)
+    {
+        return opcode | rd << 7u | funct3 << 12u | rs1 << 15u | (Word(imm) & 0xfffu) << 20u;
+    }
+
+    Word EncodeR(Word rd, Word funct3, Word rs1, Word rs2, Word funct7)
+    {
+        return 0b0110011u | rd << 7u | funct3 << 12u | rs1 << 15u | rs2 << 20u | funct7 << 25u;
+    }
+
+    Word EncodeS(Word rs1, Word rs2, int32_t imm)
+    {
+        Word u = Word(imm);
+        return 0b0100011u | (u & 0x1fu) << 7u | 0b010u << 12u | rs1 << 15u | rs2 << 20u | (u >> 5u & 0x7fu) << 25u;
+    }
+
+    Word EncodeB(Word funct3, Word rs1, Word rs2, int32_t imm)
+    {
+        Word u = Word(imm);
+        return 0b1100011u | (u >> 11u & 1u) << 7u | (u >> 1u & 0xfu) << 8u | funct3 << 12u |
+               rs1 << 15u | rs2 << 20u | (u >> 5u & 0x3fu) << 25u | (u >> 12u & 1u) << 31u;
+    }
+
+    Word Addi(Word rd, Word rs1, int32_t imm) { return EncodeI(0b0010011u, rd, 0b000u, rs1, imm); }
+    Word Add(Word rd, Word rs1, Word rs2) { return EncodeR(rd, 0b000u, rs1, rs2, 0); }
+    Word Lw(Word rd, Word rs1, int32_t imm) { return EncodeI(0b0000011u, rd, 0b010u, rs1, imm); }
+    Word Sw(Word rs2, Word rs1, int32_t imm) { return EncodeS(rs1, rs2, imm); }
+    Word Slt(Word rd, Word rs1, Word rs2) { return EncodeR(rd, 0b010u, rs1, rs2, 0); }
+    Word Jalr(Word rd, Word rs1, int32_t imm) { return EncodeI(0b1100111u, rd, 0b000u, rs1, imm); }
+    Word Beq(Word rs1, Word rs2, int32_t imm) { return EncodeB(0b000u, rs1, rs2, imm); }
+    Word Bne(Word rs1, Word rs2, int32_t imm) { return EncodeB(0b001u, rs1, rs2, imm); }
+    Word Lui(Word rd, Word imm) { return 0b0110111u | rd << 7u | (imm & 0xfffff000u); }
+    Word Auipc(Word rd, Word imm) { return 0b0010111u | rd << 7u | (imm & 0xfffff000u); }
+    Word Csrr(Word rd, CsrIdx csr) { return EncodeI(0b1110011u, rd, 0b010u, 0, Word(csr)); }
+    Word Csrw(CsrIdx csr, Word rs1) { return EncodeI(0b1110011u, 0, 0b001u, rs1, Word(csr)); }
+    Word Amo(AmoFunc func, Word rd, Word rs1, Word rs2)
+    {
+        return 0b0101111u | rd << 7u | 0b010u << 12u | rs1 << 15u | rs2 << 20u | Word(func) << 27u;
+    }
+
+    // Sums 10..1, then overwrites an instruction of the block it is running in
+    // and reports the results and instret through memory
+    const std::vector<Word> program = {
+            Addi(5, 0, 10),            // 0x200
+            Addi(6, 0, 0),             // 0x204
+            Add(6, 6, 5),              // 0x208 loop
+            Addi(5, 5, -1),            // 0x20c
+            Bne(5, 0, -8),             // 0x210
+            Lui(10, DATA),             // 0x214
+            Sw(6, 10, 0),              // 0x218
+            Lw(12, 10, 4),             // 0x21c
+            Sw(12, 0, 0x228),          // 0x220 patches 0x228
+            Lw(0, 10, 16),             // 0x224
+            Addi(7, 0, 1),             // 0x228 becomes addi x7, x0, 42
+            Sw(7, 10, 8),              // 0x22c
+            Csrr(13, CsrIdx::Instret), // 0x230
+            Sw(13, 10, 12),            // 0x234
+            Csrw(CsrIdx::Mtohost, 0),  // 0x238 exit code 0
+    };
+
+    // Every pair the block interpreter fuses: lui + addi, slt + beq,
+    // auipc + jalr and addi + lw
+    const std::vector<Word> fusedProgram = {
+            Lui(10, DATA),             // 0x200
+            Addi(10, 10, 0x10),        // 0x204
+            Addi(11, 0, 3),            // 0x208
+            Addi(12, 0, 0),            // 0x20c
+            Slt(13, 12, 11),           // 0x210 loop
+            Beq(13, 0, 0x10),          // 0x214
+            Addi(12, 12, 1),           // 0x218
+            Beq(0, 0, -12),            // 0x21c
+            Addi(0, 0, 0),             // 0x220
+            Auipc(5, 0),               // 0x224
+            Jalr(1, 5, 0x1c),          // 0x228 calls 0x240
+            Sw(14, 10, 0),             // 0x22c
+            Sw(12, 10, 4),             // 0x230
+            Csrr(15, CsrIdx::Instret), // 0x234
+            Sw(15, 10, 8),             // 0x238
+            Csrw(CsrIdx::Mtohost, 0),  // 0x23c exit code 0
+            Addi(6, 10, -0x10),        // 0x240
+            Lw(14, 6, 4),              // 0x244
+            Jalr(0, 1, 0),             // 0x248
+    };
+
+    // Every hart writes hartid + 1 to its slot, hart 0 waits for the
+    // slots of harts 1..3 and exits, the others spin
+    const std::vector<Word> smpProgram = {
+            Csrr(5, CsrIdx::Mhartid),  // 0x200
+            Add(6, 5, 5),              // 0x204
+            Add(6, 6, 6),              // 0x208
+            Lui(10, DATA),             // 0x20c
+            Addi(10, 10, 0x100),       // 0x210
+            Add(11, 10, 6),            // 0x214
+            Addi(7, 5, 1),             // 0x218
+            Sw(7, 11, 0),              // 0x21c
+            Bne(5, 0, 0),              // 0x220 harts other than 0 stop here
+            Lw(7, 10, 4),              // 0x224
+            Beq(7, 0, -4),             // 0x228
+            Lw(7, 10, 8),              // 0x22c
+            Beq(7, 0, -4),             // 0x230
+            Lw(7, 10, 12),             // 0x234
+            Beq(7, 0, -4),             // 0x238
+            Csrw(CsrIdx::Mtohost, 0),  // 0x23c exit code 0
+    };
+
+    // Every hart bumps a shared counter 8 times and logs its hartid under
+    // the new value, so the log records the interleaving. Hart 0 exits once
+    // harts 1..3 have set their done flags.
+    const std::vector<Word> interleavedProgram = {
+            Csrr(5, CsrIdx::Mhartid),  // 0x200
+            Lui(10, DATA),             // 0x204
+            Addi(8, 0, 8),             // 0x208
+            Lw(7, 10, 0x100),          // 0x20c loop
+            Addi(7, 7, 1),             // 0x210
+            Sw(7, 10, 0x100),          // 0x214
+            Add(11, 7, 7),             // 0x218
+            Add(11, 11, 11),           // 0x21c
+            Add(11, 11, 10),           // 0x220
+            Sw(5, 11, 0x200),          // 0x224
+            Addi(8, 8, -1),            // 0x228
+            Bne(8, 0, -32),            // 0x22c
+            Add(11, 5, 5),             // 0x230
+            Add(11, 11, 11),           // 0x234
+            Add(11, 11, 10),           // 0x238
+            Addi(7, 0, 1),             // 0x23c
+            Sw(7, 11, 0x180),          // 0x240
+            Bne(5, 0, 0),              // 0x244 harts other than 0 stop here
+            Lw(7, 10, 0x184),          // 0x248
+            Beq(7, 0, -4),             // 0x24c
+            Lw(7, 10, 0x188),          // 0x250
+            Beq(7, 0, -4),             // 0x254
+            Lw(7, 10, 0x18c),          // 0x258
+            Beq(7, 0, -4),             // 0x25c
+            Csrw(CsrIdx::Mtohost, 0),  // 0x260 exit code 0
+    };
+
+    // Every hart adds 1000 to one counter with amoadd and to another with an
+    // LR/SC loop, then bumps a done counter. Hart 0 exits when it reaches 4.
+    const std::vector<Word> atomicProgram = {
+            Lui(10, DATA),                   // 0x200
+            Addi(11, 10, 0x10),              // 0x204
+            Addi(13, 10, 0x14),              // 0x208
+            Addi(8, 0, 1000),                // 0x20c
+            Addi(9, 0, 1),                   // 0x210
+            Amo(AmoFunc::Add, 0, 10, 9),     // 0x214 loop
+            Amo(AmoFunc::Lr, 7, 11, 0),      // 0x218 retry
+            Addi(7, 7, 1),                   // 0x21c
+            Amo(AmoFunc::Sc, 12, 11, 7),     // 0x220
+            Bne(12, 0, -12),                 // 0x224
+            Addi(8, 8, -1),                  // 0x228
+            Bne(8, 0, -24),                  // 0x22c
+            Amo(AmoFunc::Add, 0, 13, 9),     // 0x230
+            Csrr(5, CsrIdx::Mhartid),        // 0x234
+            Bne(5, 0, 0),                    // 0x238 harts other than 0 stop here
+            Addi(14, 0, 4),                  // 0x23c
+            Lw(7, 13, 0),                    // 0x240
+            Bne(7, 14, -4),                  // 0x244
+            Csrw(CsrIdx::Mtohost, 0),        // 0x248 exit code 0
+    };
+
+    // Prints 'x' forever
+    const std::vector<Word> printingProgram = {
+            Lui(5, 0x10000),           // 0x200 PrintChar
+            Addi(5, 5, 'x'),           // 0x204
+            Csrw(CsrIdx::Mtohost, 5),  // 0x208 loop
+            Beq(0, 0, -4),             // 0x20c
+    };
+
+    std::unique_ptr<Memory> LoadProgram(const std::vector<Word>& code = program)
+    {
+        auto mem = std::make_unique<Memory>();
+        for (size_t i = 0; i < code.size(); i++)
+            mem->Store(START + 4 * i, code[i]);
+        mem->Store(DATA + 4, Addi(7, 0, 42));
+        return mem;
+    }
+
+    template<typename Step>
+    void RunToExit(Cpu& cpu, Step step)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            step(cpu);
+            auto msg = cpu.GetMessage();
+            if (msg && msg->unpacked.type == CpuToHostType::ExitCode)
+                return;
+        }
+        FAIL("program did not finish");
+    }
+}
+
+TEST_SUITE("Cpu"){
+    TEST_CASE("ProcessInstruction"){
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        RunToExit(cpu, [](Cpu& c) { c.ProcessInstruction(); });
+
+        CHECK_EQ(mem->Request(DATA), 55);
+        CHECK_EQ(mem->Request(DATA + 8), 42);
+        CHECK_EQ(mem->Request(DATA + 12), 39);
+    }
+
+    TEST_CASE("ProcessBlock matches ProcessInstruction"){
+        auto reference = LoadProgram();
+        Cpu referenceCpu{*reference};
+        referenceCpu.Reset(START);
+        RunToExit(referenceCpu, [](Cpu& c) { c.ProcessInstruction(); });
+
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        RunToExit(cpu, [](Cpu& c) { c.ProcessBlock(); });
+
+        for (Word addr = DATA; addr < DATA + 16; addr += 4)
+            CHECK_EQ(mem->Request(addr), reference->Request(addr));
+    }
+
+    TEST_CASE("Run stops at host messages"){
+        auto reference = LoadProgram();
+        Cpu referenceCpu{*reference};
+        referenceCpu.Reset(START);
+        RunToExit(referenceCpu, [](Cpu& c) { c.ProcessInstruction(); });
+
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        Word first = cpu.Run(10); // a block is never split
+        CHECK_GE(first, 10);
+        CHECK_FALSE(cpu.GetMessage());
+        CHECK_EQ(first + cpu.Run(1000), 42);
+        auto msg = cpu.GetMessage();
+        REQUIRE(msg);
+        CHECK(msg->unpacked.type == CpuToHostType::ExitCode);
+
+        for (Word addr = DATA; addr < DATA + 16; addr += 4)
+            CHECK_EQ(mem->Request(addr), reference->Request(addr));
+    }
+
+    TEST_CASE("Host stops a printing program at the limit"){
+        auto mem = LoadProgram(printingProgram);
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        FILE* out = std::tmpfile();
+        REQUIRE(out);
+        CHECK_FALSE(Host{out}.Run(cpu, 301));
+        CHECK_EQ(cpu.GetState().counters.instret, 301);
+        CHECK_EQ(std::ftell(out), 150);
+        std::fclose(out);
+    }
+
+    TEST_CASE("Timing model sees every instruction"){
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        Cache icache{Cache::Config{64, 16, 1}};
+        Cache dcache{Cache::Config{}};
+        PenaltyTiming timing{&icache, &dcache};
+        cpu.SetTimingModel(&timing);
+        CHECK_EQ(cpu.Run(1000), 42);
+        REQUIRE(cpu.GetMessage());
+
+        // the result doesn't depend on the model
+        CHECK_EQ(mem->Request(DATA), 55);
+        CHECK_EQ(icache.GetStats().reads, 42);
+        CHECK_GT(icache.GetStats().readMisses, 0);
+        CHECK_GT(dcache.GetStats().writes, 0);
+        Word misses = icache.GetStats().readMisses + dcache.GetStats().readMisses + dcache.GetStats().writeMisses;
+        CHECK_EQ(timing.Cycles(), 42 + 20 * misses);
+    }
+
+    TEST_CASE("Block timing model sees the same accesses"){
+        auto reference = LoadProgram();
+        Cpu referenceCpu{*reference};
+        referenceCpu.Reset(START);
+        Cache referenceCache{Cache::Config{}};
+        PenaltyTiming penalty{nullptr, &referenceCache};
+        referenceCpu.SetTimingModel(&penalty);
+        referenceCpu.Run(1000);
+
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        Cache dcache{Cache::Config{}};
+        IntervalTiming timing{IntervalTiming::Config{}, nullptr, &dcache, nullptr};
+        cpu.SetTimingModel(&timing);
+        CHECK_EQ(cpu.Run(1000), 42);
+        REQUIRE(cpu.GetMessage());
+
+        CHECK_EQ(mem->Request(DATA), 55);
+        CHECK_EQ(dcache.GetStats().reads, referenceCache.GetStats().reads);
+        CHECK_EQ(dcache.GetStats().writes, referenceCache.GetStats().writes);
+        CHECK_GT(timing.Cycles(), 42 / 4);
+        CHECK_GT(timing.GetPenalty(IntervalTiming::Mispredict), 0);
+    }
+
+    TEST_CASE("Restored cycle goes on with the timing model"){
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        PenaltyTiming timing{nullptr, nullptr};
+        cpu.SetTimingModel(&timing);
+        cpu.SetState(CpuState{START, {}, CsrFile::Counters{100, 1000}});
+        CHECK_EQ(cpu.Run(1000), 42);
+        CHECK_EQ(cpu.GetState().counters.instret, 142);
+        CHECK_EQ(cpu.GetState().counters.cycle, 1042);
+    }
+
+    TEST_CASE("Snapshot restores a checkpoint"){
+        auto reference = LoadProgram();
+        Cpu referenceCpu{*reference};
+        referenceCpu.Reset(START);
+        RunToExit(referenceCpu, [](Cpu& c) { c.ProcessInstruction(); });
+
+        const std::string name = "/tmp/riscv_sim_snapshot_" + std::to_string(getpid());
+        struct stat st;
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        SnapshotWriter writer;
+        REQUIRE(writer.Open(name));
+        cpu.Run(10);
+        REQUIRE(writer.Checkpoint(cpu, *mem));
+        REQUIRE(stat(name.c_str(), &st) == 0);
+        off_t baseSize = st.st_size;
+        cpu.Run(25); // the loop is done, DATA and the code have been written
+        REQUIRE(writer.Checkpoint(cpu, *mem));
+        REQUIRE(stat(name.c_str(), &st) == 0);
+        CHECK_EQ(st.st_size - baseSize, 3 * Memory::PageSize()); // record, code and DATA pages
+
+        SnapshotReader reader;
+        REQUIRE(reader.Open(name));
+        REQUIRE_EQ(reader.Checkpoints(), 2);
+        for (size_t index = 0; index < 2; index++)
+        {
+            auto restored = std::make_unique<Memory>();
+            Cpu restoredCpu{*restored};
+            restoredCpu.Reset(0);
+            REQUIRE(reader.Restore(index, restoredCpu, *restored));
+            RunToExit(restoredCpu, [](Cpu& c) { c.ProcessInstruction(); });
+
+            for (Word addr = DATA; addr < DATA + 16; addr += 4)
+                CHECK_EQ(restored->Request(addr), reference->Request(addr));
+        }
+        std::remove(name.c_str());
+    }
+
+    TEST_CASE("Fused pairs match ProcessInstruction"){
+        auto reference = LoadProgram(fusedProgram);
+        Cpu referenceCpu{*reference};
+        referenceCpu.Reset(START);
+        RunToExit(referenceCpu, [](Cpu& c) { c.ProcessInstruction(); });
+
+        CHECK_EQ(reference->Request(DATA + 0x10), Addi(7, 0, 42));
+        CHECK_EQ(reference->Request(DATA + 0x14), 3);
+
+        auto mem = LoadProgram(fusedProgram);
+        Cpu cpu{*mem};
+        cpu.Reset(START);
+        RunToExit(cpu, [](Cpu& c) { c.ProcessBlock(); });
+
+        for (Word addr = DATA + 0x10; addr < DATA + 0x1c; addr += 4)
+            CHECK_EQ(mem->Request(addr), reference->Request(addr));
+    }
+
+    TEST_CASE("JIT matches ProcessInstruction"){
+        auto reference = LoadProgram();
+        Cpu referenceCpu{*reference};
+        referenceCpu.Reset(START);
+        RunToExit(referenceCpu, [](Cpu& c) { c.ProcessInstruction(); });
+
+        auto mem = LoadProgram();
+        Cpu cpu{*mem};
+        if (!cpu.EnableJit(1))
+            return;
+        cpu.Reset(START);
+        RunToExit(cpu, [](Cpu& c) { c.ProcessBlock(); });
+
+        for (Word addr = DATA; addr < DATA + 16; addr += 4)
+            CHECK_EQ(mem->Request(addr), reference->Request(addr));
+        CHECK(mem->IsDirty(DATA));
+    }
+
+    TEST_CASE("Harts share memory"){
+        auto mem = LoadProgram(smpProgram);
+        Smp smp{*mem, 4};
+        smp.Reset(START);
+        CHECK_EQ(smp.Run(), 0);
+
+        for (Word i = 0; i < smp.Harts(); i++)
+            CHECK_EQ(mem->Request(DATA + 0x100 + 4 * i), i + 1);
+    }
+
+    TEST_CASE("Scheduler is reproducible"){
+        auto run = [](uint64_t seed)
+        {
+            auto mem = LoadProgram(interleavedProgram);
+            Smp smp{*mem, 4};
+            smp.Reset(START);
+            CHECK_EQ(Scheduler{smp, 4, seed}.Run(), 0);
+
+            std::vector<Word> log;
+            for (Word addr = DATA + 0x100; addr < DATA + 0x300; addr += 4)
+                log.push_back(mem->Request(addr));
+            return log;
+        };
+
+        std::vector<Word> log = run(1);
+        CHECK_EQ(log[0], 32);
+        CHECK(run(1) == log);
+    }
+
+    TEST_CASE("Atomics from parallel harts"){
+        auto mem = LoadProgram(atomicProgram);
+        Smp smp{*mem, 4};
+        smp.Reset(START);
+        CHECK_EQ(smp.Run(), 0);
+
+        CHECK_EQ(mem->Request(DATA), 4000);
+        CHECK_EQ(mem->Request(DATA + 0x10), 4000);
+    }
+}
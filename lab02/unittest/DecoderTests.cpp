@@ -4,12 +4,12 @@
 #include "Instructions.h"
 #include "Decoder.h"
 
-void testBranch(InstructionPtr &instruction);
-void testI(InstructionPtr &instruction);
-void testR(InstructionPtr &instruction);
-void testU(InstructionPtr &instruction);
-void testUJ(InstructionPtr &instruction);
-void testAlu(InstructionPtr &instruction);
+void testBranch(Instruction &instruction);
+void testI(Instruction &instruction);
+void testR(Instruction &instruction);
+void testU(Instruction &instruction);
+void testUJ(Instruction &instruction);
+void testAlu(Instruction &instruction);
 
 TEST_SUITE("Decoder"){
     Decoder _decoder;
@@ -17,61 +17,61 @@ TEST_SUITE("Decoder"){
         SUBCASE("AND"){
             auto instruction = _decoder.Decode(AND);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::And);
+            CHECK(instruction._aluFunc == AluFunc::And);
         }
 
         SUBCASE("ADD"){
             auto instruction = _decoder.Decode(ADD);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Add);
+            CHECK(instruction._aluFunc == AluFunc::Add);
         }
 
         SUBCASE("OR"){
             auto instruction = _decoder.Decode(OR);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Or);
+            CHECK(instruction._aluFunc == AluFunc::Or);
         }
 
         SUBCASE("SUB"){
             auto instruction = _decoder.Decode(SUB);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Sub);
+            CHECK(instruction._aluFunc == AluFunc::Sub);
         }
 
         SUBCASE("SLL"){
             auto instruction = _decoder.Decode(SLL);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Sll);
+            CHECK(instruction._aluFunc == AluFunc::Sll);
         }
 
         SUBCASE("XOR"){
             auto instruction = _decoder.Decode(XOR);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Xor);
+            CHECK(instruction._aluFunc == AluFunc::Xor);
         }
 
         SUBCASE("SRL"){
             auto instruction = _decoder.Decode(SRL);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Srl);
+            CHECK(instruction._aluFunc == AluFunc::Srl);
         }
 
         SUBCASE("SRA"){
             auto instruction = _decoder.Decode(SRA);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Sra);
+            CHECK(instruction._aluFunc == AluFunc::Sra);
         }
 
         SUBCASE("SLT"){
             auto instruction = _decoder.Decode(SLT);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Slt);
+            CHECK(instruction._aluFunc == AluFunc::Slt);
         }
 
         SUBCASE("SLTU"){
             auto instruction = _decoder.Decode(SLTU);
             testR(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Sltu);
+            CHECK(instruction._aluFunc == AluFunc::Sltu);
         }
     }
 
@@ -79,66 +79,68 @@ TEST_SUITE("Decoder"){
         SUBCASE("ANDI"){
             auto instruction = _decoder.Decode(ANDI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::And);
+            CHECK(instruction._aluFunc == AluFunc::And);
         }
 
         SUBCASE("ADDI"){
             auto instruction = _decoder.Decode(ADDI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Add);
+            CHECK(instruction._aluFunc == AluFunc::Add);
         }
 
         SUBCASE("ORI"){
             auto instruction = _decoder.Decode(ORI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Or);
+            CHECK(instruction._aluFunc == AluFunc::Or);
         }
 
         SUBCASE("SLLI"){
             auto instruction = _decoder.Decode(SLLI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Sll);
+            CHECK(instruction._aluFunc == AluFunc::Sll);
         }
 
         SUBCASE("XORI"){
             auto instruction = _decoder.Decode(XORI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Xor);
+            CHECK(instruction._aluFunc == AluFunc::Xor);
         }
 
         SUBCASE("SRLI"){
             auto instruction = _decoder.Decode(SRLI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Srl);
+            CHECK(instruction._aluFunc == AluFunc::Srl);
         }
 
         SUBCASE("SRAI"){
             auto instruction = _decoder.Decode(SRAI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Sra);
+            CHECK(instruction._aluFunc == AluFunc::Sra);
         }
 
         SUBCASE("SLTIU"){
             auto instruction = _decoder.Decode(SLTIU);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Sltu);
+            CHECK(instruction._aluFunc == AluFunc::Sltu);
         }
 
         SUBCASE("SLTI"){
             auto instruction = _decoder.Decode(SLTI);
             testI(instruction);
-            CHECK(instruction->_aluFunc == AluFunc::Slt);
+            CHECK(instruction._aluFunc == AluFunc::Slt);
         }
 
 
         // RV32 Load Instructions are also I-Type
         SUBCASE("LW"){
             auto instruction = _decoder.Decode(LW);
-            CHECK(instruction->_imm.value() == IMM);
-            CHECK(instruction->_src1.value() == 1);
-            CHECK(instruction->_dst.value() == 15);
-            CHECK(instruction->_type == IType::Ld);
-            CHECK(instruction->_aluFunc == AluFunc::Add);
+            CHECK(instruction.Has(Instruction::Imm));
+            CHECK(instruction._imm == IMM);
+            CHECK(instruction.Has(Instruction::Src1));
+            CHECK(instruction._src1 == 1);
+            CHECK(instruction._dst == 15);
+            CHECK(instruction._type == IType::Ld);
+            CHECK(instruction._aluFunc == AluFunc::Add);
         }
     }
 
@@ -146,14 +148,14 @@ TEST_SUITE("Decoder"){
         SUBCASE("AUIPC"){
             auto instruction = _decoder.Decode(AUIPC);
             testU(instruction);
-            CHECK(instruction->_type == IType::Auipc);
+            CHECK(instruction._type == IType::Auipc);
         }
 
         SUBCASE("LUI"){
             auto instruction = _decoder.Decode(LUI);
             testU(instruction);
-            CHECK(instruction->_type == IType::Alu);
-            CHECK(instruction->_aluFunc == AluFunc::Add);
+            CHECK(instruction._type == IType::Alu);
+            CHECK(instruction._aluFunc == AluFunc::Add);
         }
 
     }
@@ -161,10 +163,13 @@ TEST_SUITE("Decoder"){
     TEST_CASE("S-Format"){
         SUBCASE("SW"){
             auto instruction = _decoder.Decode(SW);
-            CHECK(instruction->_imm.value() == IMM_S);
-            CHECK(instruction->_src2.value() == 15);
-            CHECK(instruction->_src1.value() == 15);
-            CHECK(instruction->_type == IType::St);
+            CHECK(instruction.Has(Instruction::Imm));
+            CHECK(instruction._imm == IMM_S);
+            CHECK(instruction.Has(Instruction::Src2));
+            CHECK(instruction._src2 == 15);
+            CHECK(instruction.Has(Instruction::Src1));
+            CHECK(instruction._src1 == 15);
+            CHECK(instruction._type == IType::St);
         }
     }
 
@@ -172,37 +177,42 @@ TEST_SUITE("Decoder"){
         SUBCASE("BEQ"){
             auto instruction = _decoder.Decode(BEQ);
             testBranch(instruction);
-            CHECK(instruction->_brFunc == BrFunc::Eq);
+            CHECK(instruction._brFunc == BrFunc::Eq);
         }
 
         SUBCASE("BGE"){
             auto instruction = _decoder.Decode(BGE);
             testBranch(instruction);
-            CHECK(instruction->_brFunc == BrFunc::Ge);
+            CHECK(instruction._brFunc == BrFunc::Ge);
         }
 
         SUBCASE("BGEU"){
             auto instruction = _decoder.Decode(BGEU);
             testBranch(instruction);
-            CHECK(instruction->_brFunc == BrFunc::Geu);
+            CHECK(instruction._brFunc == BrFunc::Geu);
         }
 
         SUBCASE("BNE"){
             auto instruction = _decoder.Decode(BNE);
             testBranch(instruction);
-            CHECK(instruction->_brFunc == BrFunc::Neq);
+            CHECK(instruction._brFunc == BrFunc::Neq);
         }
 
         SUBCASE("BLT"){
             auto instruction = _decoder.Decode(BLT);
             testBranch(instruction);
-            CHECK(instruction->_brFunc == BrFunc::Lt);
+            CHECK(instruction._brFunc == BrFunc::Lt);
         }
 
         SUBCASE("BLTU"){
             auto instruction = _decoder.Decode(BLTU);
             testBranch(instruction);
-            CHECK(instruction->_brFunc == BrFunc::Ltu);
+            CHECK(instruction._brFunc == BrFunc::Ltu);
+        }
+
+        SUBCASE("Reserved funct3"){
+            CHECK(_decoder.Decode(BEQ | 0b010u << 12u)._type == IType::Unsupported);
+            CHECK(_decoder.Decode(BEQ | 0b011u << 12u)._type == IType::Unsupported);
         }
 
     }
@@ -211,58 +221,70 @@ TEST_SUITE("Decoder"){
         SUBCASE("JAL"){
             auto instruction = _decoder.Decode(JAL);
             testUJ(instruction);
-            CHECK(instruction->_type == IType::J);
+            CHECK(instruction._type == IType::J);
         }
 
         SUBCASE("JALR"){
             auto instruction = _decoder.Decode(JALR);
             testUJ(instruction);
-            CHECK(instruction->_src1.value() == 1);
-            CHECK(instruction->_type == IType::Jr);
+            CHECK(instruction.Has(Instruction::Src1));
+            CHECK(instruction._src1 == 1);
+            CHECK(instruction._type == IType::Jr);
         }
     }
     TEST_CASE("Task6"){
         SUBCASE("BLT"){
             auto instruction = _decoder.Decode(0b0'000000'01100'01011'100'0110'0'1100011);
-            CHECK(instruction->_type == IType::Br);
-            CHECK(instruction->_brFunc == BrFunc::Lt);
-            CHECK(instruction->_src1.value() == 11);
-            CHECK(instruction->_src2.value() == 12);
-            CHECK(instruction->_imm.value() == IMM_SB);
+            CHECK(instruction._type == IType::Br);
+            CHECK(instruction._brFunc == BrFunc::Lt);
+            CHECK(instruction.Has(Instruction::Src1));
+            CHECK(instruction._src1 == 11);
+            CHECK(instruction.Has(Instruction::Src2));
+            CHECK(instruction._src2 == 12);
+            CHECK(instruction.Has(Instruction::Imm));
+            CHECK(instruction._imm == IMM_SB);
         }
     }
 }
 
-void testBranch(InstructionPtr &instruction){
-    CHECK(instruction->_imm.value() == IMM_SB);
-    CHECK(instruction->_src1.value() == 15);
-    CHECK(instruction->_src2.value() == 15);
-    CHECK(instruction->_type == IType::Br);
+void testBranch(Instruction &instruction){
+    CHECK(instruction.Has(Instruction::Imm));
+    CHECK(instruction._imm == IMM_SB);
+    CHECK(instruction.Has(Instruction::Src1));
+    CHECK(instruction._src1 == 15);
+    CHECK(instruction.Has(Instruction::Src2));
+    CHECK(instruction._src2 == 15);
+    CHECK(instruction._type == IType::Br);
 }
 
-void testR(InstructionPtr &instruction){
+void testR(Instruction &instruction){
     testAlu(instruction);
-    CHECK(instruction->_src2.value() == 3);
+    CHECK(instruction.Has(Instruction::Src2));
+    CHECK(instruction._src2 == 3);
 
 }
 
-void testI(InstructionPtr &instruction){
+void testI(Instruction &instruction){
     testAlu(instruction);
-    CHECK(instruction->_imm.value() == IMM);
+    CHECK(instruction.Has(Instruction::Imm));
+    CHECK(instruction._imm == IMM);
 }
 
-void testU(InstructionPtr &instruction){
-    CHECK(instruction->_imm.value() == IMM_U << 12u);
-    CHECK(instruction->_dst.value() == 15);
+void testU(Instruction &instruction){
+    CHECK(instruction.Has(Instruction::Imm));
+    CHECK(instruction._imm == IMM_U << 12u);
+    CHECK(instruction._dst == 15);
 }
 
-void testUJ(InstructionPtr &instruction){
-    CHECK(instruction->_imm.value() == IMM_UJ);
-    CHECK(instruction->_dst.value() == 15);
+void testUJ(Instruction &instruction){
+    CHECK(instruction.Has(Instruction::Imm));
+    CHECK(instruction._imm == IMM_UJ);
+    CHECK(instruction._dst == 15);
 }
 
-void testAlu(InstructionPtr &instruction){
-    CHECK(instruction->_src1.value() == 1);
-    CHECK(instruction->_dst.value() == 15);
-    CHECK(instruction->_type == IType::Alu);
+void testAlu(Instruction &instruction){
+    CHECK(instruction.Has(Instruction::Src1));
+    CHECK(instruction._src1 == 1);
+    CHECK(instruction._dst == 15);
+    CHECK(instruction._type == IType::Alu);
 }
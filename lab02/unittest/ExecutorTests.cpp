@@ -8,12 +8,12 @@ constexpr Word IP        = 0x200;
 constexpr Word SRCVAL1   = 1;
 constexpr Word SRCVAL2   = 2;
 
-void testAlu(InstructionPtr &instruction, Executor &exe);
-void testR(InstructionPtr &instruction, Executor &exe);
-void testI(InstructionPtr &instruction, Executor &exe);
-void testU(InstructionPtr &instruction, Executor &exe);
-void testBranch(InstructionPtr &instruction, Executor &exe);
-void testUJ(InstructionPtr &instruction, Executor &exe);
+void testAlu(Instruction &instruction, Executor &exe);
+void testR(Instruction &instruction, Executor &exe);
+void testI(Instruction &instruction, Executor &exe);
+void testU(Instruction &instruction, Executor &exe);
+void testBranch(Instruction &instruction, Executor &exe);
+void testUJ(Instruction &instruction, Executor &exe);
 
 
 TEST_SUITE("Executor"){
@@ -23,61 +23,61 @@ TEST_SUITE("Executor"){
         SUBCASE("AND"){
             auto instruction = _decoder.Decode(AND);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 & SRCVAL2);
+            CHECK_EQ(instruction._data, SRCVAL1 & SRCVAL2);
         }
 
         SUBCASE("ADD"){
             auto instruction = _decoder.Decode(ADD);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 + SRCVAL2);
+            CHECK_EQ(instruction._data, SRCVAL1 + SRCVAL2);
         }
 
         SUBCASE("OR"){
             auto instruction = _decoder.Decode(OR);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 | SRCVAL2);
+            CHECK_EQ(instruction._data, SRCVAL1 | SRCVAL2);
         }
 
         SUBCASE("SUB"){
             auto instruction = _decoder.Decode(SUB);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 - SRCVAL2);
+            CHECK_EQ(instruction._data, SRCVAL1 - SRCVAL2);
         }
 
         SUBCASE("SLL"){
             auto instruction = _decoder.Decode(SLL);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 << (SRCVAL2 % 32));
+            CHECK_EQ(instruction._data, SRCVAL1 << (SRCVAL2 % 32));
         }
 
         SUBCASE("XOR"){
             auto instruction = _decoder.Decode(XOR);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 ^ SRCVAL2);
+            CHECK_EQ(instruction._data, SRCVAL1 ^ SRCVAL2);
         }
 
         SUBCASE("SRL"){
             auto instruction = _decoder.Decode(SRL);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 >> (SRCVAL2 % 32));
+            CHECK_EQ(instruction._data, SRCVAL1 >> (SRCVAL2 % 32));
         }
 
         SUBCASE("SRA"){
             auto instruction = _decoder.Decode(SRA);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, Word((int)SRCVAL1 >> (SRCVAL2 % 32)));
+            CHECK_EQ(instruction._data, Word((int)SRCVAL1 >> (SRCVAL2 % 32)));
         }
 
         SUBCASE("SLT"){
             auto instruction = _decoder.Decode(SLT);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, (int)SRCVAL1 < (int)SRCVAL2);
+            CHECK_EQ(instruction._data, (int)SRCVAL1 < (int)SRCVAL2);
         }
 
         SUBCASE("SLTU"){
             auto instruction = _decoder.Decode(SLTU);
             testR(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 < SRCVAL2);
+            CHECK_EQ(instruction._data, SRCVAL1 < SRCVAL2);
 
         }
     }
@@ -86,58 +86,58 @@ TEST_SUITE("Executor"){
         SUBCASE("ANDI"){
             auto instruction = _decoder.Decode(ANDI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 & IMM);
+            CHECK_EQ(instruction._data, SRCVAL1 & IMM);
         }
 
         SUBCASE("ADDI"){
             auto instruction = _decoder.Decode(ADDI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 + IMM);
+            CHECK_EQ(instruction._data, SRCVAL1 + IMM);
         }
 
         SUBCASE("ORI"){
             auto instruction = _decoder.Decode(ORI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 | IMM);
+            CHECK_EQ(instruction._data, SRCVAL1 | IMM);
         }
 
         SUBCASE("SLLI"){
             auto instruction = _decoder.Decode(SLLI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 << (IMM % 32));
+            CHECK_EQ(instruction._data, SRCVAL1 << (IMM % 32));
 
         }
 
         SUBCASE("XORI"){
             auto instruction = _decoder.Decode(XORI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 ^ IMM);
+            CHECK_EQ(instruction._data, SRCVAL1 ^ IMM);
 
         }
 
         SUBCASE("SRLI"){
             auto instruction = _decoder.Decode(SRLI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 >> (IMM % 32));
+            CHECK_EQ(instruction._data, SRCVAL1 >> (IMM % 32));
 
         }
 
         SUBCASE("SRAI"){
             auto instruction = _decoder.Decode(SRAI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, Word((int)SRCVAL1 >> (IMM % 32)));
+            CHECK_EQ(instruction._data, Word((int)SRCVAL1 >> (IMM % 32)));
         }
 
         SUBCASE("SLTIU"){
             auto instruction = _decoder.Decode(SLTIU);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, SRCVAL1 < IMM);
+            CHECK_EQ(instruction._data, SRCVAL1 < IMM);
         }
 
         SUBCASE("SLTI"){
             auto instruction = _decoder.Decode(SLTI);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_data, (int)SRCVAL1 < (int)IMM);
+            CHECK_EQ(instruction._data, (int)SRCVAL1 < (int)IMM);
 
 
         }
@@ -146,7 +146,7 @@ TEST_SUITE("Executor"){
         SUBCASE("LW"){
             auto instruction = _decoder.Decode(LW);
             testI(instruction, _exe);
-            CHECK_EQ(instruction->_addr, SRCVAL1 + IMM);
+            CHECK_EQ(instruction._addr, SRCVAL1 + IMM);
         }
     }
 
@@ -154,13 +154,13 @@ TEST_SUITE("Executor"){
         SUBCASE("AUIPC"){
             auto instruction = _decoder.Decode(AUIPC);
             testU(instruction, _exe);
-            CHECK_EQ(instruction->_data, IP + (IMM_U << 12u));
+            CHECK_EQ(instruction._data, IP + (IMM_U << 12u));
         }
 
         SUBCASE("LUI"){
             auto instruction = _decoder.Decode(LUI);
             testU(instruction, _exe);
-            CHECK_EQ(instruction->_data, IMM_U << 12u);
+            CHECK_EQ(instruction._data, IMM_U << 12u);
         }
 
     }
@@ -168,13 +168,13 @@ TEST_SUITE("Executor"){
     TEST_CASE("S-Format"){
         SUBCASE("SW"){
             auto instruction = _decoder.Decode(SW);
-            instruction->_src1Val = SRCVAL1;
-            instruction->_src2Val = SRCVAL2;
+            instruction._src1Val = SRCVAL1;
+            instruction._src2Val = SRCVAL2;
             _exe.Execute(instruction, IP);
 
-            CHECK_EQ(instruction->_data, SRCVAL2);
-            CHECK_EQ(instruction->_addr, SRCVAL1 + IMM_S);
-            CHECK_EQ(instruction->_nextIp, IP + 4);
+            CHECK_EQ(instruction._data, SRCVAL2);
+            CHECK_EQ(instruction._addr, SRCVAL1 + IMM_S);
+            CHECK_EQ(instruction._nextIp, IP + 4);
 
         }
     }
@@ -183,40 +183,40 @@ TEST_SUITE("Executor"){
         SUBCASE("BEQ"){
             auto instruction = _decoder.Decode(BEQ);
             testBranch(instruction, _exe);
-            CHECK_EQ(instruction->_nextIp, (SRCVAL1 == SRCVAL2 )? IP + IMM_SB : IP + 4);
+            CHECK_EQ(instruction._nextIp, (SRCVAL1 == SRCVAL2 )? IP + IMM_SB : IP + 4);
         }
 
         SUBCASE("BGE"){
             auto instruction = _decoder.Decode(BGE);
             testBranch(instruction, _exe);
-            CHECK_EQ(instruction->_nextIp, ((int)SRCVAL1 >= (int)SRCVAL2)? IP + IMM_SB : IP + 4);
+            CHECK_EQ(instruction._nextIp, ((int)SRCVAL1 >= (int)SRCVAL2)? IP + IMM_SB : IP + 4);
         }
 
         SUBCASE("BGEU"){
             auto instruction = _decoder.Decode(BGEU);
             testBranch(instruction, _exe);
-            CHECK_EQ(instruction->_nextIp, (SRCVAL1 >= SRCVAL2 )? IP + IMM_SB : IP + 4);
+            CHECK_EQ(instruction._nextIp, (SRCVAL1 >= SRCVAL2 )? IP + IMM_SB : IP + 4);
 
         }
 
         SUBCASE("BNE"){
             auto instruction = _decoder.Decode(BNE);
             testBranch(instruction, _exe);
-            CHECK_EQ(instruction->_nextIp, (SRCVAL1 != SRCVAL2)? IP + IMM_SB : IP + 4);
+            CHECK_EQ(instruction._nextIp, (SRCVAL1 != SRCVAL2)? IP + IMM_SB : IP + 4);
 
         }
 
         SUBCASE("BLT"){
             auto instruction = _decoder.Decode(BLT);
             testBranch(instruction, _exe);
-            CHECK_EQ(instruction->_nextIp, ((int)SRCVAL1 < (int)SRCVAL2 )? IP + IMM_SB : IP + 4);
+            CHECK_EQ(instruction._nextIp, ((int)SRCVAL1 < (int)SRCVAL2 )? IP + IMM_SB : IP + 4);
 
         }
 
         SUBCASE("BLTU"){
             auto instruction = _decoder.Decode(BLTU);
             testBranch(instruction, _exe);
-            CHECK_EQ(instruction->_nextIp, (SRCVAL1 < SRCVAL2 )? IP + IMM_SB : IP + 4);
+            CHECK_EQ(instruction._nextIp, (SRCVAL1 < SRCVAL2 )? IP + IMM_SB : IP + 4);
         }
 
     }
@@ -229,53 +229,107 @@ TEST_SUITE("Executor"){
 
         SUBCASE("JALR"){
             auto instruction = _decoder.Decode(JALR);
-            instruction->_src1Val = SRCVAL1;
+            instruction._src1Val = SRCVAL1;
             testUJ(instruction, _exe);
 
-            CHECK_EQ(instruction->_nextIp, IMM_UJ + SRCVAL1);
+            CHECK_EQ(instruction._nextIp, IMM_UJ + SRCVAL1);
 
         }
     }
     
+    TEST_CASE("M-Format"){
+        auto execute = [](Word code, Word first, Word second)
+        {
+            auto instruction = _decoder.Decode(code);
+            CHECK(instruction._type == IType::Alu);
+            instruction._src1Val = first;
+            instruction._src2Val = second;
+            _exe.Execute(instruction, IP);
+            CHECK_EQ(instruction._nextIp, IP + 4);
+            return instruction._data;
+        };
+
+        SUBCASE("MUL"){
+            CHECK_EQ(execute(MUL, 7, Word(-3)), Word(-21));
+            CHECK_EQ(execute(MUL, 0x10000, 0x10000), 0);
+        }
+
+        SUBCASE("MULH"){
+            CHECK_EQ(execute(MULH, Word(-2), 3), ~0u);
+            CHECK_EQ(execute(MULH, 0x80000000u, 0x80000000u), 0x40000000u);
+        }
+
+        SUBCASE("MULHSU"){
+            CHECK_EQ(execute(MULHSU, Word(-1), 0xffffffffu), ~0u);
+            CHECK_EQ(execute(MULHSU, 2, 0x80000000u), 1);
+        }
+
+        SUBCASE("MULHU"){
+            CHECK_EQ(execute(MULHU, 0xffffffffu, 0xffffffffu), 0xfffffffeu);
+        }
+
+        SUBCASE("DIV"){
+            CHECK_EQ(execute(DIV, Word(-7), 2), Word(-3));
+            CHECK_EQ(execute(DIV, 5, 0), ~0u);
+            CHECK_EQ(execute(DIV, 0x80000000u, ~0u), 0x80000000u);
+        }
+
+        SUBCASE("DIVU"){
+            CHECK_EQ(execute(DIVU, 0xfffffffeu, 2), 0x7fffffffu);
+            CHECK_EQ(execute(DIVU, 5, 0), ~0u);
+        }
+
+        SUBCASE("REM"){
+            CHECK_EQ(execute(REM, Word(-7), 2), Word(-1));
+            CHECK_EQ(execute(REM, 5, 0), 5);
+            CHECK_EQ(execute(REM, 0x80000000u, ~0u), 0);
+        }
+
+        SUBCASE("REMU"){
+            CHECK_EQ(execute(REMU, 0xffffffffu, 10), 5);
+            CHECK_EQ(execute(REMU, 5, 0), 5);
+        }
+    }
+
     TEST_CASE("Task6"){
         SUBCASE("BLT"){
             auto instruction = _decoder.Decode(0b0'000000'01100'01011'100'0111'0'1100011);
-            instruction->_src1Val = 11;
-            instruction->_src2Val = 12;
+            instruction._src1Val = 11;
+            instruction._src2Val = 12;
             _exe.Execute(instruction, IP);
-            CHECK(instruction->_nextIp == IP + instruction->_imm.value());
+            CHECK(instruction._nextIp == IP + instruction._imm);
         }
     }
 }
 
-void testAlu(InstructionPtr &instruction, Executor &exe){
-    instruction->_src1Val = SRCVAL1;
+void testAlu(Instruction &instruction, Executor &exe){
+    instruction._src1Val = SRCVAL1;
     exe.Execute(instruction, IP);
 
-    CHECK_EQ(instruction->_nextIp, IP + 4);
+    CHECK_EQ(instruction._nextIp, IP + 4);
 }
 
-void testR(InstructionPtr &instruction, Executor &exe){
-    instruction->_src2Val = SRCVAL2;
+void testR(Instruction &instruction, Executor &exe){
+    instruction._src2Val = SRCVAL2;
     testAlu(instruction, exe);
 }
 
-void testI(InstructionPtr &instruction, Executor &exe){
+void testI(Instruction &instruction, Executor &exe){
     testAlu(instruction, exe);
 }
 
-void testU(InstructionPtr &instruction, Executor &exe){
+void testU(Instruction &instruction, Executor &exe){
     exe.Execute(instruction, IP);
-    CHECK_EQ(instruction->_nextIp, IP + 4);
+    CHECK_EQ(instruction._nextIp, IP + 4);
 }
 
-void testBranch(InstructionPtr &instruction, Executor &exe){
-    instruction->_src1Val = SRCVAL1;
-    instruction->_src2Val = SRCVAL2;
+void testBranch(Instruction &instruction, Executor &exe){
+    instruction._src1Val = SRCVAL1;
+    instruction._src2Val = SRCVAL2;
     exe.Execute(instruction, IP);
 }
 
-void testUJ(InstructionPtr &instruction, Executor &exe){
+void testUJ(Instruction &instruction, Executor &exe){
     exe.Execute(instruction, IP);
-    CHECK_EQ(instruction->_data, IP + 4);
+    CHECK_EQ(instruction._data, IP + 4);
 }
@@ -33,6 +33,16 @@ constexpr Word SLTU   = 0b00000000001100001011011110110011;
 constexpr Word SLTIU  = 0b00000000001100001011011110010011;
 constexpr Word LW     = 0b00000000001100001010011110000011;
 
+// M: funct7 = 0000001
+constexpr Word MUL    = 0b00000010001100001000011110110011;
+constexpr Word MULH   = 0b00000010001100001001011110110011;
+constexpr Word MULHSU = 0b00000010001100001010011110110011;
+constexpr Word MULHU  = 0b00000010001100001011011110110011;
+constexpr Word DIV    = 0b00000010001100001100011110110011;
+constexpr Word DIVU   = 0b00000010001100001101011110110011;
+constexpr Word REM    = 0b00000010001100001110011110110011;
+constexpr Word REMU   = 0b00000010001100001111011110110011;
+
 // S: imm = 12
 constexpr Word SW     = 0b00000000111101111010011000100011;
 
@@ -0,0 +1,179 @@
+#include "doctest.h"
+
+#include "Memory.h"
+
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace
+{
+    constexpr Word OFFSET   = 0xff0;   // file offset of the segment
+    constexpr Word ADDR     = 0xfff0;  // same offset within a page, so whole pages get mapped
+    constexpr Word FILESZ   = 0x2020;  // unaligned head, two pages, unaligned tail
+    constexpr Word MEMSZ    = 0x3000;
+
+    Word Pattern(Word addr) { return addr * 2654435761u; }
+
+    // The PT_LOAD segment filled with Pattern of its addresses
+    Elf32_Phdr Segment()
+    {
+        Elf32_Phdr phdr = {};
+        phdr.p_type = PT_LOAD;
+        phdr.p_offset = OFFSET;
+        phdr.p_paddr = ADDR;
+        phdr.p_filesz = FILESZ;
+        phdr.p_memsz = MEMSZ;
+        phdr.p_flags = PF_R | PF_X;
+        return phdr;
+    }
+
+    // ELF with the segment, followed by extra if there is one
+    std::string WriteElf(std::optional<Elf32_Phdr> extra = std::nullopt)
+    {
+        std::vector<char> file(OFFSET + FILESZ);
+        auto ehdr = reinterpret_cast<Elf32_Ehdr*>(file.data());
+        std::memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+        ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+        ehdr->e_phoff = sizeof(Elf32_Ehdr);
+        ehdr->e_phentsize = sizeof(Elf32_Phdr);
+        ehdr->e_phnum = 1;
+
+        auto phdr = reinterpret_cast<Elf32_Phdr*>(file.data() + ehdr->e_phoff);
+        phdr[0] = Segment();
+        if (extra)
+        {
+            ehdr->e_phnum = 2;
+            phdr[1] = extra.value();
+        }
+
+        for (Word addr = ADDR; addr < ADDR + FILESZ; addr += 4)
+        {
+            Word word = Pattern(addr);
+            std::memcpy(file.data() + OFFSET + (addr - ADDR), &word, sizeof(word));
+        }
+
+        char name[] = "/tmp/riscv_sim_memory_XXXXXX";
+        int fd = mkstemp(name);
+        REQUIRE(fd >= 0);
+        REQUIRE(write(fd, file.data(), file.size()) == ssize_t(file.size()));
+        close(fd);
+        return name;
+    }
+}
+
+TEST_SUITE("Memory"){
+    TEST_CASE("LoadElf"){
+        std::string name = WriteElf();
+        auto mem = std::make_unique<Memory>();
+        std::vector<Memory::Segment> segments;
+        REQUIRE(mem->LoadElf(name, &segments));
+
+        REQUIRE_EQ(segments.size(), 1);
+        CHECK_EQ(segments[0].addr, ADDR);
+        CHECK_EQ(segments[0].size, MEMSZ);
+        CHECK(segments[0].executable);
+
+        for (Word addr = ADDR; addr < ADDR + FILESZ; addr += 4)
+            REQUIRE_EQ(mem->Request(addr), Pattern(addr));
+        CHECK_EQ(mem->Request(ADDR - 4), 0);
+        CHECK_EQ(mem->Request(ADDR + FILESZ), 0);
+        CHECK_EQ(mem->Request(0xfffffffc), 0);
+
+        // Mapped pages are private, stores must not reach the file
+        mem->Store(ADDR + 0x1000, 42);
+        CHECK_EQ(mem->Request(ADDR + 0x1000), 42);
+        auto other = std::make_unique<Memory>();
+        REQUIRE(other->LoadElf(name));
+        CHECK_EQ(other->Request(ADDR + 0x1000), Pattern(ADDR + 0x1000));
+
+        std::remove(name.c_str());
+    }
+
+    TEST_CASE("ResetToImage"){
+        std::string name = WriteElf();
+        auto mem = std::make_unique<Memory>();
+        REQUIRE(mem->LoadElf(name));
+        std::remove(name.c_str());
+
+        const std::vector<Word> addrs = {
+                ADDR,               // copied head
+                ADDR + 0x1000,      // mapped page
+                ADDR + FILESZ + 4,  // copied tail and bss
+                ADDR + 0x2ff0,      // bss
+                0x80000000,         // outside of the image
+        };
+        CHECK_FALSE(mem->IsDirty(ADDR));
+        for (Word addr : addrs)
+            mem->Store(addr, 0xdeadbeef);
+        for (Word addr : addrs)
+            CHECK(mem->IsDirty(addr));
+        CHECK_FALSE(mem->IsDirty(0x40000000));
+
+        mem->ResetToImage();
+        for (Word addr : addrs)
+            CHECK_FALSE(mem->IsDirty(addr));
+        for (Word addr = ADDR - 0x1000; addr < ADDR + MEMSZ + 0x1000; addr += 4)
+        {
+            Word expected = addr >= ADDR && addr < ADDR + FILESZ ? Pattern(addr) : 0;
+            REQUIRE_EQ(mem->Request(addr), expected);
+        }
+        CHECK_EQ(mem->Request(0x80000000), 0);
+    }
+
+    TEST_CASE("LoadElf drops the previous program"){
+        std::string name = WriteElf();
+        // the second segment reaches past the end of the file
+        Elf32_Phdr extra = Segment();
+        extra.p_paddr = 0x80000000;
+        extra.p_filesz = FILESZ + 4;
+        std::string broken = WriteElf(extra);
+        auto mem = std::make_unique<Memory>();
+        mem->Store(0x40000000, 1);
+        REQUIRE(mem->LoadElf(name));
+        CHECK_EQ(mem->Request(0x40000000), 0);
+        mem->Store(0x40000000, 2);
+        mem->Store(ADDR, 3);
+
+        REQUIRE(mem->LoadElf(name));
+        CHECK_EQ(mem->Request(0x40000000), 0);
+        CHECK_EQ(mem->Request(ADDR), Pattern(ADDR));
+        CHECK_FALSE(mem->IsDirty(0x40000000));
+
+        // the first segment of the broken file is loaded, then dropped
+        CHECK_FALSE(mem->LoadElf(broken));
+        CHECK_EQ(mem->Request(ADDR), 0);
+        CHECK(mem->UsedPages().empty());
+        mem->Store(ADDR, 4);
+        mem->ResetToImage();
+        CHECK_EQ(mem->Request(ADDR), 0);
+
+        std::remove(name.c_str());
+        std::remove(broken.c_str());
+    }
+
+    TEST_CASE("LoadElf rejects segments that wrap around"){
+        auto mem = std::make_unique<Memory>();
+
+        // past the end of the address space
+        Elf32_Phdr extra = Segment();
+        extra.p_paddr = 0xfffff000;
+        extra.p_filesz = 0;
+        extra.p_memsz = 0x2000;
+        std::string name = WriteElf(extra);
+        CHECK_FALSE(mem->LoadElf(name));
+        std::remove(name.c_str());
+
+        // past the end of the file
+        extra = Segment();
+        extra.p_paddr = 0x80000000;
+        extra.p_offset = 0xffffff00;
+        extra.p_filesz = 0x200;
+        name = WriteElf(extra);
+        CHECK_FALSE(mem->LoadElf(name));
+        std::remove(name.c_str());
+    }
+}
@@ -0,0 +1,147 @@
+#include "doctest.h"
+
+#include "PipelineTiming.h"
+#include "OutOfOrderTiming.h"
+#include "IntervalTiming.h"
+
+namespace
+{
+    Instruction Alu(RId dst, RId src1, RId src2, AluFunc func = AluFunc::Add)
+    {
+        Instruction instr;
+        instr._type = IType::Alu;
+        instr._aluFunc = func;
+        instr._dst = dst;
+        instr.SetSrc1(src1);
+        instr.SetSrc2(src2);
+        return instr;
+    }
+
+    Instruction Load(RId dst, RId base)
+    {
+        Instruction instr;
+        instr._type = IType::Ld;
+        instr._dst = dst;
+        instr.SetSrc1(base);
+        instr.SetImm(0);
+        instr._addr = 0x1000;
+        return instr;
+    }
+
+    Instruction Branch(RId src1, Word nextIp)
+    {
+        Instruction instr;
+        instr._type = IType::Br;
+        instr._brFunc = BrFunc::Neq;
+        instr.SetSrc1(src1);
+        instr.SetSrc2(0);
+        instr._nextIp = nextIp;
+        return instr;
+    }
+
+    uint64_t Run(PipelineTiming::Config config, const std::vector<Instruction>& trace)
+    {
+        PipelineTiming pipeline{config, nullptr, nullptr, nullptr};
+        Word ip = 0x200;
+        for (const Instruction& instr : trace)
+        {
+            pipeline.Retire(instr, ip);
+            ip += 4;
+        }
+        return pipeline.Cycles();
+    }
+}
+
+TEST_SUITE("PipelineTiming"){
+    TEST_CASE("Forwarding"){
+        // independent instructions fill the pipeline and retire one per cycle
+        PipelineTiming::Config full;
+        CHECK_EQ(Run(full, {Alu(1, 2, 3), Alu(4, 5, 6), Alu(7, 8, 9)}), 3 + 4);
+        CHECK_EQ(Run(full, {Alu(1, 2, 3), Alu(4, 1, 1)}), 2 + 4);
+        CHECK_EQ(Run(full, {Load(1, 2), Alu(4, 1, 1)}), 2 + 4 + 1);
+
+        PipelineTiming::Config none;
+        none.forwarding = PipelineTiming::Forwarding::None;
+        CHECK_EQ(Run(none, {Alu(1, 2, 3), Alu(4, 1, 1)}), 2 + 4 + 2);
+        CHECK_EQ(Run(none, {Load(1, 2), Alu(4, 1, 1)}), 2 + 4 + 2);
+
+        PipelineTiming::Config ex;
+        ex.forwarding = PipelineTiming::Forwarding::Ex;
+        CHECK_EQ(Run(ex, {Alu(1, 2, 3), Alu(4, 1, 1)}), 2 + 4);
+        CHECK_EQ(Run(ex, {Load(1, 2), Alu(4, 1, 1)}), 2 + 4 + 2);
+    }
+
+    TEST_CASE("Branches and multi-cycle units"){
+        PipelineTiming::Config config;
+        CHECK_EQ(Run(config, {Branch(1, 0x204), Alu(4, 5, 6)}), 2 + 4);
+        CHECK_EQ(Run(config, {Branch(1, 0x300), Alu(4, 5, 6)}), 2 + 4 + 2);
+        config.resolve = PipelineTiming::Decode;
+        CHECK_EQ(Run(config, {Branch(1, 0x300), Alu(4, 5, 6)}), 2 + 4 + 1);
+
+        PipelineTiming pipeline{PipelineTiming::Config{}, nullptr, nullptr, nullptr};
+        pipeline.Retire(Alu(1, 2, 3, AluFunc::Mul), 0x200);
+        pipeline.Retire(Alu(4, 5, 6), 0x204);
+        pipeline.Retire(Alu(7, 1, 4), 0x208);
+        CHECK_EQ(pipeline.Cycles(), 3 + 4 + 2);
+        CHECK_EQ(pipeline.GetStalls(PipelineTiming::Structural), 2);
+        CHECK_EQ(pipeline.Counter(3 + PipelineTiming::Structural), 2);
+        CHECK_EQ(pipeline.GetStalls(PipelineTiming::Data), 0);
+    }
+}
+
+TEST_SUITE("OutOfOrderTiming"){
+    TEST_CASE("Width and dependences bound IPC"){
+        OutOfOrderTiming independent{OutOfOrderTiming::Config{}, nullptr, nullptr, nullptr};
+        OutOfOrderTiming chain{OutOfOrderTiming::Config{}, nullptr, nullptr, nullptr};
+        for (Word i = 0; i < 400; i++)
+        {
+            independent.Retire(Alu(RId(1 + i % 8), 0, 0), 0x200 + 4 * i);
+            chain.Retire(Alu(1, 1, 1), 0x200 + 4 * i);
+        }
+        CHECK_LT(independent.Cycles(), 110);
+        CHECK_GE(independent.Cycles(), 100);
+        CHECK_GE(chain.Cycles(), 400);
+        CHECK_LT(chain.Cycles(), 410);
+    }
+
+    TEST_CASE("Long latency fills the ROB"){
+        OutOfOrderTiming::Config config;
+        config.robSize = 8;
+        OutOfOrderTiming core{config, nullptr, nullptr, nullptr};
+        core.Retire(Alu(1, 2, 3, AluFunc::Div), 0x200);
+        for (Word i = 1; i < 20; i++)
+            core.Retire(Alu(4, 5, 6), 0x200 + 4 * i);
+        CHECK_GT(core.GetStalls(OutOfOrderTiming::RobFull), 0);
+        CHECK_EQ(core.Counter(3 + OutOfOrderTiming::RobFull), core.GetStalls(OutOfOrderTiming::RobFull));
+        CHECK_GE(core.Cycles(), config.divLatency);
+    }
+}
+
+TEST_SUITE("IntervalTiming"){
+    TEST_CASE("Parse"){
+        auto config = IntervalTiming::Parse("width=2,depth=0,resolve=1", "test");
+        REQUIRE(config);
+        CHECK_EQ(config->width, 2);
+        CHECK_EQ(config->frontendDepth, 0);
+        // a mispredict costs at least the cycle of its fetch group
+        CHECK_FALSE(IntervalTiming::Parse("depth=0,resolve=0", "test"));
+        CHECK_FALSE(IntervalTiming::Parse("rob=0", "test"));
+    }
+
+    TEST_CASE("Dispatch width and penalties"){
+        IntervalTiming::Config config;
+        IntervalTiming core{config, nullptr, nullptr, nullptr};
+        for (Word i = 0; i < 400; i++)
+            core.Retire(Alu(RId(1 + i % 8), 0, 0), 0x200 + 4 * i);
+        Word fill = config.frontendDepth + config.resolveLatency;
+        CHECK_EQ(core.Cycles(), 100 + fill);
+
+        // a taken branch without a predictor mispredicts, a divide outlasts
+        // what the ROB hides
+        core.Retire(Branch(1, 0x200), 0x840);
+        core.Retire(Alu(1, 2, 3, AluFunc::Div), 0x200);
+        CHECK_EQ(core.GetPenalty(IntervalTiming::Mispredict), fill - 1);
+        CHECK_EQ(core.GetPenalty(IntervalTiming::LongLatency), config.divLatency - config.robSize / config.width);
+        CHECK_EQ(core.Counter(3 + IntervalTiming::LongLatency), core.GetPenalty(IntervalTiming::LongLatency));
+    }
+}